@@ -0,0 +1,833 @@
+package main
+
+import (
+    "crypto/cipher"
+    "encoding/binary"
+    "errors"
+    "fmt"
+    "log"
+    "net"
+    "os"
+    "runtime"
+    "strings"
+    "sync"
+    "sync/atomic"
+    "unsafe"
+    
+    "github.com/cilium/ebpf"
+    "golang.org/x/crypto/chacha20poly1305"
+    "golang.org/x/sys/unix"
+)
+
+// AF_XDP userspace data plane. xdp_vpn_filter redirects WireGuard UDP into
+// xsks_map; one thread per RX queue, pinned to that queue's CPU, decrypts
+// straight out of UMEM and encrypts outbound packets into free frames of
+// the same UMEM.
+const (
+    xskFrameSize       = 4096
+    xskDefaultFrames   = 4096
+    xskRingSize        = 2048
+    xskBatchSize       = 64
+    xskTxQueueLen      = 1024
+    
+    wgMessageData      = 4
+    wgDataHeaderLen    = 16
+    wgMinDataLen       = wgDataHeaderLen + chacha20poly1305.Overhead
+    wgRejectAfterMsgs  = ^uint64(0) - 8192 - 1
+    
+    replayBlockBits    = 64
+    replayRingBlocks   = 128
+    replayWindow       = (replayRingBlocks - 1) * replayBlockBits
+    
+    ethHeaderLen       = 14
+    ipv4HeaderLen      = 20
+    ipv6HeaderLen      = 40
+    udpHeaderLen       = 8
+)
+
+// AFXDPConfig selects the interface, queues and polling mode
+type AFXDPConfig struct {
+    Interface      string
+    Queues         []int // RX queues to bind; all queues if empty
+    CPUs           []int // CPU for each entry of Queues; queue id modulo CPU count if empty
+    FramesPerQueue int
+    ZeroCopy       bool
+    BusyPollBudget int   // packets per busy poll; 0 sleeps in poll(2)
+    
+    // Receives decrypted inner packets; the slice is only valid for the call
+    Deliver   func(session *XSKSession, packet []byte)
+    // Receives handshake and cookie messages for the userspace Noise handler
+    Handshake func(msg []byte, from *net.UDPAddr)
+}
+
+// XSKSession is one keypair installed by the userspace handshake
+type XSKSession struct {
+    Peer        *Peer
+    remoteIndex uint32
+    recv        cipher.AEAD
+    send        cipher.AEAD
+    sendCounter atomic.Uint64
+    
+    mu          sync.Mutex
+    replay      replayFilter
+    header      []byte // reply eth/ip/udp header, relearned from each valid packet
+    queue       *xskQueue
+}
+
+// Sliding replay window over a ring of 64-bit blocks, as in WireGuard
+type replayFilter struct {
+    last uint64
+    ring [replayRingBlocks]uint64
+}
+
+func (f *replayFilter) validate(counter uint64) bool {
+    if counter >= wgRejectAfterMsgs {
+        return false
+    }
+    
+    block := counter / replayBlockBits
+    if counter > f.last {
+        current := f.last / replayBlockBits
+        diff := block - current
+        if diff > replayRingBlocks {
+            diff = replayRingBlocks
+        }
+        for i := current + 1; i <= current+diff; i++ {
+            f.ring[i%replayRingBlocks] = 0
+        }
+        f.last = counter
+    } else if f.last-counter > replayWindow {
+        return false
+    }
+    
+    bit := uint64(1) << (counter % replayBlockBits)
+    old := f.ring[block%replayRingBlocks]
+    f.ring[block%replayRingBlocks] = old | bit
+    return old&bit == 0
+}
+
+// Single-producer/single-consumer ring shared with the kernel
+type xskRing struct {
+    mem      []byte
+    producer *uint32
+    consumer *uint32
+    flags    *uint32
+    descs    unsafe.Pointer
+    mask     uint32
+    size     uint32
+    cached   uint32 // our side: producer for fill/tx, consumer for rx/comp
+}
+
+func (r *xskRing) addr(i uint32) *uint64 {
+    return (*uint64)(unsafe.Add(r.descs, int(i&r.mask)*8))
+}
+
+func (r *xskRing) desc(i uint32) *unix.XDPDesc {
+    return (*unix.XDPDesc)(unsafe.Add(r.descs, int(i&r.mask)*int(unsafe.Sizeof(unix.XDPDesc{}))))
+}
+
+// Free slots on a ring we produce into
+func (r *xskRing) free() uint32 {
+    return r.size - (r.cached - atomic.LoadUint32(r.consumer))
+}
+
+// Filled slots on a ring we consume from
+func (r *xskRing) ready(max uint32) uint32 {
+    n := atomic.LoadUint32(r.producer) - r.cached
+    if n > max {
+        n = max
+    }
+    return n
+}
+
+func (r *xskRing) submit(n uint32) {
+    r.cached += n
+    atomic.StoreUint32(r.producer, r.cached)
+}
+
+func (r *xskRing) release(n uint32) {
+    r.cached += n
+    atomic.StoreUint32(r.consumer, r.cached)
+}
+
+func (r *xskRing) needWakeup() bool {
+    return atomic.LoadUint32(r.flags)&unix.XDP_RING_NEED_WAKEUP != 0
+}
+
+type xskTxRequest struct {
+    session *XSKSession
+    packets [][]byte
+}
+
+// One AF_XDP socket and its UMEM, owned by a single pinned thread
+type xskQueue struct {
+    engine *AFXDPEngine
+    id     int
+    cpu    int
+    fd     int
+    umem   []byte
+    fill   xskRing
+    comp   xskRing
+    rx     xskRing
+    tx     xskRing
+    frames []uint64 // frames owned by userspace, available for TX
+    txq    chan xskTxRequest
+}
+
+// AFXDPEngine runs the userspace data plane across the bound RX queues
+type AFXDPEngine struct {
+    cfg      AFXDPConfig
+    ifindex  int
+    xsks     *ebpf.Map
+    queues   []*xskQueue
+    sessions sync.Map // local receiver index -> *XSKSession
+    stop     atomic.Bool
+    wg       sync.WaitGroup
+    
+    RxPackets atomic.Uint64
+    TxPackets atomic.Uint64
+    Dropped   atomic.Uint64
+}
+
+// Create AF_XDP sockets for every configured queue and publish them in xsks_map
+func NewAFXDPEngine(cfg AFXDPConfig, xsks *ebpf.Map) (*AFXDPEngine, error) {
+    iface, err := net.InterfaceByName(cfg.Interface)
+    if err != nil {
+        return nil, fmt.Errorf("AF_XDP interface %s: %w", cfg.Interface, err)
+    }
+    
+    if cfg.FramesPerQueue <= 0 {
+        cfg.FramesPerQueue = xskDefaultFrames
+    }
+    if len(cfg.Queues) == 0 {
+        for q := 0; q < rxQueueCount(cfg.Interface); q++ {
+            cfg.Queues = append(cfg.Queues, q)
+        }
+    }
+    
+    if len(cfg.CPUs) != 0 && len(cfg.CPUs) != len(cfg.Queues) {
+        return nil, fmt.Errorf("AF_XDP: %d CPUs for %d queues", len(cfg.CPUs), len(cfg.Queues))
+    }
+    
+    e := &AFXDPEngine{cfg: cfg, ifindex: iface.Index, xsks: xsks}
+    for i, id := range cfg.Queues {
+        q, err := e.openQueue(id)
+        if err != nil {
+            e.Close()
+            return nil, fmt.Errorf("AF_XDP queue %d: %w", id, err)
+        }
+        // Drivers usually spread queue IRQs one per CPU in order; pass
+        // CPUs when irqbalance or a manual smp_affinity says otherwise
+        q.cpu = id % runtime.NumCPU()
+        if len(cfg.CPUs) != 0 {
+            q.cpu = cfg.CPUs[i]
+        }
+        e.queues = append(e.queues, q)
+        
+        if err := xsks.Update(uint32(id), uint32(q.fd), ebpf.UpdateAny); err != nil {
+            e.Close()
+            return nil, fmt.Errorf("failed to register XSK for queue %d: %w", id, err)
+        }
+    }
+    
+    return e, nil
+}
+
+// Number of RX queues the NIC exposes, falling back to one per CPU
+func rxQueueCount(ifname string) int {
+    entries, err := os.ReadDir("/sys/class/net/" + ifname + "/queues")
+    if err != nil {
+        return runtime.NumCPU()
+    }
+    
+    n := 0
+    for _, e := range entries {
+        if strings.HasPrefix(e.Name(), "rx-") {
+            n++
+        }
+    }
+    if n == 0 {
+        return 1
+    }
+    return n
+}
+
+func (e *AFXDPEngine) openQueue(id int) (*xskQueue, error) {
+    fd, err := unix.Socket(unix.AF_XDP, unix.SOCK_RAW|unix.SOCK_CLOEXEC, 0)
+    if err != nil {
+        return nil, err
+    }
+    q := &xskQueue{engine: e, id: id, fd: fd, txq: make(chan xskTxRequest, xskTxQueueLen)}
+    
+    size := e.cfg.FramesPerQueue * xskFrameSize
+    q.umem, err = unix.Mmap(-1, 0, size, unix.PROT_READ|unix.PROT_WRITE,
+        unix.MAP_PRIVATE|unix.MAP_ANONYMOUS|unix.MAP_POPULATE)
+    if err != nil {
+        q.close()
+        return nil, err
+    }
+    
+    reg := unix.XDPUmemReg{
+        Addr: uint64(uintptr(unsafe.Pointer(&q.umem[0]))),
+        Len:  uint64(size),
+        Size: xskFrameSize,
+    }
+    if err := setsockoptRaw(fd, unix.XDP_UMEM_REG, unsafe.Pointer(&reg), unsafe.Sizeof(reg)); err != nil {
+        q.close()
+        return nil, fmt.Errorf("UMEM registration: %w", err)
+    }
+    
+    for _, opt := range []int{unix.XDP_UMEM_FILL_RING, unix.XDP_UMEM_COMPLETION_RING,
+        unix.XDP_RX_RING, unix.XDP_TX_RING} {
+        if err := unix.SetsockoptInt(fd, unix.SOL_XDP, opt, xskRingSize); err != nil {
+            q.close()
+            return nil, fmt.Errorf("ring setup: %w", err)
+        }
+    }
+    
+    var off unix.XDPMmapOffsets
+    offLen := uint32(unsafe.Sizeof(off))
+    if _, _, errno := unix.Syscall6(unix.SYS_GETSOCKOPT, uintptr(fd), unix.SOL_XDP,
+        unix.XDP_MMAP_OFFSETS, uintptr(unsafe.Pointer(&off)), uintptr(unsafe.Pointer(&offLen)), 0); errno != 0 {
+        q.close()
+        return nil, fmt.Errorf("ring offsets: %w", errno)
+    }
+    
+    rings := []struct {
+        ring  *xskRing
+        off   unix.XDPRingOffset
+        pgoff int64
+        esize uintptr
+    }{
+        {&q.fill, off.Fr, unix.XDP_UMEM_PGOFF_FILL_RING, 8},
+        {&q.comp, off.Cr, unix.XDP_UMEM_PGOFF_COMPLETION_RING, 8},
+        {&q.rx, off.Rx, unix.XDP_PGOFF_RX_RING, unsafe.Sizeof(unix.XDPDesc{})},
+        {&q.tx, off.Tx, unix.XDP_PGOFF_TX_RING, unsafe.Sizeof(unix.XDPDesc{})},
+    }
+    for _, r := range rings {
+        if err := mmapRing(fd, r.ring, r.off, r.pgoff, r.esize); err != nil {
+            q.close()
+            return nil, err
+        }
+    }
+    
+    // Half the frames wait on the fill ring for RX, the rest are ours for TX
+    nframes := uint32(e.cfg.FramesPerQueue)
+    nfill := nframes / 2
+    if nfill > xskRingSize {
+        nfill = xskRingSize
+    }
+    for i := uint32(0); i < nfill; i++ {
+        *q.fill.addr(q.fill.cached + i) = uint64(i) * xskFrameSize
+    }
+    q.fill.submit(nfill)
+    for i := nfill; i < nframes; i++ {
+        q.frames = append(q.frames, uint64(i)*xskFrameSize)
+    }
+    
+    flags := uint16(unix.XDP_USE_NEED_WAKEUP)
+    if e.cfg.ZeroCopy {
+        flags |= unix.XDP_ZEROCOPY
+    } else {
+        flags |= unix.XDP_COPY
+    }
+    if err := unix.Bind(fd, &unix.SockaddrXDP{Flags: flags, Ifindex: uint32(e.ifindex),
+        QueueID: uint32(id)}); err != nil {
+        q.close()
+        return nil, fmt.Errorf("bind: %w", err)
+    }
+    
+    if e.cfg.BusyPollBudget > 0 {
+        // Let this queue's thread drive NAPI instead of waiting for IRQs
+        unix.SetsockoptInt(fd, unix.SOL_SOCKET, unix.SO_PREFER_BUSY_POLL, 1)
+        unix.SetsockoptInt(fd, unix.SOL_SOCKET, unix.SO_BUSY_POLL, 20)
+        unix.SetsockoptInt(fd, unix.SOL_SOCKET, unix.SO_BUSY_POLL_BUDGET, e.cfg.BusyPollBudget)
+    }
+    
+    return q, nil
+}
+
+func setsockoptRaw(fd, opt int, val unsafe.Pointer, size uintptr) error {
+    _, _, errno := unix.Syscall6(unix.SYS_SETSOCKOPT, uintptr(fd), unix.SOL_XDP,
+        uintptr(opt), uintptr(val), size, 0)
+    if errno != 0 {
+        return errno
+    }
+    return nil
+}
+
+func mmapRing(fd int, r *xskRing, off unix.XDPRingOffset, pgoff int64, esize uintptr) error {
+    length := int(off.Desc) + xskRingSize*int(esize)
+    mem, err := unix.Mmap(fd, pgoff, length, unix.PROT_READ|unix.PROT_WRITE,
+        unix.MAP_SHARED|unix.MAP_POPULATE)
+    if err != nil {
+        return fmt.Errorf("ring mmap: %w", err)
+    }
+    
+    base := unsafe.Pointer(&mem[0])
+    r.mem = mem
+    r.producer = (*uint32)(unsafe.Add(base, int(off.Producer)))
+    r.consumer = (*uint32)(unsafe.Add(base, int(off.Consumer)))
+    r.flags = (*uint32)(unsafe.Add(base, int(off.Flags)))
+    r.descs = unsafe.Add(base, int(off.Desc))
+    r.size = xskRingSize
+    r.mask = xskRingSize - 1
+    return nil
+}
+
+func (q *xskQueue) close() {
+    for _, r := range []*xskRing{&q.fill, &q.comp, &q.rx, &q.tx} {
+        if r.mem != nil {
+            unix.Munmap(r.mem)
+        }
+    }
+    if q.umem != nil {
+        unix.Munmap(q.umem)
+    }
+    unix.Close(q.fd)
+}
+
+// Start one locked OS thread per queue
+func (e *AFXDPEngine) Start() {
+    for _, q := range e.queues {
+        e.wg.Add(1)
+        go q.run()
+    }
+}
+
+// Stop the queue threads and release sockets, UMEM and xsks_map slots
+func (e *AFXDPEngine) Close() {
+    e.stop.Store(true)
+    e.wg.Wait()
+    for _, q := range e.queues {
+        e.xsks.Delete(uint32(q.id))
+        q.close()
+    }
+    e.queues = nil
+}
+
+// XSKEndpoint is the outer path a session sends on before anything has
+// arrived: both UDP addresses, the Ethernet addresses of this hop and the
+// bound queue to transmit from
+type XSKEndpoint struct {
+    Local     *net.UDPAddr
+    Remote    *net.UDPAddr
+    LocalMAC  net.HardwareAddr
+    RemoteMAC net.HardwareAddr // the peer, or the gateway towards it
+    Queue     int
+}
+
+// Install a keypair negotiated by the userspace handshake. The reply
+// header is built from ep, so the initiator can send first; it is then
+// relearned from every authenticated packet, which follows roaming.
+func (e *AFXDPEngine) AddSession(peer *Peer, localIndex, remoteIndex uint32,
+    recvKey, sendKey []byte, ep XSKEndpoint) (*XSKSession, error) {
+    var q *xskQueue
+    for _, bound := range e.queues {
+        if bound.id == ep.Queue {
+            q = bound
+        }
+    }
+    if q == nil {
+        return nil, fmt.Errorf("AF_XDP queue %d is not bound", ep.Queue)
+    }
+    header, err := buildHeader(ep)
+    if err != nil {
+        return nil, err
+    }
+    
+    recv, err := chacha20poly1305.New(recvKey)
+    if err != nil {
+        return nil, err
+    }
+    send, err := chacha20poly1305.New(sendKey)
+    if err != nil {
+        return nil, err
+    }
+    
+    s := &XSKSession{Peer: peer, remoteIndex: remoteIndex, recv: recv, send: send,
+        header: header, queue: q}
+    e.sessions.Store(localIndex, s)
+    return s, nil
+}
+
+// Outer Ethernet/IP/UDP header towards ep; lengths and checksums are
+// filled in per packet by fixupHeaders
+func buildHeader(ep XSKEndpoint) ([]byte, error) {
+    if ep.Local == nil || ep.Remote == nil || len(ep.LocalMAC) != 6 || len(ep.RemoteMAC) != 6 {
+        return nil, errors.New("AF_XDP endpoint needs both UDP addresses and MACs")
+    }
+    
+    var h []byte
+    src4, dst4 := ep.Local.IP.To4(), ep.Remote.IP.To4()
+    switch {
+    case src4 != nil && dst4 != nil:
+        h = make([]byte, ethHeaderLen+ipv4HeaderLen+udpHeaderLen)
+        binary.BigEndian.PutUint16(h[12:14], unix.ETH_P_IP)
+        ip := h[ethHeaderLen:]
+        ip[0] = 0x45
+        binary.BigEndian.PutUint16(ip[6:8], 0x4000) // DF
+        ip[8] = 64
+        ip[9] = unix.IPPROTO_UDP
+        copy(ip[12:16], src4)
+        copy(ip[16:20], dst4)
+    case src4 == nil && dst4 == nil && len(ep.Local.IP) == net.IPv6len && len(ep.Remote.IP) == net.IPv6len:
+        h = make([]byte, ethHeaderLen+ipv6HeaderLen+udpHeaderLen)
+        binary.BigEndian.PutUint16(h[12:14], unix.ETH_P_IPV6)
+        ip := h[ethHeaderLen:]
+        ip[0] = 0x60
+        ip[6] = unix.IPPROTO_UDP
+        ip[7] = 64
+        copy(ip[8:24], ep.Local.IP)
+        copy(ip[24:40], ep.Remote.IP)
+    default:
+        return nil, errors.New("AF_XDP endpoint addresses must share a family")
+    }
+    
+    copy(h[0:6], ep.RemoteMAC)
+    copy(h[6:12], ep.LocalMAC)
+    udp := h[len(h)-udpHeaderLen:]
+    binary.BigEndian.PutUint16(udp[0:2], uint16(ep.Local.Port))
+    binary.BigEndian.PutUint16(udp[2:4], uint16(ep.Remote.Port))
+    return h, nil
+}
+
+func (e *AFXDPEngine) RemoveSession(localIndex uint32) {
+    e.sessions.Delete(localIndex)
+}
+
+// Queue packets for encryption on the session's queue: the one given to
+// AddSession until a packet arrives, then the one it last arrived on.
+// The engine owns the packet slices until they are sent.
+func (e *AFXDPEngine) Send(s *XSKSession, packets [][]byte) error {
+    s.mu.Lock()
+    q := s.queue
+    s.mu.Unlock()
+    
+    select {
+    case q.txq <- xskTxRequest{session: s, packets: packets}:
+        return nil
+    default:
+        e.Dropped.Add(uint64(len(packets)))
+        return errors.New("AF_XDP transmit queue full")
+    }
+}
+
+func (q *xskQueue) run() {
+    defer q.engine.wg.Done()
+    
+    // Keep the queue on one core so UMEM and session state stay cache-hot
+    runtime.LockOSThread()
+    defer runtime.UnlockOSThread()
+    
+    var set unix.CPUSet
+    set.Set(q.cpu)
+    if err := unix.SchedSetaffinity(0, &set); err != nil {
+        log.Printf("AF_XDP queue %d: pinning to CPU %d failed: %v", q.id, q.cpu, err)
+    }
+    
+    pfd := []unix.PollFd{{Fd: int32(q.fd), Events: unix.POLLIN}}
+    busy := q.engine.cfg.BusyPollBudget > 0
+    
+    for !q.engine.stop.Load() {
+        n := q.receive()
+        n += q.transmit()
+        q.complete()
+        
+        if n > 0 {
+            continue
+        }
+        if busy {
+            // recvfrom on an AF_XDP socket runs a busy poll of its NAPI
+            unix.Recvfrom(q.fd, nil, unix.MSG_DONTWAIT)
+        } else {
+            unix.Poll(pfd, 100)
+        }
+    }
+}
+
+func (q *xskQueue) receive() int {
+    n := q.rx.ready(xskBatchSize)
+    if n == 0 {
+        if q.fill.needWakeup() {
+            unix.Recvfrom(q.fd, nil, unix.MSG_DONTWAIT)
+        }
+        return 0
+    }
+    
+    var recycle [xskBatchSize]uint64
+    for i := uint32(0); i < n; i++ {
+        d := q.rx.desc(q.rx.cached + i)
+        q.engine.handleFrame(q, q.umem[d.Addr:d.Addr+uint64(d.Len)])
+        recycle[i] = d.Addr &^ (xskFrameSize - 1)
+    }
+    q.rx.release(n)
+    q.engine.RxPackets.Add(uint64(n))
+    
+    // Frames go straight back to the fill ring; overflow is kept for TX
+    free := q.fill.free()
+    for i := uint32(0); i < n; i++ {
+        if i < free {
+            *q.fill.addr(q.fill.cached + i) = recycle[i]
+        } else {
+            q.frames = append(q.frames, recycle[i])
+        }
+    }
+    if free > n {
+        free = n
+    }
+    q.fill.submit(free)
+    
+    return int(n)
+}
+
+// Split a frame into its outer headers and WireGuard message
+func parseFrame(frame []byte) (hdrLen int, msg []byte, from *net.UDPAddr, ok bool) {
+    if len(frame) < ethHeaderLen {
+        return 0, nil, nil, false
+    }
+    
+    var ip net.IP
+    switch binary.BigEndian.Uint16(frame[12:14]) {
+    case unix.ETH_P_IP:
+        if len(frame) < ethHeaderLen+ipv4HeaderLen {
+            return 0, nil, nil, false
+        }
+        ihl := int(frame[ethHeaderLen]&0x0f) * 4
+        if ihl != ipv4HeaderLen || frame[ethHeaderLen+9] != unix.IPPROTO_UDP {
+            return 0, nil, nil, false
+        }
+        ip = net.IP(frame[ethHeaderLen+12 : ethHeaderLen+16])
+        hdrLen = ethHeaderLen + ipv4HeaderLen + udpHeaderLen
+    case unix.ETH_P_IPV6:
+        // XDP keeps frames with extension headers on the kernel path
+        if len(frame) < ethHeaderLen+ipv6HeaderLen || frame[ethHeaderLen+6] != unix.IPPROTO_UDP {
+            return 0, nil, nil, false
+        }
+        ip = net.IP(frame[ethHeaderLen+8 : ethHeaderLen+24])
+        hdrLen = ethHeaderLen + ipv6HeaderLen + udpHeaderLen
+    default:
+        return 0, nil, nil, false
+    }
+    
+    if len(frame) < hdrLen {
+        return 0, nil, nil, false
+    }
+    udp := frame[hdrLen-udpHeaderLen : hdrLen]
+    udpLen := int(binary.BigEndian.Uint16(udp[4:6]))
+    if udpLen < udpHeaderLen || hdrLen-udpHeaderLen+udpLen > len(frame) {
+        return 0, nil, nil, false
+    }
+    
+    from = &net.UDPAddr{IP: ip, Port: int(binary.BigEndian.Uint16(udp[0:2]))}
+    return hdrLen, frame[hdrLen : hdrLen-udpHeaderLen+udpLen], from, true
+}
+
+func (e *AFXDPEngine) handleFrame(q *xskQueue, frame []byte) {
+    hdrLen, msg, from, ok := parseFrame(frame)
+    if !ok || len(msg) < 4 {
+        e.Dropped.Add(1)
+        return
+    }
+    
+    if msg[0] != wgMessageData {
+        if e.cfg.Handshake != nil {
+            from.IP = append(net.IP(nil), from.IP...)
+            e.cfg.Handshake(append([]byte(nil), msg...), from)
+        }
+        return
+    }
+    
+    if len(msg) < wgMinDataLen {
+        e.Dropped.Add(1)
+        return
+    }
+    v, found := e.sessions.Load(binary.LittleEndian.Uint32(msg[4:8]))
+    if !found {
+        e.Dropped.Add(1)
+        return
+    }
+    s := v.(*XSKSession)
+    
+    // Decrypt in place inside the UMEM frame
+    counter := binary.LittleEndian.Uint64(msg[8:16])
+    var nonce [chacha20poly1305.NonceSize]byte
+    binary.LittleEndian.PutUint64(nonce[4:], counter)
+    plain, err := s.recv.Open(msg[wgDataHeaderLen:wgDataHeaderLen], nonce[:], msg[wgDataHeaderLen:], nil)
+    if err != nil {
+        e.Dropped.Add(1)
+        return
+    }
+    
+    // Only authenticated packets may move the window or the reply path
+    s.mu.Lock()
+    fresh := s.replay.validate(counter)
+    if fresh {
+        s.learnReplyHeader(frame[:hdrLen])
+        s.queue = q
+    }
+    s.mu.Unlock()
+    if !fresh {
+        e.Dropped.Add(1)
+        return
+    }
+    
+    s.Peer.RxBytes.Add(uint64(len(msg)))
+    if len(plain) > 0 && e.cfg.Deliver != nil {
+        e.cfg.Deliver(s, plain)
+    }
+}
+
+// Keep a copy of the incoming headers with addresses and ports swapped
+func (s *XSKSession) learnReplyHeader(hdr []byte) {
+    s.header = append(s.header[:0], hdr...)
+    h := s.header
+    
+    swap := func(a, b []byte) {
+        var tmp [16]byte
+        copy(tmp[:], a)
+        copy(a, b)
+        copy(b, tmp[:len(a)])
+    }
+    swap(h[0:6], h[6:12])
+    if len(h) == ethHeaderLen+ipv4HeaderLen+udpHeaderLen {
+        swap(h[ethHeaderLen+12:ethHeaderLen+16], h[ethHeaderLen+16:ethHeaderLen+20])
+    } else {
+        swap(h[ethHeaderLen+8:ethHeaderLen+24], h[ethHeaderLen+24:ethHeaderLen+40])
+    }
+    udp := h[len(h)-udpHeaderLen:]
+    swap(udp[0:2], udp[2:4])
+}
+
+func (q *xskQueue) transmit() int {
+    sent := uint32(0)
+    
+batch:
+    for sent < xskBatchSize {
+        var req xskTxRequest
+        select {
+        case req = <-q.txq:
+        default:
+            break batch
+        }
+        
+        for _, pkt := range req.packets {
+            if len(q.frames) == 0 || q.tx.free() <= sent {
+                q.engine.Dropped.Add(1)
+                continue
+            }
+            addr := q.frames[len(q.frames)-1]
+            n := req.session.seal(q.umem[addr:addr+xskFrameSize], pkt)
+            if n == 0 {
+                q.engine.Dropped.Add(1)
+                continue
+            }
+            q.frames = q.frames[:len(q.frames)-1]
+            
+            d := q.tx.desc(q.tx.cached + sent)
+            d.Addr = addr
+            d.Len = uint32(n)
+            d.Options = 0
+            sent++
+        }
+    }
+    
+    if sent == 0 {
+        return 0
+    }
+    q.tx.submit(sent)
+    q.engine.TxPackets.Add(uint64(sent))
+    if q.tx.needWakeup() {
+        unix.Sendto(q.fd, nil, unix.MSG_DONTWAIT, nil)
+    }
+    return int(sent)
+}
+
+// Build a full frame: reply headers, WireGuard header, sealed payload
+func (s *XSKSession) seal(frame, plain []byte) int {
+    s.mu.Lock()
+    hdrLen := copy(frame, s.header)
+    s.mu.Unlock()
+    if hdrLen == 0 {
+        return 0
+    }
+    
+    // Pad to 16 bytes like the kernel implementation
+    padded := (len(plain) + 15) &^ 15
+    total := hdrLen + wgDataHeaderLen + padded + chacha20poly1305.Overhead
+    if total > len(frame) {
+        return 0
+    }
+    
+    msg := frame[hdrLen:total]
+    counter := s.sendCounter.Add(1) - 1
+    binary.LittleEndian.PutUint32(msg[0:4], wgMessageData)
+    binary.LittleEndian.PutUint32(msg[4:8], s.remoteIndex)
+    binary.LittleEndian.PutUint64(msg[8:16], counter)
+    
+    body := msg[wgDataHeaderLen : wgDataHeaderLen+padded]
+    clear(body[copy(body, plain):])
+    var nonce [chacha20poly1305.NonceSize]byte
+    binary.LittleEndian.PutUint64(nonce[4:], counter)
+    s.send.Seal(body[:0], nonce[:], body, nil)
+    
+    fixupHeaders(frame, hdrLen, len(msg))
+    s.Peer.TxBytes.Add(uint64(len(msg)))
+    return total
+}
+
+// Rewrite lengths and checksums for a new UDP payload size
+func fixupHeaders(frame []byte, hdrLen, payload int) {
+    hdr := frame[:hdrLen]
+    udp := hdr[hdrLen-udpHeaderLen:]
+    udpLen := udpHeaderLen + payload
+    binary.BigEndian.PutUint16(udp[4:6], uint16(udpLen))
+    binary.BigEndian.PutUint16(udp[6:8], 0)
+    
+    ip := hdr[ethHeaderLen : hdrLen-udpHeaderLen]
+    if len(ip) == ipv4HeaderLen {
+        // IPv4 UDP checksum is optional; the IP header one is not
+        binary.BigEndian.PutUint16(ip[2:4], uint16(ipv4HeaderLen+udpLen))
+        binary.BigEndian.PutUint16(ip[10:12], 0)
+        binary.BigEndian.PutUint16(ip[10:12], checksumFold(checksumAdd(0, ip)))
+        return
+    }
+    
+    binary.BigEndian.PutUint16(ip[4:6], uint16(udpLen))
+    sum := checksumAdd(0, ip[8:40])
+    sum += uint32(udpLen) + unix.IPPROTO_UDP
+    sum = checksumAdd(sum, udp)
+    sum = checksumAdd(sum, frame[hdrLen:hdrLen+payload])
+    csum := checksumFold(sum)
+    if csum == 0 {
+        csum = 0xffff
+    }
+    binary.BigEndian.PutUint16(udp[6:8], csum)
+}
+
+func checksumAdd(sum uint32, b []byte) uint32 {
+    for len(b) >= 2 {
+        sum += uint32(b[0])<<8 | uint32(b[1])
+        b = b[2:]
+    }
+    if len(b) == 1 {
+        sum += uint32(b[0]) << 8
+    }
+    return sum
+}
+
+func checksumFold(sum uint32) uint16 {
+    for sum>>16 != 0 {
+        sum = sum&0xffff + sum>>16
+    }
+    return ^uint16(sum)
+}
+
+// Return transmitted frames to the TX pool
+func (q *xskQueue) complete() {
+    n := q.comp.ready(xskRingSize)
+    for i := uint32(0); i < n; i++ {
+        q.frames = append(q.frames, *q.comp.addr(q.comp.cached + i))
+    }
+    q.comp.release(n)
+}
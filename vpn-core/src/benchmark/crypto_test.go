@@ -0,0 +1,383 @@
+package benchmark
+
+import (
+    "crypto/cipher"
+    "crypto/hmac"
+    "crypto/rand"
+    "encoding/binary"
+    "errors"
+    "fmt"
+    "hash"
+    "testing"
+    "time"
+    
+    "golang.org/x/crypto/blake2s"
+    "golang.org/x/crypto/chacha20poly1305"
+    "golang.org/x/crypto/curve25519"
+)
+
+// Payload sizes for the AEAD benchmarks, from keepalive-sized to GSO-sized
+var aeadSizes = []int{64, 128, 256, 512, 1024, 1420, 4096, 16384, 65536}
+
+func BenchmarkChaCha20Poly1305Seal(b *testing.B) {
+    for _, size := range aeadSizes {
+        b.Run(fmt.Sprintf("size=%d", size), func(b *testing.B) {
+            aead := newBenchAEAD(b)
+            plaintext := make([]byte, size)
+            dst := make([]byte, 0, size+chacha20poly1305.Overhead)
+            var nonce [chacha20poly1305.NonceSize]byte
+            
+            b.SetBytes(int64(size))
+            b.ReportAllocs()
+            b.ResetTimer()
+            for i := 0; i < b.N; i++ {
+                binary.LittleEndian.PutUint64(nonce[4:], uint64(i))
+                dst = aead.Seal(dst[:0], nonce[:], plaintext, nil)
+            }
+        })
+    }
+}
+
+func BenchmarkChaCha20Poly1305Open(b *testing.B) {
+    for _, size := range aeadSizes {
+        b.Run(fmt.Sprintf("size=%d", size), func(b *testing.B) {
+            aead := newBenchAEAD(b)
+            var nonce [chacha20poly1305.NonceSize]byte
+            sealed := aead.Seal(nil, nonce[:], make([]byte, size), nil)
+            dst := make([]byte, 0, size)
+            
+            b.SetBytes(int64(size))
+            b.ReportAllocs()
+            b.ResetTimer()
+            for i := 0; i < b.N; i++ {
+                var err error
+                if dst, err = aead.Open(dst[:0], nonce[:], sealed, nil); err != nil {
+                    b.Fatal(err)
+                }
+            }
+        })
+    }
+}
+
+// Seal across all cores, one key per goroutine as with per-peer keys
+func BenchmarkChaCha20Poly1305SealParallel(b *testing.B) {
+    for _, size := range aeadSizes {
+        b.Run(fmt.Sprintf("size=%d", size), func(b *testing.B) {
+            b.SetBytes(int64(size))
+            b.ReportAllocs()
+            b.RunParallel(func(pb *testing.PB) {
+                aead := newBenchAEAD(b)
+                plaintext := make([]byte, size)
+                dst := make([]byte, 0, size+chacha20poly1305.Overhead)
+                var nonce [chacha20poly1305.NonceSize]byte
+                var counter uint64
+                
+                for pb.Next() {
+                    binary.LittleEndian.PutUint64(nonce[4:], counter)
+                    counter++
+                    dst = aead.Seal(dst[:0], nonce[:], plaintext, nil)
+                }
+            })
+        })
+    }
+}
+
+func BenchmarkChaCha20Poly1305OpenParallel(b *testing.B) {
+    for _, size := range aeadSizes {
+        b.Run(fmt.Sprintf("size=%d", size), func(b *testing.B) {
+            b.SetBytes(int64(size))
+            b.ReportAllocs()
+            b.RunParallel(func(pb *testing.PB) {
+                aead := newBenchAEAD(b)
+                var nonce [chacha20poly1305.NonceSize]byte
+                sealed := aead.Seal(nil, nonce[:], make([]byte, size), nil)
+                dst := make([]byte, 0, size)
+                
+                for pb.Next() {
+                    var err error
+                    if dst, err = aead.Open(dst[:0], nonce[:], sealed, nil); err != nil {
+                        b.Error(err)
+                        return
+                    }
+                }
+            })
+        })
+    }
+}
+
+// One op is a full Noise IK initiation, response and transport key derivation
+func BenchmarkNoiseIKHandshake(b *testing.B) {
+    initiator, responder := newNoisePeer(b), newNoisePeer(b)
+    
+    b.ReportAllocs()
+    b.ResetTimer()
+    for i := 0; i < b.N; i++ {
+        if err := noiseRoundTrip(initiator, responder); err != nil {
+            b.Fatal(err)
+        }
+    }
+}
+
+func BenchmarkNoiseIKHandshakeParallel(b *testing.B) {
+    b.ReportAllocs()
+    b.RunParallel(func(pb *testing.PB) {
+        initiator, responder := newNoisePeer(b), newNoisePeer(b)
+        for pb.Next() {
+            if err := noiseRoundTrip(initiator, responder); err != nil {
+                b.Error(err)
+                return
+            }
+        }
+    })
+}
+
+func newBenchAEAD(b testing.TB) cipher.AEAD {
+    aead, err := randomAEAD()
+    if err != nil {
+        b.Fatal(err)
+    }
+    return aead
+}
+
+func randomAEAD() (cipher.AEAD, error) {
+    key := make([]byte, chacha20poly1305.KeySize)
+    if _, err := rand.Read(key); err != nil {
+        return nil, err
+    }
+    return chacha20poly1305.New(key)
+}
+
+// WireGuard's Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s handshake, as in the
+// protocol paper, with an all-zero preshared key
+const (
+    noiseConstruction = "Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s"
+    noiseIdentifier   = "WireGuard v1 zx2c4 Jason@zx2c4.com"
+    noiseLabelMac1    = "mac1----"
+    
+    noiseInitiationBody = 116 // type through encrypted timestamp
+    noiseInitiationLen  = 148 // plus mac1 and mac2
+)
+
+type noisePeer struct {
+    private, public [32]byte
+}
+
+func newNoisePeer(b testing.TB) *noisePeer {
+    p, err := randomNoisePeer()
+    if err != nil {
+        b.Fatal(err)
+    }
+    return p
+}
+
+func randomNoisePeer() (*noisePeer, error) {
+    p := &noisePeer{}
+    if _, err := rand.Read(p.private[:]); err != nil {
+        return nil, err
+    }
+    curve25519.ScalarBaseMult(&p.public, &p.private)
+    return p, nil
+}
+
+// Chaining key and hash carried through the handshake
+type noiseState struct {
+    ck [32]byte
+    h  [32]byte
+}
+
+func newNoiseState(responderPublic []byte) noiseState {
+    var s noiseState
+    s.ck = blake2s.Sum256([]byte(noiseConstruction))
+    s.h = noiseHash(s.ck[:], []byte(noiseIdentifier))
+    s.h = noiseHash(s.h[:], responderPublic)
+    return s
+}
+
+func (s *noiseState) mixHash(data []byte) {
+    s.h = noiseHash(s.h[:], data)
+}
+
+// Mix public input into the chaining key
+func (s *noiseState) mixChain(input []byte) {
+    noiseKDF(s.ck[:], input, s.ck[:])
+}
+
+// Mix a DH result into the chaining key, returning a message key
+func (s *noiseState) mixKey(input []byte) [32]byte {
+    var key [32]byte
+    noiseKDF(s.ck[:], input, s.ck[:], key[:])
+    return key
+}
+
+func (s *noiseState) seal(key [32]byte, plaintext []byte) []byte {
+    aead, _ := chacha20poly1305.New(key[:])
+    var nonce [chacha20poly1305.NonceSize]byte
+    out := aead.Seal(nil, nonce[:], plaintext, s.h[:])
+    s.mixHash(out)
+    return out
+}
+
+func (s *noiseState) open(key [32]byte, ciphertext []byte) ([]byte, error) {
+    aead, _ := chacha20poly1305.New(key[:])
+    var nonce [chacha20poly1305.NonceSize]byte
+    out, err := aead.Open(nil, nonce[:], ciphertext, s.h[:])
+    if err != nil {
+        return nil, err
+    }
+    s.mixHash(ciphertext)
+    return out, nil
+}
+
+func noiseHash(a, b []byte) [32]byte {
+    h, _ := blake2s.New256(nil)
+    h.Write(a)
+    h.Write(b)
+    var out [32]byte
+    h.Sum(out[:0])
+    return out
+}
+
+func noiseHMAC(key []byte, data ...[]byte) []byte {
+    mac := hmac.New(func() hash.Hash {
+        h, _ := blake2s.New256(nil)
+        return h
+    }, key)
+    for _, d := range data {
+        mac.Write(d)
+    }
+    return mac.Sum(nil)
+}
+
+// HKDF over HMAC-BLAKE2s, writing as many 32-byte outputs as given
+func noiseKDF(key, input []byte, outputs ...[]byte) {
+    prk := noiseHMAC(key, input)
+    prev := []byte{}
+    for i, out := range outputs {
+        prev = noiseHMAC(prk, prev, []byte{byte(i + 1)})
+        copy(out, prev)
+    }
+}
+
+// mac1 = MAC(HASH(LABEL_MAC1 || responder static), msg up to mac1)
+func noiseMac1(responderPublic, body []byte) []byte {
+    key := noiseHash([]byte(noiseLabelMac1), responderPublic)
+    mac, _ := blake2s.New128(key[:])
+    mac.Write(body)
+    return mac.Sum(nil)
+}
+
+func noiseDH(private, public []byte) ([]byte, error) {
+    return curve25519.X25519(private, public)
+}
+
+func noiseTimestamp() []byte {
+    // TAI64N
+    now := time.Now()
+    ts := make([]byte, 12)
+    binary.BigEndian.PutUint64(ts, 0x400000000000000a+uint64(now.Unix()))
+    binary.BigEndian.PutUint32(ts[8:], uint32(now.Nanosecond()))
+    return ts
+}
+
+// Initiation, response and transport keys on both sides; fails if the
+// two ends disagree on any of them
+func noiseRoundTrip(initiator, responder *noisePeer) error {
+    var psk [32]byte
+    
+    // Initiator: message 1
+    ei, err := randomNoisePeer()
+    if err != nil {
+        return err
+    }
+    
+    is := newNoiseState(responder.public[:])
+    is.mixChain(ei.public[:])
+    is.mixHash(ei.public[:])
+    dh, err := noiseDH(ei.private[:], responder.public[:])
+    if err != nil {
+        return err
+    }
+    encStatic := is.seal(is.mixKey(dh), initiator.public[:])
+    if dh, err = noiseDH(initiator.private[:], responder.public[:]); err != nil {
+        return err
+    }
+    encTimestamp := is.seal(is.mixKey(dh), noiseTimestamp())
+    
+    msg := make([]byte, 0, noiseInitiationLen)
+    msg = binary.LittleEndian.AppendUint32(msg, 1) // type
+    msg = binary.LittleEndian.AppendUint32(msg, 1) // sender index
+    msg = append(msg, ei.public[:]...)
+    msg = append(msg, encStatic...)
+    msg = append(msg, encTimestamp...)
+    msg = append(msg, noiseMac1(responder.public[:], msg)...)
+    msg = append(msg, make([]byte, 16)...) // mac2, no cookie
+    
+    // Responder: check mac1, then consume message 1
+    body := msg[:noiseInitiationBody]
+    if !hmac.Equal(msg[noiseInitiationBody:noiseInitiationBody+16], noiseMac1(responder.public[:], body)) {
+        return errors.New("noise: mac1 mismatch")
+    }
+    rs := newNoiseState(responder.public[:])
+    rs.mixChain(ei.public[:])
+    rs.mixHash(ei.public[:])
+    if dh, err = noiseDH(responder.private[:], ei.public[:]); err != nil {
+        return err
+    }
+    static, err := rs.open(rs.mixKey(dh), encStatic)
+    if err != nil {
+        return err
+    }
+    if dh, err = noiseDH(responder.private[:], static); err != nil {
+        return err
+    }
+    if _, err := rs.open(rs.mixKey(dh), encTimestamp); err != nil {
+        return err
+    }
+    
+    // Responder: message 2
+    er, err := randomNoisePeer()
+    if err != nil {
+        return err
+    }
+    
+    rs.mixChain(er.public[:])
+    rs.mixHash(er.public[:])
+    if dh, err = noiseDH(er.private[:], ei.public[:]); err != nil {
+        return err
+    }
+    rs.mixChain(dh)
+    if dh, err = noiseDH(er.private[:], static); err != nil {
+        return err
+    }
+    rs.mixChain(dh)
+    var tau, key [32]byte
+    noiseKDF(rs.ck[:], psk[:], rs.ck[:], tau[:], key[:])
+    rs.mixHash(tau[:])
+    encEmpty := rs.seal(key, nil)
+    
+    // Initiator: consume message 2
+    is.mixChain(er.public[:])
+    is.mixHash(er.public[:])
+    if dh, err = noiseDH(ei.private[:], er.public[:]); err != nil {
+        return err
+    }
+    is.mixChain(dh)
+    if dh, err = noiseDH(initiator.private[:], er.public[:]); err != nil {
+        return err
+    }
+    is.mixChain(dh)
+    noiseKDF(is.ck[:], psk[:], is.ck[:], tau[:], key[:])
+    is.mixHash(tau[:])
+    if _, err := is.open(key, encEmpty); err != nil {
+        return err
+    }
+    
+    // Transport keys
+    var iSend, iRecv, rRecv, rSend [32]byte
+    noiseKDF(is.ck[:], nil, iSend[:], iRecv[:])
+    noiseKDF(rs.ck[:], nil, rRecv[:], rSend[:])
+    if iSend != rRecv || iRecv != rSend {
+        return errors.New("noise: transport keys differ")
+    }
+    return nil
+}
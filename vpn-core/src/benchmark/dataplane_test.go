@@ -0,0 +1,763 @@
+package benchmark
+
+import (
+    "bufio"
+    "context"
+    "errors"
+    "fmt"
+    "io"
+    "net"
+    "os"
+    "path/filepath"
+    "runtime"
+    "strconv"
+    "strings"
+    "sync"
+    "sync/atomic"
+    "syscall"
+    "time"
+    
+    "github.com/vishvananda/netlink"
+    "github.com/vishvananda/netns"
+    "golang.org/x/net/ipv4"
+    "golang.org/x/sys/unix"
+    "golang.zx2c4.com/wireguard/wgctrl"
+    "golang.zx2c4.com/wireguard/wgctrl/wgtypes"
+)
+
+// DataplaneOptions switches the throughput and scalability phases from
+// simulated counters to real packets. Each peer is a WireGuard interface
+// in a private network namespace, reaching the server device over a veth
+// pair with the XDP filter attached, so traffic crosses the kernel
+// module, XDP and both crypto paths. Needs root.
+type DataplaneOptions struct {
+    Device     string        // server WireGuard device
+    PeerCounts []int         // peer sweep, ascending
+    CoreCounts []int         // core sweep, ascending
+    Duration   time.Duration // per sweep point
+    Batch      int           // datagrams per sendmmsg/recvmmsg call
+}
+
+// DataplanePoint is one measured sweep point
+type DataplanePoint struct {
+    Direction       string            `json:"direction"`
+    Peers           int               `json:"peers"`
+    Cores           int               `json:"cores"` // generator threads; the kernel uses every CPU
+    PacketsPerSec   float64           `json:"pps"`
+    Gbps            float64           `json:"gbps"`
+    LossPercent     float64           `json:"loss_percent"`
+    CyclesPerPacket float64           `json:"cycles_per_packet"`
+    XDPDrops        map[string]uint64 `json:"xdp_drops,omitempty"`
+    
+    // Server device receive side: the rx_queue limit at the start and end
+    // of the point, and datagrams dropped in between
+    RxTuning        string            `json:"rx_tuning,omitempty"`
+    RxQueueBefore   uint32            `json:"rx_queue_limit_before"`
+    RxQueueAfter    uint32            `json:"rx_queue_limit_after"`
+    RxDropped       uint64            `json:"rx_dropped"`
+}
+
+const (
+    labNamespace = "utr-bench"
+    labVethHost  = "utr-bench0"
+    labVethPeer  = "utr-bench1"
+    labSinkPort  = 5201
+    labPeerPort  = 40000 // + peer index
+    labMaxPeers  = 65535 - labPeerPort
+    
+    // Longer than the module takes to shrink an idle rx_queue limit
+    labIdleBeforeBurst = 5 * time.Second
+)
+
+// Receive presets compared under a burst after idle
+var rxTuningPresets = []struct {
+    name   string
+    tuning RxTuning
+}{
+    {"default", DefaultRxTuning},
+    {"low-latency", LowLatencyRxTuning},
+}
+
+var (
+    labHostAddr     = net.IPv4(192, 168, 250, 1).To4()
+    labPeerAddr     = net.IPv4(192, 168, 250, 2).To4()
+    labServerTunnel = net.IPv4(10, 201, 0, 1).To4()
+)
+
+// Labelled traffic directions
+const (
+    dirUpload        = "upload"
+    dirDownload      = "download"
+    dirBidirectional = "bidirectional"
+)
+
+func (b *VPNBenchmark) EnableDataplane(opts DataplaneOptions) {
+    if len(opts.PeerCounts) == 0 {
+        opts.PeerCounts = []int{1, 16, 64, 256}
+    }
+    if len(opts.CoreCounts) == 0 {
+        for cores := 1; cores < runtime.NumCPU(); cores *= 2 {
+            opts.CoreCounts = append(opts.CoreCounts, cores)
+        }
+        opts.CoreCounts = append(opts.CoreCounts, runtime.NumCPU())
+    }
+    if opts.Duration == 0 {
+        opts.Duration = 5 * time.Second
+    }
+    if opts.Batch == 0 {
+        opts.Batch = 64
+    }
+    b.dataplane = &opts
+}
+
+// Throughput with every configured peer and core
+func (b *VPNBenchmark) dataplaneThroughput() (ThroughputMetrics, error) {
+    metrics := ThroughputMetrics{}
+    opts := b.dataplane
+    
+    lab, err := newDataplaneLab(b.vpn, opts)
+    if err != nil {
+        return metrics, err
+    }
+    defer lab.Close()
+    
+    peers := opts.PeerCounts[len(opts.PeerCounts)-1]
+    cores := opts.CoreCounts[len(opts.CoreCounts)-1]
+    if err := lab.growPeers(peers); err != nil {
+        return metrics, err
+    }
+    
+    points := make(map[string]DataplanePoint)
+    for _, dir := range []string{dirUpload, dirDownload, dirBidirectional} {
+        point, err := lab.run(dir, peers, cores, b.packetSize)
+        if err != nil {
+            return metrics, fmt.Errorf("%s: %w", dir, err)
+        }
+        points[dir] = point
+    }
+    
+    if metrics.RxTuning, err = lab.rxTuningSweep(peers, cores, b.packetSize); err != nil {
+        return metrics, err
+    }
+    
+    metrics.Upload = points[dirUpload].Gbps * 1000
+    metrics.Download = points[dirDownload].Gbps * 1000
+    metrics.Bidirectional = points[dirBidirectional].Gbps * 1000
+    metrics.PacketsPerSec = uint64(points[dirBidirectional].PacketsPerSec)
+    
+    fmt.Printf("   ✓ Upload: %.2f Mbps\n", metrics.Upload)
+    fmt.Printf("   ✓ Download: %.2f Mbps\n", metrics.Download)
+    fmt.Printf("   ✓ Bidirectional: %.2f Mbps\n", metrics.Bidirectional)
+    fmt.Printf("   ✓ Packets/sec: %d (%.0f cycles/packet)\n",
+        metrics.PacketsPerSec, points[dirBidirectional].CyclesPerPacket)
+    
+    return metrics, nil
+}
+
+// Each receive preset against a full-rate upload burst after the device
+// sat idle: whether the limit kept its floor while idle, how far the
+// burst grew it, what was dropped, and what busy polling costs per packet
+func (lab *dataplaneLab) rxTuningSweep(peers, cores, packetSize int) ([]DataplanePoint, error) {
+    defer lab.vpn.SetRxTuning(DefaultRxTuning)
+    
+    var points []DataplanePoint
+    for _, preset := range rxTuningPresets {
+        if err := lab.vpn.SetRxTuning(preset.tuning); err != nil {
+            return points, err
+        }
+        time.Sleep(labIdleBeforeBurst)
+        
+        point, err := lab.run(dirUpload, peers, cores, packetSize)
+        if err != nil {
+            return points, fmt.Errorf("%s rx tuning: %w", preset.name, err)
+        }
+        point.RxTuning = preset.name
+        points = append(points, point)
+        
+        fmt.Printf("   %-12s rx_queue %5d -> %5d: %d rx drops, %.0f cycles/pkt, %.2f%% loss\n",
+            preset.name, point.RxQueueBefore, point.RxQueueAfter, point.RxDropped,
+            point.CyclesPerPacket, point.LossPercent)
+    }
+    return points, nil
+}
+
+// Sweep peer and core counts. The core count only bounds the traffic
+// generator: the module's crypt workers, NAPI and XDP still run on every
+// online CPU, so the curve is not a core scaling measurement and
+// LinearScalability is left unset.
+func (b *VPNBenchmark) dataplaneScalability() (ScalabilityMetrics, error) {
+    metrics := ScalabilityMetrics{}
+    opts := b.dataplane
+    
+    lab, err := newDataplaneLab(b.vpn, opts)
+    if err != nil {
+        return metrics, err
+    }
+    defer lab.Close()
+    
+    for _, peers := range opts.PeerCounts {
+        if err := lab.growPeers(peers); err != nil {
+            return metrics, err
+        }
+        
+        for _, cores := range opts.CoreCounts {
+            point, err := lab.run(dirUpload, peers, cores, b.packetSize)
+            if err != nil {
+                return metrics, fmt.Errorf("%d peers, %d cores: %w", peers, cores, err)
+            }
+            metrics.Curve = append(metrics.Curve, point)
+            
+            fmt.Printf("   %5d peers %3d cores: %12.0f pps %7.2f Gbps %7.0f cycles/pkt %5.2f%% loss\n",
+                peers, cores, point.PacketsPerSec, point.Gbps, point.CyclesPerPacket, point.LossPercent)
+            
+            if point.PacketsPerSec > float64(metrics.MaxPacketsPerSec) {
+                metrics.MaxPacketsPerSec = uint64(point.PacketsPerSec)
+            }
+            if point.LossPercent < 1 && peers > metrics.MaxConcurrentPeers {
+                metrics.MaxConcurrentPeers = peers
+            }
+        }
+    }
+    
+    fmt.Printf("   ✓ Max concurrent peers: %d\n", metrics.MaxConcurrentPeers)
+    fmt.Printf("   ✓ Linear scalability: n/a (kernel work is not confined to the swept cores)\n")
+    
+    return metrics, nil
+}
+
+type labPeer struct {
+    ifname string
+    ip     net.IP
+    key    wgtypes.Key
+}
+
+// dataplaneLab owns the namespace, veth pair and peer interfaces
+type dataplaneLab struct {
+    vpn        *UnderTheRadarVPN
+    opts       *DataplaneOptions
+    root       netns.NsHandle
+    ns         netns.NsHandle
+    host       *netlink.Handle // bound to root
+    nl         *netlink.Handle // bound to ns
+    xdp        io.Closer
+    serverKey  wgtypes.Key
+    serverPort int
+    peers      []labPeer
+}
+
+func newDataplaneLab(vpn *UnderTheRadarVPN, opts *DataplaneOptions) (*dataplaneLab, error) {
+    wg, err := wgctrl.New()
+    if err != nil {
+        return nil, err
+    }
+    dev, err := wg.Device(opts.Device)
+    wg.Close()
+    if err != nil {
+        return nil, fmt.Errorf("server device %s: %w", opts.Device, err)
+    }
+    
+    lab := &dataplaneLab{
+        vpn:        vpn,
+        opts:       opts,
+        root:       netns.None(),
+        ns:         netns.None(),
+        serverKey:  dev.PublicKey,
+        serverPort: dev.ListenPort,
+    }
+    if err := lab.setup(); err != nil {
+        lab.Close()
+        return nil, err
+    }
+    return lab, nil
+}
+
+func (lab *dataplaneLab) setup() error {
+    // NewNamed moves the calling thread into the new namespace
+    runtime.LockOSThread()
+    defer runtime.UnlockOSThread()
+    
+    var err error
+    if lab.root, err = netns.Get(); err != nil {
+        return err
+    }
+    if lab.ns, err = netns.NewNamed(labNamespace); err != nil {
+        return fmt.Errorf("failed to create namespace %s: %w", labNamespace, err)
+    }
+    if err := netns.Set(lab.root); err != nil {
+        return err
+    }
+    if lab.host, err = netlink.NewHandleAt(lab.root); err != nil {
+        return err
+    }
+    if lab.nl, err = netlink.NewHandleAt(lab.ns); err != nil {
+        return err
+    }
+    
+    // veth pair, host end in the root namespace
+    veth := &netlink.Veth{LinkAttrs: netlink.LinkAttrs{Name: labVethHost}, PeerName: labVethPeer}
+    if err := lab.host.LinkAdd(veth); err != nil {
+        return fmt.Errorf("failed to create veth pair: %w", err)
+    }
+    peerEnd, err := lab.host.LinkByName(labVethPeer)
+    if err != nil {
+        return err
+    }
+    if err := lab.host.LinkSetNsFd(peerEnd, int(lab.ns)); err != nil {
+        return err
+    }
+    if err := linkUp(lab.host, labVethHost, labHostAddr, 24); err != nil {
+        return err
+    }
+    if err := linkUp(lab.nl, labVethPeer, labPeerAddr, 24); err != nil {
+        return err
+    }
+    if lo, err := lab.nl.LinkByName("lo"); err == nil {
+        lab.nl.LinkSetUp(lo)
+    }
+    
+    // Server tunnel address covering every peer
+    if err := linkUp(lab.host, lab.opts.Device, labServerTunnel, 16); err != nil {
+        return err
+    }
+    
+    xdp, err := lab.vpn.AttachXDP(labVethHost)
+    if err != nil {
+        return err
+    }
+    lab.xdp = xdp
+    return nil
+}
+
+// Bring ifname up with addr/prefix, tolerating an existing address
+func linkUp(h *netlink.Handle, ifname string, addr net.IP, prefix int) error {
+    l, err := h.LinkByName(ifname)
+    if err != nil {
+        return fmt.Errorf("%s: %w", ifname, err)
+    }
+    a := &netlink.Addr{IPNet: &net.IPNet{IP: addr, Mask: net.CIDRMask(prefix, 32)}}
+    if err := h.AddrAdd(l, a); err != nil && !errors.Is(err, unix.EEXIST) {
+        return fmt.Errorf("failed to address %s: %w", ifname, err)
+    }
+    return h.LinkSetUp(l)
+}
+
+// Tunnel address of peer i, 10.201.0.2 upwards
+func labTunnelIP(i int) net.IP {
+    n := i + 2
+    return net.IPv4(10, 201, byte(n>>8), byte(n)).To4()
+}
+
+// Add peers until there are n, on both ends. Server-side endpoints are
+// set up front so download traffic needs no prior handshake.
+func (lab *dataplaneLab) growPeers(n int) error {
+    // Each peer interface listens on its own port above labPeerPort
+    if n > labMaxPeers {
+        return fmt.Errorf("too many lab peers: %d (max %d)", n, labMaxPeers)
+    }
+    
+    var configs []PeerConfig
+    err := inNS(lab.ns, func() error {
+        wg, err := wgctrl.New()
+        if err != nil {
+            return err
+        }
+        defer wg.Close()
+        
+        for i := len(lab.peers); i < n; i++ {
+            key, err := wgtypes.GeneratePrivateKey()
+            if err != nil {
+                return err
+            }
+            p := labPeer{ifname: fmt.Sprintf("utrb%d", i), ip: labTunnelIP(i), key: key}
+            
+            if err := lab.nl.LinkAdd(&netlink.Wireguard{LinkAttrs: netlink.LinkAttrs{Name: p.ifname}}); err != nil {
+                return fmt.Errorf("failed to create %s: %w", p.ifname, err)
+            }
+            
+            port := labPeerPort + i
+            cfg := wgtypes.Config{
+                PrivateKey: &key,
+                ListenPort: &port,
+                Peers: []wgtypes.PeerConfig{{
+                    PublicKey:  lab.serverKey,
+                    Endpoint:   &net.UDPAddr{IP: labHostAddr, Port: lab.serverPort},
+                    AllowedIPs: []net.IPNet{{IP: labServerTunnel, Mask: net.CIDRMask(32, 32)}},
+                }},
+            }
+            if err := wg.ConfigureDevice(p.ifname, cfg); err != nil {
+                return fmt.Errorf("failed to configure %s: %w", p.ifname, err)
+            }
+            if err := linkUp(lab.nl, p.ifname, p.ip, 16); err != nil {
+                return err
+            }
+            
+            lab.peers = append(lab.peers, p)
+            configs = append(configs, PeerConfig{
+                PublicKey:  key.PublicKey(),
+                Endpoint:   &net.UDPAddr{IP: labPeerAddr, Port: port},
+                AllowedIPs: []net.IPNet{{IP: p.ip, Mask: net.CIDRMask(32, 32)}},
+            })
+        }
+        return nil
+    })
+    if err != nil {
+        return err
+    }
+    return lab.vpn.AddPeers(configs)
+}
+
+func (lab *dataplaneLab) Close() error {
+    for _, p := range lab.peers {
+        lab.vpn.RemovePeer(p.key.PublicKey())
+    }
+    if lab.xdp != nil {
+        lab.xdp.Close()
+    }
+    if lab.nl != nil {
+        lab.nl.Close()
+    }
+    if lab.host != nil {
+        lab.host.Close()
+    }
+    
+    // Peer interfaces and both veth ends go with the namespace
+    if lab.ns.IsOpen() {
+        lab.ns.Close()
+        netns.DeleteNamed(labNamespace)
+    }
+    if lab.root.IsOpen() {
+        lab.root.Close()
+    }
+    return nil
+}
+
+// Run fn on a thread switched into ns; sockets it creates stay there
+func inNS(ns netns.NsHandle, fn func() error) error {
+    runtime.LockOSThread()
+    defer runtime.UnlockOSThread()
+    
+    orig, err := netns.Get()
+    if err != nil {
+        return err
+    }
+    defer orig.Close()
+    
+    if err := netns.Set(ns); err != nil {
+        return err
+    }
+    defer netns.Set(orig)
+    return fn()
+}
+
+// One flow direction: where senders and the sink live
+type labFlow struct {
+    senderNS netns.NsHandle
+    sinkNS   netns.NsHandle
+    conns    []*net.UDPConn
+    sinks    []*net.UDPConn
+}
+
+func (lab *dataplaneLab) openFlow(dir string, peers, cores int) (*labFlow, error) {
+    flow := &labFlow{senderNS: lab.ns, sinkNS: lab.root}
+    if dir == dirDownload {
+        flow.senderNS, flow.sinkNS = lab.root, lab.ns
+    }
+    
+    err := inNS(flow.sinkNS, func() error {
+        lc := net.ListenConfig{Control: setReusePort}
+        for i := 0; i < cores; i++ {
+            pc, err := lc.ListenPacket(context.Background(), "udp4", fmt.Sprintf(":%d", labSinkPort))
+            if err != nil {
+                return err
+            }
+            flow.sinks = append(flow.sinks, pc.(*net.UDPConn))
+        }
+        return nil
+    })
+    if err != nil {
+        flow.close()
+        return nil, err
+    }
+    
+    err = inNS(flow.senderNS, func() error {
+        for _, p := range lab.peers[:peers] {
+            // Upload: pin each socket to its peer's interface, as every
+            // peer routes to the same server tunnel address
+            d := net.Dialer{Control: bindToDevice(p.ifname)}
+            dst := net.JoinHostPort(labServerTunnel.String(), strconv.Itoa(labSinkPort))
+            if dir == dirDownload {
+                d = net.Dialer{}
+                dst = net.JoinHostPort(p.ip.String(), strconv.Itoa(labSinkPort))
+            }
+            
+            c, err := d.Dial("udp4", dst)
+            if err != nil {
+                return err
+            }
+            flow.conns = append(flow.conns, c.(*net.UDPConn))
+        }
+        return nil
+    })
+    if err != nil {
+        flow.close()
+        return nil, err
+    }
+    return flow, nil
+}
+
+func (flow *labFlow) close() {
+    for _, c := range flow.conns {
+        c.Close()
+    }
+    for _, c := range flow.sinks {
+        c.Close()
+    }
+}
+
+func setReusePort(network, address string, c syscall.RawConn) error {
+    var opErr error
+    err := c.Control(func(fd uintptr) {
+        opErr = unix.SetsockoptInt(int(fd), unix.SOL_SOCKET, unix.SO_REUSEPORT, 1)
+    })
+    if err != nil {
+        return err
+    }
+    return opErr
+}
+
+func bindToDevice(ifname string) func(string, string, syscall.RawConn) error {
+    return func(network, address string, c syscall.RawConn) error {
+        var opErr error
+        err := c.Control(func(fd uintptr) {
+            opErr = unix.SetsockoptString(int(fd), unix.SOL_SOCKET, unix.SO_BINDTODEVICE, ifname)
+        })
+        if err != nil {
+            return err
+        }
+        return opErr
+    }
+}
+
+// Drive one sweep point: cores sender workers, each owning a share of the
+// peer sockets and pushing batches with sendmmsg, against cores recvmmsg
+// sinks behind SO_REUSEPORT
+func (lab *dataplaneLab) run(dir string, peers, cores, packetSize int) (DataplanePoint, error) {
+    point := DataplanePoint{Direction: dir, Peers: peers, Cores: cores}
+    
+    // Only the generator: kernel-side work is not pinned
+    prev := runtime.GOMAXPROCS(cores)
+    defer runtime.GOMAXPROCS(prev)
+    
+    dirs := []string{dir}
+    if dir == dirBidirectional {
+        dirs = []string{dirUpload, dirDownload}
+    }
+    
+    var flows []*labFlow
+    defer func() {
+        for _, flow := range flows {
+            flow.close()
+        }
+    }()
+    for _, d := range dirs {
+        flow, err := lab.openFlow(d, peers, cores)
+        if err != nil {
+            return point, err
+        }
+        flows = append(flows, flow)
+    }
+    
+    var sent, received, receivedBytes atomic.Uint64
+    var wg sync.WaitGroup
+    stop := make(chan struct{})
+    
+    xdpBefore, _ := lab.vpn.RefreshXDPStats()
+    limit, droppedBefore := lab.readRx()
+    point.RxQueueBefore = limit
+    cpuBefore := readCPUBusy()
+    start := time.Now()
+    
+    for _, flow := range flows {
+        for _, sink := range flow.sinks {
+            wg.Add(1)
+            go func(sink *net.UDPConn) {
+                defer wg.Done()
+                n, bytes := receiveBatches(sink, lab.opts.Batch, stop)
+                received.Add(n)
+                receivedBytes.Add(bytes)
+            }(sink)
+        }
+        for w := 0; w < cores; w++ {
+            var owned []*net.UDPConn
+            for i := w; i < len(flow.conns); i += cores {
+                owned = append(owned, flow.conns[i])
+            }
+            if len(owned) == 0 {
+                continue
+            }
+            
+            wg.Add(1)
+            go func() {
+                defer wg.Done()
+                sent.Add(sendBatches(owned, packetSize, lab.opts.Batch, stop))
+            }()
+        }
+    }
+    
+    time.Sleep(lab.opts.Duration)
+    close(stop)
+    wg.Wait()
+    
+    elapsed := time.Since(start).Seconds()
+    cpuSeconds := readCPUBusy() - cpuBefore
+    limit, droppedAfter := lab.readRx()
+    point.RxQueueAfter = limit
+    if droppedAfter > droppedBefore {
+        point.RxDropped = droppedAfter - droppedBefore
+    }
+    
+    point.PacketsPerSec = float64(received.Load()) / elapsed
+    point.Gbps = float64(receivedBytes.Load()) * 8 / elapsed / 1e9
+    if n := sent.Load(); n > 0 && received.Load() < n {
+        point.LossPercent = float64(n-received.Load()) / float64(n) * 100
+    }
+    if hz := cpuHz(); hz > 0 && received.Load() > 0 {
+        point.CyclesPerPacket = cpuSeconds * hz / float64(received.Load())
+    }
+    
+    if xdpAfter, err := lab.vpn.RefreshXDPStats(); err == nil && xdpBefore != nil {
+        for reason := range xdpAfter.Drops {
+            if n := xdpAfter.Drops[reason] - xdpBefore.Drops[reason]; n > 0 {
+                if point.XDPDrops == nil {
+                    point.XDPDrops = make(map[string]uint64)
+                }
+                point.XDPDrops[XDPDropReason(reason).String()] = n
+            }
+        }
+    }
+    
+    return point, nil
+}
+
+// Round-robin batches over conns until stop, returning datagrams sent
+func sendBatches(conns []*net.UDPConn, packetSize, batch int, stop <-chan struct{}) uint64 {
+    payload := make([]byte, packetSize)
+    msgs := make([]ipv4.Message, batch)
+    for i := range msgs {
+        msgs[i].Buffers = [][]byte{payload}
+    }
+    
+    pcs := make([]*ipv4.PacketConn, len(conns))
+    for i, c := range conns {
+        pcs[i] = ipv4.NewPacketConn(c)
+    }
+    
+    var sent uint64
+    for {
+        for _, pc := range pcs {
+            select {
+            case <-stop:
+                return sent
+            default:
+            }
+            
+            // Full socket buffers just mean the path is saturated
+            if n, err := pc.WriteBatch(msgs, 0); err == nil {
+                sent += uint64(n)
+            }
+        }
+    }
+}
+
+// Drain sink with recvmmsg until stop, returning datagrams and bytes
+func receiveBatches(sink *net.UDPConn, batch int, stop <-chan struct{}) (uint64, uint64) {
+    pc := ipv4.NewPacketConn(sink)
+    msgs := make([]ipv4.Message, batch)
+    for i := range msgs {
+        msgs[i].Buffers = [][]byte{make([]byte, 65536)}
+    }
+    
+    var packets, bytes uint64
+    for {
+        select {
+        case <-stop:
+            return packets, bytes
+        default:
+        }
+        
+        sink.SetReadDeadline(time.Now().Add(100 * time.Millisecond))
+        n, err := pc.ReadBatch(msgs, 0)
+        if err != nil {
+            continue
+        }
+        for _, m := range msgs[:n] {
+            bytes += uint64(m.N)
+        }
+        packets += uint64(n)
+    }
+}
+
+// System-wide busy CPU seconds from /proc/stat, softirq time included,
+// since that is where most of the data plane runs
+func readCPUBusy() float64 {
+    f, err := os.Open("/proc/stat")
+    if err != nil {
+        return 0
+    }
+    defer f.Close()
+    
+    scanner := bufio.NewScanner(f)
+    if !scanner.Scan() {
+        return 0
+    }
+    fields := strings.Fields(scanner.Text())
+    if len(fields) < 9 || fields[0] != "cpu" {
+        return 0
+    }
+    
+    // user nice system idle iowait irq softirq steal
+    var busy uint64
+    for i, field := range fields[1:9] {
+        v, _ := strconv.ParseUint(field, 10, 64)
+        if i != 3 && i != 4 {
+            busy += v
+        }
+    }
+    return float64(busy) / 100 // USER_HZ
+}
+
+// Server device's rx_queue limit and rx_dropped counter; zero where the
+// module's sysfs is missing
+func (lab *dataplaneLab) readRx() (uint32, uint64) {
+    dev := filepath.Join("/sys/class/net", lab.opts.Device)
+    limit := readSysfsUint(filepath.Join(dev, "undertheradar", "rx_queue_limit"))
+    return uint32(limit), readSysfsUint(filepath.Join(dev, "statistics", "rx_dropped"))
+}
+
+func readSysfsUint(path string) uint64 {
+    b, err := os.ReadFile(path)
+    if err != nil {
+        return 0
+    }
+    v, _ := strconv.ParseUint(strings.TrimSpace(string(b)), 10, 64)
+    return v
+}
+
+// Nominal clock of the first CPU, 0 if unknown
+func cpuHz() float64 {
+    f, err := os.Open("/proc/cpuinfo")
+    if err != nil {
+        return 0
+    }
+    defer f.Close()
+    
+    scanner := bufio.NewScanner(f)
+    for scanner.Scan() {
+        key, value, ok := strings.Cut(scanner.Text(), ":")
+        if ok && strings.TrimSpace(key) == "cpu MHz" {
+            mhz, _ := strconv.ParseFloat(strings.TrimSpace(value), 64)
+            return mhz * 1e6
+        }
+    }
+    return 0
+}
@@ -2,20 +2,26 @@ package benchmark
 
 import (
     "crypto/rand"
+    "encoding/binary"
+    "encoding/json"
     "fmt"
+    "io"
+    mrand "math/rand"
     "net"
     "sync"
     "sync/atomic"
     "time"
     
+    "github.com/HdrHistogram/hdrhistogram-go"
     "github.com/montanaflynn/stats"
-    "golang.org/x/crypto/curve25519"
+    "golang.org/x/crypto/chacha20poly1305"
 )
 
 // BenchmarkResults contains comprehensive performance metrics
 type BenchmarkResults struct {
     Throughput      ThroughputMetrics
-    Latency         LatencyMetrics
+    Latency         LatencyMetrics    // under half load, as the headline figure
+    LatencyByLoad   []LatencyMetrics
     PacketLoss      float64
     CPUUsage        float64
     MemoryUsage     MemoryMetrics
@@ -30,18 +36,48 @@ type ThroughputMetrics struct {
     Bidirectional   float64  // Mbps
     JitterMs        float64
     PacketsPerSec   uint64
+    RxTuning        []DataplanePoint // data-plane mode, burst after idle per preset
 }
 
 type LatencyMetrics struct {
-    MinMs      float64
-    MaxMs      float64
-    AvgMs      float64
-    MedianMs   float64
-    P95Ms      float64
-    P99Ms      float64
-    StdDevMs   float64
+    Load       string   `json:"load"`
+    Background int      `json:"background_clients"`
+    Samples    int64    `json:"samples"`
+    MinMs      float64  `json:"min_ms"`
+    MaxMs      float64  `json:"max_ms"`
+    AvgMs      float64  `json:"avg_ms"`
+    MedianMs   float64  `json:"p50_ms"`
+    // Tail percentiles stay 0 (and out of the JSON) unless enough samples
+    // lie beyond them; see latencyTailSamples
+    P95Ms      float64  `json:"p95_ms,omitempty"`
+    P99Ms      float64  `json:"p99_ms,omitempty"`
+    P999Ms     float64  `json:"p99_9_ms,omitempty"`
+    P9999Ms    float64  `json:"p99_99_ms,omitempty"`
+    StdDevMs   float64  `json:"stddev_ms"`
 }
 
+// Background loads latency is measured under, in background clients per
+// configured client
+var latencyLoads = []struct {
+    name     string
+    fraction float64
+}{
+    {"idle", 0},
+    {"half", 0.5},
+    {"full", 1},
+}
+
+// Latency histogram range: 1µs to 1 minute at 3 significant figures
+const (
+    latencyMinMicros = 1
+    latencyMaxMicros = 60 * 1000 * 1000
+    latencySigFigs   = 3
+    
+    // A percentile is only reported with this many samples above it;
+    // with fewer it is just the maximum under another name
+    latencyTailSamples = 10
+)
+
 type MemoryMetrics struct {
     HeapMB      float64
     StackMB     float64
@@ -59,7 +95,8 @@ type EncryptionMetrics struct {
 type ScalabilityMetrics struct {
     MaxConcurrentPeers  int
     MaxPacketsPerSec    uint64
-    LinearScalability   float64  // 0.0 - 1.0
+    LinearScalability   float64  // 0.0 - 1.0, 0 when not measured
+    Curve               []DataplanePoint // data-plane mode sweep
 }
 
 // VPNBenchmark performs comprehensive performance testing
@@ -76,8 +113,9 @@ type VPNBenchmark struct {
     rxPackets       atomic.Uint64
     txPackets       atomic.Uint64
     droppedPackets  atomic.Uint64
-    latencies       []float64
-    latencyMu       sync.Mutex
+    
+    // Real traffic through netns peers instead of simulated counters
+    dataplane       *DataplaneOptions
 }
 
 // Run executes comprehensive benchmark suite
@@ -106,11 +144,16 @@ func (b *VPNBenchmark) Run() (*BenchmarkResults, error) {
     
     // Phase 3: Latency Testing
     fmt.Println("\n📊 Phase 3: Latency Testing")
-    latencyMetrics, err := b.benchmarkLatency()
-    if err != nil {
-        return nil, fmt.Errorf("latency benchmark failed: %w", err)
+    for _, load := range latencyLoads {
+        latencyMetrics, err := b.benchmarkLatency(load.name, int(float64(b.numClients)*load.fraction))
+        if err != nil {
+            return nil, fmt.Errorf("latency benchmark failed: %w", err)
+        }
+        results.LatencyByLoad = append(results.LatencyByLoad, latencyMetrics)
+        if load.name == "half" {
+            results.Latency = latencyMetrics
+        }
     }
-    results.Latency = latencyMetrics
     
     // Phase 4: Scalability Testing
     fmt.Println("\n📊 Phase 4: Scalability Testing")
@@ -141,49 +184,60 @@ func (b *VPNBenchmark) Run() (*BenchmarkResults, error) {
 func (b *VPNBenchmark) benchmarkEncryption() (EncryptionMetrics, error) {
     metrics := EncryptionMetrics{}
     
-    // Test handshake performance
+    // Full Noise IK round trips, both ends
+    initiator, err := randomNoisePeer()
+    if err != nil {
+        return metrics, err
+    }
+    responder, err := randomNoisePeer()
+    if err != nil {
+        return metrics, err
+    }
     start := time.Now()
     numHandshakes := 1000
     
     for i := 0; i < numHandshakes; i++ {
-        // Generate ephemeral keys
-        var privateKey, publicKey [32]byte
-        if _, err := rand.Read(privateKey[:]); err != nil {
-            return metrics, err
+        if err := noiseRoundTrip(initiator, responder); err != nil {
+            return metrics, fmt.Errorf("handshake failed: %w", err)
         }
-        curve25519.ScalarBaseMult(&publicKey, &privateKey)
-        
-        // Simulate handshake
-        // In real implementation, this would perform full Noise handshake
     }
     
     handshakeDuration := time.Since(start)
     metrics.HandshakesPerSec = float64(numHandshakes) / handshakeDuration.Seconds()
     
-    // Test encryption throughput
-    data := make([]byte, 1024*1024) // 1MB
-    rand.Read(data)
+    // ChaCha20-Poly1305 at the configured packet size
+    aead, err := randomAEAD()
+    if err != nil {
+        return metrics, err
+    }
+    plaintext := make([]byte, b.packetSize)
+    rand.Read(plaintext)
+    sealed := make([]byte, 0, b.packetSize+chacha20poly1305.Overhead)
+    opened := make([]byte, 0, b.packetSize)
+    var nonce [chacha20poly1305.NonceSize]byte
     
     // Encryption benchmark
+    var counter uint64
     encStart := time.Now()
     encBytes := 0
     for time.Since(encStart) < time.Second {
-        // In real implementation, this would use ChaCha20-Poly1305
-        encrypted := make([]byte, len(data)+16) // +16 for auth tag
-        copy(encrypted, data) // Placeholder
-        encBytes += len(data)
+        binary.LittleEndian.PutUint64(nonce[4:], counter)
+        counter++
+        sealed = aead.Seal(sealed[:0], nonce[:], plaintext, nil)
+        encBytes += len(plaintext)
     }
-    metrics.EncryptMbps = float64(encBytes) / 1024 / 1024
+    metrics.EncryptMbps = float64(encBytes) * 8 / 1e6 / time.Since(encStart).Seconds()
     
-    // Decryption benchmark
+    // Decryption benchmark, of the last sealed packet
     decStart := time.Now()
     decBytes := 0
     for time.Since(decStart) < time.Second {
-        decrypted := make([]byte, len(data))
-        copy(decrypted, data) // Placeholder
-        decBytes += len(data)
+        if opened, err = aead.Open(opened[:0], nonce[:], sealed, nil); err != nil {
+            return metrics, fmt.Errorf("decryption failed: %w", err)
+        }
+        decBytes += len(opened)
     }
-    metrics.DecryptMbps = float64(decBytes) / 1024 / 1024
+    metrics.DecryptMbps = float64(decBytes) * 8 / 1e6 / time.Since(decStart).Seconds()
     
     fmt.Printf("   ✓ Handshakes/sec: %.0f\n", metrics.HandshakesPerSec)
     fmt.Printf("   ✓ Encryption: %.0f Mbps\n", metrics.EncryptMbps)
@@ -194,6 +248,10 @@ func (b *VPNBenchmark) benchmarkEncryption() (EncryptionMetrics, error) {
 
 // Benchmark throughput with multiple concurrent connections
 func (b *VPNBenchmark) benchmarkThroughput() (ThroughputMetrics, error) {
+    if b.dataplane != nil {
+        return b.dataplaneThroughput()
+    }
+    
     metrics := ThroughputMetrics{}
     var wg sync.WaitGroup
     
@@ -269,7 +327,7 @@ func (b *VPNBenchmark) benchmarkThroughput() (ThroughputMetrics, error) {
     // Calculate bidirectional metrics
     totalBytes := b.rxBytes.Load() + b.txBytes.Load()
     metrics.Bidirectional = float64(totalBytes) * 8 / b.testDuration.Seconds() / 1000000
-    metrics.PacketsPerSec = (b.rxPackets.Load() + b.txPackets.Load()) / uint64(b.testDuration.Seconds())
+    metrics.PacketsPerSec = uint64(float64(b.rxPackets.Load()+b.txPackets.Load()) / b.testDuration.Seconds())
     
     fmt.Printf("   ✓ Upload: %.2f Mbps\n", metrics.Upload)
     fmt.Printf("   ✓ Download: %.2f Mbps\n", metrics.Download)
@@ -279,25 +337,28 @@ func (b *VPNBenchmark) benchmarkThroughput() (ThroughputMetrics, error) {
     return metrics, nil
 }
 
-// Benchmark latency under various conditions
-func (b *VPNBenchmark) benchmarkLatency() (LatencyMetrics, error) {
-    metrics := LatencyMetrics{}
-    b.latencies = make([]float64, 0, 10000)
+// Benchmark latency under a given background load. Each prober records
+// into its own HDR histogram, so nothing is shared while measuring; the
+// histograms are merged once the run is over.
+func (b *VPNBenchmark) benchmarkLatency(load string, background int) (LatencyMetrics, error) {
+    metrics := LatencyMetrics{Load: load, Background: background}
     
     var wg sync.WaitGroup
     stopCh := make(chan struct{})
     
     // Run latency test with background traffic
-    for i := 0; i < 10; i++ {
+    histograms := make([]*hdrhistogram.Histogram, 10)
+    for i := range histograms {
+        histograms[i] = hdrhistogram.New(latencyMinMicros, latencyMaxMicros, latencySigFigs)
         wg.Add(1)
-        go func() {
+        go func(hist *hdrhistogram.Histogram) {
             defer wg.Done()
-            b.measureLatency(stopCh)
-        }()
+            b.measureLatency(stopCh, hist)
+        }(histograms[i])
     }
     
     // Generate background traffic to simulate real conditions
-    for i := 0; i < b.numClients/2; i++ {
+    for i := 0; i < background; i++ {
         wg.Add(1)
         go func(clientID int) {
             defer wg.Done()
@@ -305,31 +366,56 @@ func (b *VPNBenchmark) benchmarkLatency() (LatencyMetrics, error) {
         }(i)
     }
     
-    time.Sleep(b.testDuration)
+    time.Sleep(b.testDuration / time.Duration(len(latencyLoads)))
     close(stopCh)
     wg.Wait()
     
     // Calculate statistics
-    if len(b.latencies) > 0 {
-        metrics.MinMs, _ = stats.Min(b.latencies)
-        metrics.MaxMs, _ = stats.Max(b.latencies)
-        metrics.AvgMs, _ = stats.Mean(b.latencies)
-        metrics.MedianMs, _ = stats.Median(b.latencies)
-        metrics.P95Ms, _ = stats.Percentile(b.latencies, 95)
-        metrics.P99Ms, _ = stats.Percentile(b.latencies, 99)
-        metrics.StdDevMs, _ = stats.StandardDeviation(b.latencies)
+    total := hdrhistogram.New(latencyMinMicros, latencyMaxMicros, latencySigFigs)
+    for _, hist := range histograms {
+        if dropped := total.Merge(hist); dropped > 0 {
+            return metrics, fmt.Errorf("%d latency samples out of histogram range", dropped)
+        }
+    }
+    
+    metrics.Samples = total.TotalCount()
+    if metrics.Samples > 0 {
+        ms := func(micros int64) float64 { return float64(micros) / 1000 }
+        metrics.MinMs = ms(total.Min())
+        metrics.MaxMs = ms(total.Max())
+        metrics.AvgMs = total.Mean() / 1000
+        metrics.MedianMs = ms(total.ValueAtQuantile(50))
+        tail := func(q float64) float64 {
+            if float64(metrics.Samples)*(100-q)/100 < latencyTailSamples {
+                return 0
+            }
+            return ms(total.ValueAtQuantile(q))
+        }
+        metrics.P95Ms = tail(95)
+        metrics.P99Ms = tail(99)
+        metrics.P999Ms = tail(99.9)
+        metrics.P9999Ms = tail(99.99)
+        metrics.StdDevMs = total.StdDev() / 1000
     }
     
+    fmt.Printf("   Load: %s (%d background clients, %d samples)\n", load, background, metrics.Samples)
     fmt.Printf("   ✓ Min: %.2f ms\n", metrics.MinMs)
     fmt.Printf("   ✓ Avg: %.2f ms\n", metrics.AvgMs)
-    fmt.Printf("   ✓ P95: %.2f ms\n", metrics.P95Ms)
-    fmt.Printf("   ✓ P99: %.2f ms\n", metrics.P99Ms)
+    fmt.Printf("   ✓ P50: %.2f ms\n", metrics.MedianMs)
+    printPercentile("   ✓ P99: ", metrics.P99Ms)
+    printPercentile("   ✓ P99.9: ", metrics.P999Ms)
+    printPercentile("   ✓ P99.99: ", metrics.P9999Ms)
+    fmt.Printf("   ✓ Max: %.2f ms\n", metrics.MaxMs)
     
     return metrics, nil
 }
 
 // Benchmark scalability with increasing load
 func (b *VPNBenchmark) benchmarkScalability() (ScalabilityMetrics, error) {
+    if b.dataplane != nil {
+        return b.dataplaneScalability()
+    }
+    
     metrics := ScalabilityMetrics{}
     
     // Test with increasing number of peers
@@ -461,7 +547,7 @@ func (b *VPNBenchmark) generateTraffic(clientID int, testType string, stopCh <-c
 }
 
 // Measure latency
-func (b *VPNBenchmark) measureLatency(stopCh <-chan struct{}) {
+func (b *VPNBenchmark) measureLatency(stopCh <-chan struct{}, hist *hdrhistogram.Histogram) {
     ticker := time.NewTicker(100 * time.Millisecond)
     defer ticker.Stop()
     
@@ -474,17 +560,22 @@ func (b *VPNBenchmark) measureLatency(stopCh <-chan struct{}) {
             
             // Simulate round-trip
             // In real implementation, this would send ICMP echo
-            time.Sleep(time.Millisecond * time.Duration(5+rand.Intn(10)))
-            
-            latency := time.Since(start).Seconds() * 1000
+            time.Sleep(time.Millisecond * time.Duration(5+mrand.Intn(10)))
             
-            b.latencyMu.Lock()
-            b.latencies = append(b.latencies, latency)
-            b.latencyMu.Unlock()
+            hist.RecordValue(time.Since(start).Microseconds())
         }
     }
 }
 
+// Tail percentiles the run had too few samples for print as n/a
+func printPercentile(label string, v float64) {
+    if v == 0 {
+        fmt.Printf("%sn/a (too few samples)\n", label)
+        return
+    }
+    fmt.Printf("%s%.2f ms\n", label, v)
+}
+
 // Generate test public key
 func generateTestPublicKey() wgtypes.Key {
     var key wgtypes.Key
@@ -505,8 +596,10 @@ func (r *BenchmarkResults) Print() {
     
     fmt.Printf("\n⏱️  LATENCY\n")
     fmt.Printf("   Average:       %.2f ms\n", r.Latency.AvgMs)
-    fmt.Printf("   P95:           %.2f ms\n", r.Latency.P95Ms)
-    fmt.Printf("   P99:           %.2f ms\n", r.Latency.P99Ms)
+    printPercentile("   P95:           ", r.Latency.P95Ms)
+    printPercentile("   P99:           ", r.Latency.P99Ms)
+    printPercentile("   P99.9:         ", r.Latency.P999Ms)
+    fmt.Printf("   Max:           %.2f ms\n", r.Latency.MaxMs)
     fmt.Printf("   Jitter:        %.2f ms\n", r.Latency.StdDevMs)
     
     fmt.Printf("\n🔐 ENCRYPTION\n")
@@ -516,7 +609,11 @@ func (r *BenchmarkResults) Print() {
     
     fmt.Printf("\n📈 SCALABILITY\n")
     fmt.Printf("   Max peers:     %d\n", r.Scalability.MaxConcurrentPeers)
-    fmt.Printf("   Linear scale:  %.2f\n", r.Scalability.LinearScalability)
+    if r.Scalability.LinearScalability > 0 {
+        fmt.Printf("   Linear scale:  %.2f\n", r.Scalability.LinearScalability)
+    } else {
+        fmt.Printf("   Linear scale:  n/a\n")
+    }
     
     fmt.Printf("\n🎯 QUALITY\n")
     fmt.Printf("   Packet loss:   %.2f%%\n", r.PacketLoss)
@@ -531,6 +628,13 @@ func (r *BenchmarkResults) Print() {
     fmt.Printf("\n🏆 OVERALL SCORE: %.1f/100 - Grade: %s\n", score, grade)
 }
 
+// Write the per-load latency results as JSON for dashboards
+func (r *BenchmarkResults) WriteLatencyJSON(w io.Writer) error {
+    enc := json.NewEncoder(w)
+    enc.SetIndent("", "  ")
+    return enc.Encode(r.LatencyByLoad)
+}
+
 func (r *BenchmarkResults) calculateOverallScore() float64 {
     // Weighted scoring based on importance
     throughputScore := min(r.Throughput.Bidirectional/1000, 1.0) * 30  // 30 points max
@@ -1,16 +1,28 @@
 package main
 
 import (
+    "bytes"
+    "container/heap"
     "crypto/rand"
+    "crypto/subtle"
     "encoding/base64"
+    "encoding/binary"
+    "errors"
     "fmt"
+    "log"
     "net"
+    "os"
+    "path/filepath"
+    "runtime"
+    "strconv"
+    "strings"
     "sync"
     "sync/atomic"
     "time"
     
     "github.com/cilium/ebpf"
     "github.com/cilium/ebpf/link"
+    "github.com/cilium/ebpf/ringbuf"
     "github.com/cilium/ebpf/rlimit"
     "golang.org/x/crypto/chacha20poly1305"
     "golang.org/x/crypto/curve25519"
@@ -24,6 +36,9 @@ const (
     KeepaliveInterval  = 25 * time.Second
     HandshakeTimeout   = 5 * time.Second
     MaxHandshakeRetry  = 20
+    
+    // Compiled XDP/TC object, built from src/ebpf/xdp_accelerator.c
+    EBPFObjectPath     = "/usr/lib/undertheradar/xdp_accelerator.o"
 )
 
 // High-performance VPN control plane with advanced features
@@ -37,14 +52,19 @@ type UnderTheRadarVPN struct {
     listenPort   int
     
     // Peer management
-    peers        map[string]*Peer
+    peers        map[wgtypes.Key]*Peer
     peersByIP    map[string]*Peer
+    routes       atomic.Pointer[routeTable] // written under mu, read lock-free
+    
+    // Serialises peer provisioning so netlink calls run outside mu
+    provisionMu  sync.Mutex
     
     // Performance metrics
     rxBytes      atomic.Uint64
     txBytes      atomic.Uint64
     rxPackets    atomic.Uint64
     txPackets    atomic.Uint64
+    xdpStats     atomic.Pointer[XDPStats]
     
     // Advanced features
     killSwitch   *KillSwitch
@@ -56,6 +76,22 @@ type UnderTheRadarVPN struct {
     // eBPF programs for packet processing
     xdpProgram   *ebpf.Program
     tcProgram    *ebpf.Program
+    ebpfMaps     map[string]*ebpf.Map
+    tracingSpec  *ebpf.CollectionSpec
+    sessionLinks []link.Link
+    sessionTimer *time.Timer
+    afxdp        *AFXDPEngine
+    
+    // QoS classifier generation currently live in the datapath
+    qosMu        sync.Mutex
+    qosGen       uint32
+    qosPrefixes  []qosPrefixKey
+    
+    // Flow record export from the XDP ring buffer
+    flowReader   *ringbuf.Reader
+    
+    // Hot-path tracepoint samplers and the Prometheus endpoint
+    telemetry    *telemetry
     
     // Connection stability
     failoverMgr  *FailoverManager
@@ -84,8 +120,23 @@ type Peer struct {
     // Connection state
     HandshakeRetries atomic.Uint32
     IsAlive         atomic.Bool
+    Keepalive       atomic.Bool    // device sends persistent keepalives
+    
+    // Previous counter sample, owned by collectMetrics
+    sample          peerSample
 }
 
+type peerSample struct {
+    at      time.Time
+    rx, tx  uint64
+    rate    float64 // EWMA of bytes/sec
+    latency uint32
+    loss    uint32
+}
+
+// Weight of the newest rate sample in the load EWMA
+const loadEWMAAlpha = 0.3
+
 // Initialize high-performance VPN with eBPF acceleration
 func NewUnderTheRadarVPN(deviceName string) (*UnderTheRadarVPN, error) {
     // Remove memory limit for eBPF
@@ -101,7 +152,7 @@ func NewUnderTheRadarVPN(deviceName string) (*UnderTheRadarVPN, error) {
     vpn := &UnderTheRadarVPN{
         wgClient:   wgClient,
         deviceName: deviceName,
-        peers:      make(map[string]*Peer),
+        peers:      make(map[wgtypes.Key]*Peer),
         peersByIP:  make(map[string]*Peer),
     }
     
@@ -124,33 +175,623 @@ func NewUnderTheRadarVPN(deviceName string) (*UnderTheRadarVPN, error) {
 
 // Load eBPF programs for XDP and TC acceleration
 func (vpn *UnderTheRadarVPN) loadEBPFPrograms() error {
-    // XDP program for fast packet filtering
-    xdpSpec, err := loadXDPProgram()
+    // Both programs and their maps live in one object
+    spec, err := ebpf.LoadCollectionSpec(EBPFObjectPath)
     if err != nil {
-        return err
+        return fmt.Errorf("failed to load eBPF object: %w", err)
     }
     
-    xdpProg, err := ebpf.NewProgram(xdpSpec)
+    // Session feeders and telemetry attach to the kernel module and need
+    // its BTF, so they are loaded on demand and never block the XDP/TC path
+    vpn.tracingSpec = &ebpf.CollectionSpec{
+        Maps:      spec.Maps,
+        Programs:  make(map[string]*ebpf.ProgramSpec),
+        ByteOrder: spec.ByteOrder,
+    }
+    for name, prog := range spec.Programs {
+        if prog.Type == ebpf.Tracing {
+            vpn.tracingSpec.Programs[name] = prog
+            delete(spec.Programs, name)
+        }
+    }
+    
+    coll, err := ebpf.NewCollection(spec)
     if err != nil {
-        return fmt.Errorf("failed to create XDP program: %w", err)
+        return fmt.Errorf("failed to create eBPF collection: %w", err)
+    }
+    
+    // XDP program for fast packet filtering
+    xdpProg, ok := coll.Programs["xdp_vpn_filter"]
+    if !ok {
+        coll.Close()
+        return fmt.Errorf("XDP program xdp_vpn_filter not found")
     }
     vpn.xdpProgram = xdpProg
     
     // TC program for advanced packet manipulation
-    tcSpec, err := loadTCProgram()
+    tcProg, ok := coll.Programs["tc_vpn_egress"]
+    if !ok {
+        coll.Close()
+        return fmt.Errorf("TC program tc_vpn_egress not found")
+    }
+    vpn.tcProgram = tcProg
+    
+    // Maps stay reachable for runtime tuning from the control plane
+    vpn.ebpfMaps = coll.Maps
+    
+    // Keep the classic VoIP/gaming/VPN marking until an operator retunes it
+    return vpn.SetQoSRules(DefaultQoSRules)
+}
+
+// Look up a map from the loaded eBPF object by name
+func (vpn *UnderTheRadarVPN) ebpfMap(name string) (*ebpf.Map, error) {
+    m, ok := vpn.ebpfMaps[name]
+    if !ok {
+        return nil, fmt.Errorf("eBPF map %s not loaded", name)
+    }
+    return m, nil
+}
+
+// RateLimitConfig mirrors struct rate_limit_config in xdp_accelerator.c
+type RateLimitConfig struct {
+    Rate    uint64 // packets per second per source
+    Burst   uint64 // packets
+    Pad     uint32
+    Enabled uint32
+}
+
+// Update the XDP per-source rate limit without reloading the program.
+// Each RX queue enforces the whole limit; a single-flow source only ever
+// reaches one of them.
+func (vpn *UnderTheRadarVPN) SetRateLimit(rate, burst uint64) error {
+    m, err := vpn.ebpfMap("rate_limit_config_map")
     if err != nil {
         return err
     }
     
-    tcProg, err := ebpf.NewProgram(tcSpec)
+    cfg := RateLimitConfig{
+        Rate:    rate,
+        Burst:   burst,
+        Enabled: 1,
+    }
+    if rate == 0 {
+        cfg.Enabled = 0
+    }
+    
+    if err := m.Update(uint32(0), &cfg, ebpf.UpdateAny); err != nil {
+        return fmt.Errorf("failed to update rate limit config: %w", err)
+    }
+    return nil
+}
+
+// Attach the session feeders to the kernel module and let XDP drop data
+// packets whose receiver index has no live session. Keypairs created
+// before the feeders ran are unknown to the map, so enforcement starts
+// only once all of them must have expired.
+func (vpn *UnderTheRadarVPN) EnableSessionValidation() error {
+    enforce, err := vpn.ebpfMap("session_enforce")
     if err != nil {
-        return fmt.Errorf("failed to create TC program: %w", err)
+        return err
+    }
+    if len(vpn.sessionLinks) > 0 {
+        return nil
+    }
+    
+    coll, err := vpn.loadTracing("session_")
+    if err != nil {
+        return fmt.Errorf("failed to load session feeders: %w", err)
+    }
+    defer coll.Close()
+    
+    for name, prog := range coll.Programs {
+        l, err := link.AttachTracing(link.TracingOptions{Program: prog})
+        if err != nil {
+            vpn.DisableSessionValidation()
+            return fmt.Errorf("failed to attach %s: %w", name, err)
+        }
+        vpn.sessionLinks = append(vpn.sessionLinks, l)
+    }
+    
+    vpn.sessionTimer = time.AfterFunc(RejectAfterTime, func() {
+        if err := enforce.Update(uint32(0), uint32(1), ebpf.UpdateAny); err != nil {
+            log.Printf("Failed to enable session validation: %v", err)
+        }
+    })
+    return nil
+}
+
+// Load the module-attached programs whose names start with prefix,
+// sharing the maps of the XDP/TC collection
+func (vpn *UnderTheRadarVPN) loadTracing(prefix string) (*ebpf.Collection, error) {
+    spec := vpn.tracingSpec.Copy()
+    for name := range spec.Programs {
+        if !strings.HasPrefix(name, prefix) {
+            delete(spec.Programs, name)
+        }
+    }
+    return ebpf.NewCollectionWithOptions(spec, ebpf.CollectionOptions{
+        MapReplacements: vpn.ebpfMaps,
+    })
+}
+
+// Stop enforcing and detach the session feeders
+func (vpn *UnderTheRadarVPN) DisableSessionValidation() {
+    if vpn.sessionTimer != nil {
+        vpn.sessionTimer.Stop()
+        vpn.sessionTimer = nil
+    }
+    if enforce, err := vpn.ebpfMap("session_enforce"); err == nil {
+        enforce.Update(uint32(0), uint32(0), ebpf.UpdateAny)
+    }
+    for _, l := range vpn.sessionLinks {
+        l.Close()
+    }
+    vpn.sessionLinks = nil
+}
+
+// Switch WireGuard traffic to the AF_XDP userspace data plane, for hosts
+// where the kernel module cannot be loaded. Sockets are bound and in
+// xsks_map before XDP starts redirecting, so no packet hits an empty slot.
+func (vpn *UnderTheRadarVPN) StartAFXDP(cfg AFXDPConfig) (*AFXDPEngine, error) {
+    xsks, err := vpn.ebpfMap("xsks_map")
+    if err != nil {
+        return nil, err
+    }
+    xskCfg, err := vpn.ebpfMap("xsk_config")
+    if err != nil {
+        return nil, err
+    }
+    
+    engine, err := NewAFXDPEngine(cfg, xsks)
+    if err != nil {
+        return nil, err
+    }
+    engine.Start()
+    
+    if err := xskCfg.Update(uint32(0), uint32(1), ebpf.UpdateAny); err != nil {
+        engine.Close()
+        return nil, fmt.Errorf("failed to enable AF_XDP redirect: %w", err)
+    }
+    
+    vpn.afxdp = engine
+    return engine, nil
+}
+
+// Hand WireGuard traffic back to the kernel path and stop the engine
+func (vpn *UnderTheRadarVPN) StopAFXDP() {
+    if vpn.afxdp == nil {
+        return
+    }
+    if xskCfg, err := vpn.ebpfMap("xsk_config"); err == nil {
+        xskCfg.Update(uint32(0), uint32(0), ebpf.UpdateAny)
+    }
+    vpn.afxdp.Close()
+    vpn.afxdp = nil
+}
+
+// pacingKey and pacingState mirror the pacing map in xdp_accelerator.c
+type pacingKey struct {
+    Addr [16]byte
+    Port [2]byte // network byte order
+    Pad  uint16
+}
+
+type pacingState struct {
+    Rate    uint64
+    Horizon uint64
+    TLast   uint64
+}
+
+// Pace tunnel traffic towards a peer endpoint at bytesPerSec using EDT;
+// a zero rate removes the limit. Needs fq on the egress device.
+func (vpn *UnderTheRadarVPN) SetPeerPacingRate(endpoint *net.UDPAddr, bytesPerSec uint64,
+    horizon time.Duration) error {
+    m, err := vpn.ebpfMap("pacing_map")
+    if err != nil {
+        return err
+    }
+    
+    ip := endpoint.IP.To16()
+    if ip == nil {
+        return fmt.Errorf("invalid endpoint %s", endpoint)
+    }
+    
+    var key pacingKey
+    copy(key.Addr[:], ip)
+    binary.BigEndian.PutUint16(key.Port[:], uint16(endpoint.Port))
+    
+    if bytesPerSec == 0 {
+        if err := m.Delete(&key); err != nil && !errors.Is(err, ebpf.ErrKeyNotExist) {
+            return fmt.Errorf("failed to clear pacing for %s: %w", endpoint, err)
+        }
+        return nil
     }
-    vpn.tcProgram = tcProg
     
+    state := pacingState{Rate: bytesPerSec, Horizon: uint64(horizon.Nanoseconds())}
+    if err := m.Update(&key, &state, ebpf.UpdateAny); err != nil {
+        return fmt.Errorf("failed to set pacing for %s: %w", endpoint, err)
+    }
+    return nil
+}
+
+// QoSRule marks traffic to a destination prefix or to a destination port
+// range with a DSCP code point and counts it under Class
+type QoSRule struct {
+    Prefix   *net.IPNet // takes precedence over port rules when set
+    PortLow  uint16     // inclusive range, used when Prefix is nil
+    PortHigh uint16
+    DSCP     uint8      // QoSDSCPKeep leaves the existing mark
+    Class    uint8      // counter slot, below QoSMaxClasses
+    Priority uint32     // skb->priority for qdisc band selection, 0 keeps it
+}
+
+const (
+    QoSDSCPKeep   = 0xff
+    QoSMaxClasses = 16
+    
+    qosPorts       = 65536
+    qosMaxPrefixes = 1024 // per generation, QOS_MAX_PREFIXES
+    qosRuleActive  = 0x1
+)
+
+var DefaultQoSRules = []QoSRule{
+    {PortLow: 5060, PortHigh: 5061, DSCP: 46, Class: 1},   // SIP: EF
+    {PortLow: 27000, PortHigh: 27100, DSCP: 34, Class: 2}, // Gaming: AF41
+    {PortLow: 51820, PortHigh: 51820, DSCP: 26, Class: 3}, // WireGuard: AF31
+}
+
+// qosRule and qosPrefixKey mirror the classifier maps in xdp_accelerator.c
+type qosRule struct {
+    Flags    uint8
+    DSCP     uint8
+    Class    uint8
+    Pad      uint8
+    Priority uint32
+}
+
+type qosPrefixKey struct {
+    Prefixlen uint32
+    Gen       uint32
+    Addr      [16]byte
+}
+
+// QoSClassStats is one class's traffic summed over all CPUs
+type QoSClassStats struct {
+    Packets uint64
+    Bytes   uint64
+}
+
+// Replace the whole QoS ruleset. The new rules are written into the idle
+// generation and published with a single config write, so the datapath
+// never sees a mix of old and new rules.
+func (vpn *UnderTheRadarVPN) SetQoSRules(rules []QoSRule) error {
+    ports, err := vpn.ebpfMap("qos_ports")
+    if err != nil {
+        return err
+    }
+    prefixes, err := vpn.ebpfMap("qos_prefixes")
+    if err != nil {
+        return err
+    }
+    cfgMap, err := vpn.ebpfMap("qos_config")
+    if err != nil {
+        return err
+    }
+    
+    vpn.qosMu.Lock()
+    defer vpn.qosMu.Unlock()
+    
+    gen := vpn.qosGen + 1
+    table := make([]qosRule, qosPorts)
+    var newPrefixes []qosPrefixKey
+    var prefixRules []qosRule
+    
+    for _, r := range rules {
+        if r.Class >= QoSMaxClasses {
+            return fmt.Errorf("QoS class %d out of range", r.Class)
+        }
+        rule := qosRule{Flags: qosRuleActive, DSCP: r.DSCP, Class: r.Class, Priority: r.Priority}
+        
+        if r.Prefix != nil {
+            ones, bits := r.Prefix.Mask.Size()
+            ip := r.Prefix.IP.To16()
+            if ip == nil || bits == 0 {
+                return fmt.Errorf("invalid QoS prefix %s", r.Prefix)
+            }
+            if bits == 32 {
+                ones += 96 // v4-mapped
+            }
+            key := qosPrefixKey{Prefixlen: 32 + uint32(ones), Gen: gen}
+            copy(key.Addr[:], ip)
+            newPrefixes = append(newPrefixes, key)
+            prefixRules = append(prefixRules, rule)
+            continue
+        }
+        
+        for port := int(r.PortLow); port <= int(r.PortHigh); port++ {
+            table[port] = rule
+        }
+    }
+    
+    keys := make([]uint32, qosPorts)
+    base := (gen & 1) * qosPorts
+    for i := range keys {
+        keys[i] = base + uint32(i)
+    }
+    if len(newPrefixes) > qosMaxPrefixes {
+        return fmt.Errorf("%d QoS prefix rules exceed the limit of %d", len(newPrefixes), qosMaxPrefixes)
+    }
+    
+    if _, err := ports.BatchUpdate(keys, table, nil); err != nil {
+        return fmt.Errorf("failed to write QoS port rules: %w", err)
+    }
+    
+    // A failed attempt must not leave prefixes behind in gen, or the
+    // next call would publish them alongside its own
+    written := 0
+    rollback := func() {
+        for i := 0; i < written; i++ {
+            prefixes.Delete(&newPrefixes[i])
+        }
+    }
+    for ; written < len(newPrefixes); written++ {
+        if err := prefixes.Update(&newPrefixes[written], &prefixRules[written], ebpf.UpdateAny); err != nil {
+            rollback()
+            return fmt.Errorf("failed to write QoS prefix rule: %w", err)
+        }
+    }
+    
+    // Publish; other CPUs switch over on their next packet
+    if err := cfgMap.Update(uint32(0), gen, ebpf.UpdateAny); err != nil {
+        rollback()
+        return fmt.Errorf("failed to publish QoS rules: %w", err)
+    }
+    
+    // The old generation's prefixes can no longer match
+    for i := range vpn.qosPrefixes {
+        prefixes.Delete(&vpn.qosPrefixes[i])
+    }
+    vpn.qosPrefixes = newPrefixes
+    vpn.qosGen = gen
+    return nil
+}
+
+// Per-class packet and byte counters, summed across CPUs
+func (vpn *UnderTheRadarVPN) QoSStats() ([]QoSClassStats, error) {
+    m, err := vpn.ebpfMap("qos_class_stats")
+    if err != nil {
+        return nil, err
+    }
+    
+    stats := make([]QoSClassStats, QoSMaxClasses)
+    for class := range stats {
+        var perCPU []QoSClassStats
+        if err := m.Lookup(uint32(class), &perCPU); err != nil {
+            return nil, fmt.Errorf("failed to read QoS class %d: %w", class, err)
+        }
+        for _, s := range perCPU {
+            stats[class].Packets += s.Packets
+            stats[class].Bytes += s.Bytes
+        }
+    }
+    return stats, nil
+}
+
+// flowConfig mirrors struct flow_config in xdp_accelerator.c
+type flowConfig struct {
+    SampleRate     uint32
+    Pad            uint32
+    ExportInterval uint64
+}
+
+// FlowRecord is an aggregate flow snapshot exported by XDP. Counters are
+// scaled up from 1-in-SampleRate samples, so they are estimates.
+type FlowRecord struct {
+    SrcIP    net.IP
+    DstIP    net.IP
+    SrcPort  uint16
+    DstPort  uint16
+    Protocol uint8
+    Packets  uint64
+    Bytes    uint64
+    LastSeen time.Duration // CLOCK_MONOTONIC
+}
+
+const flowRecordSize = 16 + 16 + 2 + 2 + 1 + 3 + 8 + 8 + 8
+
+// Trade flow accounting precision for datapath cost: only one packet in
+// sampleRate touches the shared flow entry
+func (vpn *UnderTheRadarVPN) SetFlowSampling(sampleRate uint32, exportInterval time.Duration) error {
+    m, err := vpn.ebpfMap("flow_config_map")
+    if err != nil {
+        return err
+    }
+    
+    cfg := flowConfig{SampleRate: sampleRate, ExportInterval: uint64(exportInterval.Nanoseconds())}
+    if err := m.Update(uint32(0), &cfg, ebpf.UpdateAny); err != nil {
+        return fmt.Errorf("failed to update flow sampling: %w", err)
+    }
     return nil
 }
 
+// Stream flow records from XDP to handler until Stop
+func (vpn *UnderTheRadarVPN) StartFlowExport(handler func(FlowRecord)) error {
+    m, err := vpn.ebpfMap("flow_events")
+    if err != nil {
+        return err
+    }
+    
+    reader, err := ringbuf.NewReader(m)
+    if err != nil {
+        return fmt.Errorf("failed to open flow ring buffer: %w", err)
+    }
+    vpn.flowReader = reader
+    
+    go func() {
+        for {
+            rec, err := reader.Read()
+            if err != nil {
+                if errors.Is(err, ringbuf.ErrClosed) {
+                    return
+                }
+                continue
+            }
+            if len(rec.RawSample) < flowRecordSize {
+                continue
+            }
+            handler(parseFlowRecord(rec.RawSample))
+        }
+    }()
+    return nil
+}
+
+func parseFlowRecord(b []byte) FlowRecord {
+    src := net.IP(append([]byte(nil), b[0:16]...))
+    dst := net.IP(append([]byte(nil), b[16:32]...))
+    if v4 := src.To4(); v4 != nil {
+        src = v4
+    }
+    if v4 := dst.To4(); v4 != nil {
+        dst = v4
+    }
+    
+    return FlowRecord{
+        SrcIP:    src,
+        DstIP:    dst,
+        SrcPort:  binary.BigEndian.Uint16(b[32:34]),
+        DstPort:  binary.BigEndian.Uint16(b[34:36]),
+        Protocol: b[36],
+        Packets:  binary.NativeEndian.Uint64(b[40:48]),
+        Bytes:    binary.NativeEndian.Uint64(b[48:56]),
+        LastSeen: time.Duration(binary.NativeEndian.Uint64(b[56:64])),
+    }
+}
+
+// Steering modes, mirroring STEER_MODE_* in xdp_accelerator.c
+type SteeringMode uint32
+
+const (
+    SteerOff      SteeringMode = 0
+    SteerReceiver SteeringMode = 1 // hash of the WireGuard receiver index
+    SteerFlow     SteeringMode = 2 // hash of the outer UDP flow
+    
+    steerTableSize = 256
+)
+
+// CPUWeight assigns a decrypt core a share of the steering table and the
+// cpumap queue size used for packets redirected to it
+type CPUWeight struct {
+    CPU       uint32
+    Weight    uint32
+    QueueSize uint32
+}
+
+// steeringConfig mirrors struct steering_config in xdp_accelerator.c
+type steeringConfig struct {
+    Mode  uint32
+    Slots uint32
+}
+
+// Retune XDP CPU steering live. CPUs are installed in cpu_map before the
+// slot table points at them, and removed only after it no longer does,
+// so in-flight packets never hit a missing entry. While steering is on
+// the module decrypts each peer on the CPU it was steered to instead of
+// fanning its packets out round-robin.
+func (vpn *UnderTheRadarVPN) SetCPUSteering(mode SteeringMode, weights []CPUWeight) error {
+    cpuMap, err := vpn.ebpfMap("cpu_map")
+    if err != nil {
+        return err
+    }
+    table, err := vpn.ebpfMap("steering_table")
+    if err != nil {
+        return err
+    }
+    cfgMap, err := vpn.ebpfMap("steering_config_map")
+    if err != nil {
+        return err
+    }
+    
+    active := make(map[uint32]bool)
+    var total uint32
+    for _, w := range weights {
+        if w.Weight == 0 {
+            continue
+        }
+        qsize := w.QueueSize
+        if qsize == 0 {
+            qsize = 2048
+        }
+        if err := cpuMap.Update(w.CPU, qsize, ebpf.UpdateAny); err != nil {
+            return fmt.Errorf("failed to add CPU %d to cpu_map: %w", w.CPU, err)
+        }
+        active[w.CPU] = true
+        total += w.Weight
+    }
+    
+    slots := fillSteeringSlots(weights, total)
+    for i, cpu := range slots {
+        if err := table.Update(uint32(i), cpu, ebpf.UpdateAny); err != nil {
+            return fmt.Errorf("failed to update steering slot %d: %w", i, err)
+        }
+    }
+    
+    cfg := steeringConfig{Mode: uint32(mode), Slots: uint32(len(slots))}
+    if len(slots) == 0 {
+        cfg.Mode = uint32(SteerOff)
+    }
+    if err := cfgMap.Update(uint32(0), &cfg, ebpf.UpdateAny); err != nil {
+        return fmt.Errorf("failed to update steering config: %w", err)
+    }
+    
+    // Drop CPUs that no longer own any slot
+    for cpu := uint32(0); cpu < cpuMap.MaxEntries(); cpu++ {
+        if active[cpu] {
+            continue
+        }
+        if err := cpuMap.Delete(cpu); err != nil && !errors.Is(err, ebpf.ErrKeyNotExist) {
+            return fmt.Errorf("failed to remove CPU %d from cpu_map: %w", cpu, err)
+        }
+    }
+    
+    local := uint32(0)
+    if cfg.Mode != uint32(SteerOff) {
+        local = 1
+    }
+    return writeRxTuning(filepath.Join("/sys/class/net", vpn.deviceName, "undertheradar"),
+        "crypt_on_rx_cpu", local)
+}
+
+// Spread CPUs over the slot table in proportion to their weights, using
+// smooth weighted round-robin so heavy CPUs are interleaved, not clumped
+func fillSteeringSlots(weights []CPUWeight, total uint32) []uint32 {
+    if total == 0 {
+        return nil
+    }
+    
+    n := steerTableSize
+    if total < uint32(n) {
+        n = int(total)
+    }
+    
+    current := make([]int64, len(weights))
+    slots := make([]uint32, 0, n)
+    for len(slots) < n {
+        best := -1
+        for i, w := range weights {
+            if w.Weight == 0 {
+                continue
+            }
+            current[i] += int64(w.Weight)
+            if best < 0 || current[i] > current[best] {
+                best = i
+            }
+        }
+        current[best] -= int64(total)
+        slots = append(slots, weights[best].CPU)
+    }
+    return slots
+}
+
 // Start VPN with all advanced features
 func (vpn *UnderTheRadarVPN) Start(config VPNConfig) error {
     // Generate or load private key
@@ -198,11 +839,166 @@ func (vpn *UnderTheRadarVPN) Start(config VPNConfig) error {
     return nil
 }
 
+// Peers per ConfigureDevice call during bulk provisioning
+const peerBatchSize = 512
+
 // Add peer with advanced features
 func (vpn *UnderTheRadarVPN) AddPeer(peerConfig PeerConfig) error {
+    peer, err := newPeer(peerConfig)
+    if err != nil {
+        return err
+    }
+    
+    vpn.provisionMu.Lock()
+    defer vpn.provisionMu.Unlock()
+    
+    // Configure WireGuard peer; readers are not blocked meanwhile
+    cfg := wgtypes.Config{
+        Peers: []wgtypes.PeerConfig{peer.wgConfig()},
+    }
+    
+    if err := vpn.wgClient.ConfigureDevice(vpn.deviceName, cfg); err != nil {
+        return fmt.Errorf("failed to configure peer: %w", err)
+    }
+    
     vpn.mu.Lock()
     defer vpn.mu.Unlock()
     
+    // Replacing a peer withdraws its old routes first
+    if old, exists := vpn.peers[peer.PublicKey]; exists {
+        vpn.unindexPeer(old)
+        vpn.failoverMgr.Forget(old)
+    }
+    
+    // Store peer
+    vpn.peers[peer.PublicKey] = peer
+    
+    // Index by allowed IPs for fast lookup
+    for _, allowedIP := range peer.AllowedIPs {
+        vpn.peersByIP[allowedIP.String()] = peer
+    }
+    vpn.publishRoutes(peer, false)
+    vpn.failoverMgr.Track(peer, time.Time{})
+    
+    return nil
+}
+
+// Bulk variant of AddPeer for large peer sets; existing peers are kept
+func (vpn *UnderTheRadarVPN) AddPeers(configs []PeerConfig) error {
+    return vpn.provisionPeers(configs, false)
+}
+
+// Make the device's peer set exactly configs. Unchanged peers are left
+// alone (keeping their stats), changed ones are updated, the rest removed.
+func (vpn *UnderTheRadarVPN) SyncPeers(configs []PeerConfig) error {
+    return vpn.provisionPeers(configs, true)
+}
+
+// Diff configs against the device's own peer dump, push the changes in
+// chunked ConfigureDevice calls and then swap in new indexes. Diffing the
+// device rather than our indexes means a restarted control plane neither
+// re-pushes every peer nor keeps peers it no longer knows about. vpn.mu
+// is only held briefly. If a batch fails the old indexes stay live;
+// calling SyncPeers again converges the device.
+func (vpn *UnderTheRadarVPN) provisionPeers(configs []PeerConfig, prune bool) error {
+    vpn.provisionMu.Lock()
+    defer vpn.provisionMu.Unlock()
+    
+    device, err := vpn.wgClient.Device(vpn.deviceName)
+    if err != nil {
+        return fmt.Errorf("failed to read device peers: %w", err)
+    }
+    onDevice := make(map[wgtypes.Key]*wgtypes.Peer, len(device.Peers))
+    for i := range device.Peers {
+        onDevice[device.Peers[i].PublicKey] = &device.Peers[i]
+    }
+    
+    // Every writer holds provisionMu, so current is stable until the swap
+    vpn.mu.RLock()
+    current := vpn.peers
+    vpn.mu.RUnlock()
+    
+    next := make(map[wgtypes.Key]*Peer, len(configs))
+    if !prune {
+        for key, peer := range current {
+            next[key] = peer
+        }
+    }
+    
+    var changes []wgtypes.PeerConfig
+    for _, peerConfig := range configs {
+        peer, err := newPeer(peerConfig)
+        if err != nil {
+            return fmt.Errorf("peer %s: %w", peerConfig.PublicKey, err)
+        }
+        
+        key := peer.PublicKey
+        next[key] = peer
+        if old, exists := current[key]; exists {
+            // Failover rewrites Endpoint under vpn.mu
+            vpn.mu.RLock()
+            same := old.sameConfig(peer)
+            vpn.mu.RUnlock()
+            if same {
+                next[key] = old
+            }
+        }
+        if !peer.onDevice(onDevice[key]) {
+            changes = append(changes, peer.wgConfig())
+        }
+    }
+    
+    if prune {
+        for key := range onDevice {
+            if _, keep := next[key]; !keep {
+                changes = append(changes, wgtypes.PeerConfig{PublicKey: key, Remove: true})
+            }
+        }
+    }
+    
+    for start := 0; start < len(changes); start += peerBatchSize {
+        end := start + peerBatchSize
+        if end > len(changes) {
+            end = len(changes)
+        }
+        
+        cfg := wgtypes.Config{Peers: changes[start:end]}
+        if err := vpn.wgClient.ConfigureDevice(vpn.deviceName, cfg); err != nil {
+            return fmt.Errorf("failed to configure peers %d-%d of %d: %w", start, end, len(changes), err)
+        }
+    }
+    
+    // Build the new indexes off-lock
+    byIP := make(map[string]*Peer, len(next))
+    for _, peer := range next {
+        for _, allowedIP := range peer.AllowedIPs {
+            byIP[allowedIP.String()] = peer
+        }
+    }
+    routes := buildRouteTable(next)
+    
+    vpn.mu.Lock()
+    vpn.peers = next
+    vpn.peersByIP = byIP
+    vpn.routes.Store(routes)
+    vpn.mu.Unlock()
+    
+    // Failover tracking follows the swap
+    for key, peer := range current {
+        if next[key] != peer {
+            vpn.failoverMgr.Forget(peer)
+        }
+    }
+    for key, peer := range next {
+        if current[key] != peer {
+            vpn.failoverMgr.Track(peer, time.Time{})
+        }
+    }
+    
+    return nil
+}
+
+func newPeer(peerConfig PeerConfig) (*Peer, error) {
     peer := &Peer{
         PublicKey:     peerConfig.PublicKey,
         Endpoint:      peerConfig.Endpoint,
@@ -214,76 +1010,132 @@ func (vpn *UnderTheRadarVPN) AddPeer(peerConfig PeerConfig) error {
     if peerConfig.PresharedKey != "" {
         key, err := wgtypes.ParseKey(peerConfig.PresharedKey)
         if err != nil {
-            return err
+            return nil, err
         }
         peer.PresharedKey = &key
     }
     
-    // Configure WireGuard peer
-    wgPeer := wgtypes.PeerConfig{
+    return peer, nil
+}
+
+func (peer *Peer) wgConfig() wgtypes.PeerConfig {
+    return wgtypes.PeerConfig{
         PublicKey:    peer.PublicKey,
         PresharedKey: peer.PresharedKey,
         Endpoint:     peer.Endpoint,
         AllowedIPs:   peer.AllowedIPs,
         ReplaceAllowedIPs: true,
     }
-    
-    cfg := wgtypes.Config{
-        Peers: []wgtypes.PeerConfig{wgPeer},
+}
+
+// Whether the device already carries peer's configuration. A roamed
+// endpoint only counts as a change if the config pins one.
+func (peer *Peer) onDevice(dev *wgtypes.Peer) bool {
+    if dev == nil {
+        return false
     }
-    
-    if err := vpn.wgClient.ConfigureDevice(vpn.deviceName, cfg); err != nil {
-        return fmt.Errorf("failed to configure peer: %w", err)
+    var psk wgtypes.Key
+    if peer.PresharedKey != nil {
+        psk = *peer.PresharedKey
     }
-    
-    // Store peer
-    vpn.peers[peer.PublicKey.String()] = peer
-    
-    // Index by allowed IPs for fast lookup
-    for _, allowedIP := range peer.AllowedIPs {
-        vpn.peersByIP[allowedIP.String()] = peer
+    if dev.PresharedKey != psk || len(dev.AllowedIPs) != len(peer.AllowedIPs) {
+        return false
+    }
+    if peer.Endpoint != nil && (dev.Endpoint == nil || dev.Endpoint.String() != peer.Endpoint.String()) {
+        return false
     }
     
-    return nil
+    allowed := make(map[string]struct{}, len(dev.AllowedIPs))
+    for _, prefix := range dev.AllowedIPs {
+        allowed[prefix.String()] = struct{}{}
+    }
+    for _, prefix := range peer.AllowedIPs {
+        if _, ok := allowed[prefix.String()]; !ok {
+            return false
+        }
+    }
+    return true
 }
 
-// High-performance packet routing with load balancing
-func (vpn *UnderTheRadarVPN) routePacket(dstIP net.IP) *Peer {
-    vpn.mu.RLock()
-    defer vpn.mu.RUnlock()
-    
-    var candidates []*Peer
-    
-    // Find all peers that can route to this IP
-    for _, peer := range vpn.peers {
-        for _, allowedIP := range peer.AllowedIPs {
-            if allowedIP.Contains(dstIP) {
-                candidates = append(candidates, peer)
-            }
+// Whether other would leave the indexes unchanged. Reads Endpoint, so
+// the caller holds vpn.mu.
+func (peer *Peer) sameConfig(other *Peer) bool {
+    if peer.Endpoint.String() != other.Endpoint.String() || peer.Priority != other.Priority {
+        return false
+    }
+    if (peer.PresharedKey == nil) != (other.PresharedKey == nil) ||
+        (peer.PresharedKey != nil && *peer.PresharedKey != *other.PresharedKey) {
+        return false
+    }
+    if len(peer.AllowedIPs) != len(other.AllowedIPs) ||
+        len(peer.AlternateEndpoints) != len(other.AlternateEndpoints) {
+        return false
+    }
+    for i := range peer.AllowedIPs {
+        if peer.AllowedIPs[i].String() != other.AllowedIPs[i].String() {
+            return false
+        }
+    }
+    for i := range peer.AlternateEndpoints {
+        if peer.AlternateEndpoints[i].String() != other.AlternateEndpoints[i].String() {
+            return false
         }
     }
+    return true
+}
+
+// Remove a peer and withdraw its routes
+func (vpn *UnderTheRadarVPN) RemovePeer(publicKey wgtypes.Key) error {
+    vpn.provisionMu.Lock()
+    defer vpn.provisionMu.Unlock()
     
-    if len(candidates) == 0 {
-        return nil
+    vpn.mu.RLock()
+    peer, exists := vpn.peers[publicKey]
+    vpn.mu.RUnlock()
+    if !exists {
+        return fmt.Errorf("peer %s not found", publicKey)
     }
     
-    // Select peer with lowest load score
-    var bestPeer *Peer
-    var lowestScore uint64 = ^uint64(0)
+    cfg := wgtypes.Config{
+        Peers: []wgtypes.PeerConfig{{PublicKey: publicKey, Remove: true}},
+    }
+    if err := vpn.wgClient.ConfigureDevice(vpn.deviceName, cfg); err != nil {
+        return fmt.Errorf("failed to remove peer: %w", err)
+    }
     
-    for _, peer := range candidates {
-        if !peer.IsAlive.Load() {
-            continue
-        }
-        
-        score := peer.LoadScore.Load()
-        if score < lowestScore {
-            lowestScore = score
-            bestPeer = peer
+    vpn.failoverMgr.Forget(peer)
+    
+    vpn.mu.Lock()
+    defer vpn.mu.Unlock()
+    vpn.unindexPeer(peer)
+    delete(vpn.peers, publicKey)
+    return nil
+}
+
+// Caller holds provisionMu and vpn.mu
+func (vpn *UnderTheRadarVPN) unindexPeer(peer *Peer) {
+    for _, allowedIP := range peer.AllowedIPs {
+        if vpn.peersByIP[allowedIP.String()] == peer {
+            delete(vpn.peersByIP, allowedIP.String())
         }
     }
-    
-    return bestPeer
+    vpn.publishRoutes(peer, true)
+}
+
+// Publish a routing snapshot with peer's prefixes added or removed.
+// Caller holds provisionMu and vpn.mu.
+func (vpn *UnderTheRadarVPN) publishRoutes(peer *Peer, remove bool) {
+    table := vpn.routes.Load()
+    for _, allowedIP := range peer.AllowedIPs {
+        table = table.with(allowedIP, peer, remove)
+    }
+    vpn.routes.Store(table)
+}
+
+// High-performance packet routing with load balancing. Lock-free and
+// allocation-free: candidates are pre-sorted by load in the snapshot.
+func (vpn *UnderTheRadarVPN) routePacket(dstIP net.IP) *Peer {
+    return vpn.routes.Load().lookup(dstIP)
 }
 
 // Kill switch implementation using netfilter
@@ -404,6 +1256,7 @@ type Obfuscator struct {
     enabled    atomic.Bool
     mode       ObfuscationMode
     xorKey     []byte
+    keyStream  []byte // xorKey repeated to at least keyStreamMin bytes
 }
 
 type ObfuscationMode int
@@ -415,136 +1268,844 @@ const (
     ObfuscationHTTP
 )
 
+const (
+    // Framing room around pooled payloads; TLS and HTTP chunk headers
+    // fit in front, the HTTP chunk trailer behind
+    ObfuscationHeadroom = 16
+    ObfuscationTailroom = 2
+    
+    // Payload capacity of a pooled buffer, enough for any WireGuard
+    // packet on a standard MTU
+    PacketBufferPayload = 2048
+    
+    // Whole keys per stream chunk keep the key phase aligned across chunks
+    keyStreamMin = 256
+)
+
+// PacketBuffer is a pooled packet with headroom and tailroom reserved, so
+// framing never needs to copy the payload
+type PacketBuffer struct {
+    buf [ObfuscationHeadroom + PacketBufferPayload + ObfuscationTailroom]byte
+}
+
+var packetBufferPool = sync.Pool{
+    New: func() any { return new(PacketBuffer) },
+}
+
+func GetPacketBuffer() *PacketBuffer {
+    return packetBufferPool.Get().(*PacketBuffer)
+}
+
+func PutPacketBuffer(p *PacketBuffer) {
+    packetBufferPool.Put(p)
+}
+
+// The first n payload bytes, n <= PacketBufferPayload
+func (p *PacketBuffer) Payload(n int) []byte {
+    return p.buf[ObfuscationHeadroom : ObfuscationHeadroom+n]
+}
+
+func NewObfuscator() *Obfuscator {
+    return &Obfuscator{}
+}
+
+// Select the transform and key. Call before packets flow.
+func (ob *Obfuscator) Configure(mode ObfuscationMode, key []byte) {
+    ob.mode = mode
+    ob.xorKey = append([]byte(nil), key...)
+    ob.keyStream = nil
+    if len(key) > 0 {
+        reps := (keyStreamMin + len(key) - 1) / len(key)
+        ob.keyStream = bytes.Repeat(key, reps)
+    }
+    ob.enabled.Store(mode != ObfuscationNone)
+}
+
 func (ob *Obfuscator) ObfuscatePacket(data []byte) []byte {
     if !ob.enabled.Load() {
         return data
     }
+    return ob.ObfuscateInto(make([]byte, 0, len(data)+ObfuscationHeadroom+ObfuscationTailroom), data)
+}
+
+// Write the obfuscated form of src into dst's backing array and return
+// it. Allocates only if dst's capacity is short of len(src) plus the
+// framing; src must not overlap dst.
+func (ob *Obfuscator) ObfuscateInto(dst, src []byte) []byte {
+    dst = dst[:0]
+    if !ob.enabled.Load() {
+        return append(dst, src...)
+    }
     
     switch ob.mode {
     case ObfuscationXOR:
-        return ob.xorObfuscate(data)
+        dst = append(dst, src...)
+        ob.xorKeyStream(dst, dst)
+        return dst
     case ObfuscationTLS:
-        return ob.tlsObfuscate(data)
+        return append(appendTLSHeader(dst, len(src)), src...)
     case ObfuscationHTTP:
-        return ob.httpObfuscate(data)
+        dst = append(appendHTTPChunkHeader(dst, len(src)), src...)
+        return append(dst, '\r', '\n')
     default:
-        return data
+        return append(dst, src...)
+    }
+}
+
+// Obfuscate the first n payload bytes of p in place, writing any framing
+// into the reserved headroom and tailroom. Returns the framed packet.
+func (ob *Obfuscator) ObfuscateInPlace(p *PacketBuffer, n int) []byte {
+    payload := p.Payload(n)
+    if !ob.enabled.Load() {
+        return payload
+    }
+    
+    switch ob.mode {
+    case ObfuscationXOR:
+        ob.xorKeyStream(payload, payload)
+        return payload
+    case ObfuscationTLS, ObfuscationHTTP:
+        return p.frame(ob.mode, n)
+    default:
+        return payload
+    }
+}
+
+// Place the mode's header directly in front of the payload
+func (p *PacketBuffer) frame(mode ObfuscationMode, n int) []byte {
+    var scratch [ObfuscationHeadroom]byte
+    var header []byte
+    if mode == ObfuscationTLS {
+        header = appendTLSHeader(scratch[:0], n)
+    } else {
+        header = appendHTTPChunkHeader(scratch[:0], n)
+    }
+    start := ObfuscationHeadroom - len(header)
+    copy(p.buf[start:], header)
+    
+    end := ObfuscationHeadroom + n
+    if mode == ObfuscationHTTP {
+        p.buf[end], p.buf[end+1] = '\r', '\n'
+        end += 2
     }
+    return p.buf[start:end]
 }
 
-func (ob *Obfuscator) xorObfuscate(data []byte) []byte {
-    result := make([]byte, len(data))
-    for i := range data {
-        result[i] = data[i] ^ ob.xorKey[i%len(ob.xorKey)]
+// XOR with the pre-expanded key stream. crypto/subtle uses word-wide
+// and SIMD loops; dst and src may overlap exactly.
+func (ob *Obfuscator) xorKeyStream(dst, src []byte) {
+    if len(ob.keyStream) == 0 {
+        copy(dst, src)
+        return
+    }
+    for len(src) > 0 {
+        n := subtle.XORBytes(dst, src, ob.keyStream)
+        dst, src = dst[n:], src[n:]
     }
-    return result
 }
 
-func (ob *Obfuscator) tlsObfuscate(data []byte) []byte {
+func appendTLSHeader(dst []byte, n int) []byte {
     // Make packet look like TLS 1.3 traffic
-    tlsHeader := []byte{
+    return append(dst,
         0x16, 0x03, 0x03, // TLS application data
-        byte(len(data) >> 8), byte(len(data)), // Length
-    }
-    return append(tlsHeader, data...)
+        byte(n >> 8), byte(n), // Length
+    )
+}
+
+// HTTP/1.1 chunked transfer framing: hex length, CRLF, data, CRLF
+func appendHTTPChunkHeader(dst []byte, n int) []byte {
+    dst = strconv.AppendUint(dst, uint64(n), 16)
+    return append(dst, '\r', '\n')
 }
 
-// Connection stability and automatic failover
+// Connection stability and automatic failover. Peers are sharded by
+// public key; each shard keeps a heap of handshake deadlines and sleeps
+// until the earliest one, so the work follows failures, not peer count.
 type FailoverManager struct {
     vpn           *UnderTheRadarVPN
-    checkInterval time.Duration
-    failureThreshold int
+    shards        []*failoverShard
+    stop          chan struct{}
+    stopOnce      sync.Once
+    
+    // Reachability check for a candidate endpoint, run for all
+    // alternates at once
+    probe         func(endpoint *net.UDPAddr, timeout time.Duration) error
+    probeTimeout  time.Duration
+}
+
+const (
+    // A peer in use rekeys every RekeyAfterTime; allow one handshake
+    // attempt on top. Idle peers without keepalives stop handshaking, so
+    // past this they are only rechecked for one-way traffic.
+    handshakeStaleAfter = RekeyAfterTime + HandshakeTimeout
+    idleRecheckAfter    = KeepaliveInterval
+    
+    // Loss (percent * 100) and latency (microseconds) that trigger failover
+    failoverMaxLoss    = 500
+    failoverMaxLatency = 200000
+    
+    // Concurrent failovers per shard
+    failoverSlots = 64
+)
+
+type failoverEntry struct {
+    peer      *Peer
+    handshake time.Time
+    rx, tx    uint64 // peer counters at the last handshake or idle check
+    deadline  time.Time
+    index     int  // heap position, -1 when not queued
+    inFlight  bool // failover running; it requeues the entry when done
+}
+
+type failoverShard struct {
+    mu      sync.Mutex
+    queue   deadlineHeap
+    entries map[*Peer]*failoverEntry
+    wake    chan struct{}
+    slots   chan struct{}
+}
+
+// deadlineHeap implements heap.Interface, earliest deadline first
+type deadlineHeap []*failoverEntry
+
+func (h deadlineHeap) Len() int           { return len(h) }
+func (h deadlineHeap) Less(i, j int) bool { return h[i].deadline.Before(h[j].deadline) }
+
+func (h deadlineHeap) Swap(i, j int) {
+    h[i], h[j] = h[j], h[i]
+    h[i].index = i
+    h[j].index = j
+}
+
+func (h *deadlineHeap) Push(x any) {
+    e := x.(*failoverEntry)
+    e.index = len(*h)
+    *h = append(*h, e)
+}
+
+func (h *deadlineHeap) Pop() any {
+    old := *h
+    e := old[len(old)-1]
+    old[len(old)-1] = nil
+    *h = old[:len(old)-1]
+    e.index = -1
+    return e
+}
+
+func NewFailoverManager(vpn *UnderTheRadarVPN) *FailoverManager {
+    fm := &FailoverManager{
+        vpn:          vpn,
+        shards:       make([]*failoverShard, runtime.NumCPU()),
+        stop:         make(chan struct{}),
+        probe:        probeUDPEndpoint,
+        probeTimeout: 500 * time.Millisecond,
+    }
+    
+    for i := range fm.shards {
+        fm.shards[i] = &failoverShard{
+            entries: make(map[*Peer]*failoverEntry),
+            wake:    make(chan struct{}, 1),
+            slots:   make(chan struct{}, failoverSlots),
+        }
+    }
+    return fm
 }
 
 func (fm *FailoverManager) Start() {
-    ticker := time.NewTicker(fm.checkInterval)
-    defer ticker.Stop()
+    for _, shard := range fm.shards {
+        go fm.run(shard)
+    }
+    <-fm.stop
+}
+
+func (fm *FailoverManager) Stop() {
+    fm.stopOnce.Do(func() { close(fm.stop) })
+}
+
+func (fm *FailoverManager) shardFor(peer *Peer) *failoverShard {
+    key := peer.PublicKey
+    return fm.shards[binary.LittleEndian.Uint32(key[:4])%uint32(len(fm.shards))]
+}
+
+// Record a new handshake for peer, or start tracking a new peer when
+// handshake is zero, and push its deadline out accordingly
+func (fm *FailoverManager) Track(peer *Peer, handshake time.Time) {
+    base := handshake
+    if base.IsZero() {
+        base = time.Now() // grace period for the first handshake
+    }
+    peer.IsAlive.Store(true)
     
-    for range ticker.C {
-        fm.checkPeers()
+    shard := fm.shardFor(peer)
+    shard.mu.Lock()
+    defer shard.mu.Unlock()
+    
+    e := shard.entries[peer]
+    if e == nil {
+        e = &failoverEntry{peer: peer, index: -1}
+        shard.entries[peer] = e
+    }
+    e.handshake = handshake
+    e.rx, e.tx = peer.RxBytes.Load(), peer.TxBytes.Load()
+    shard.schedule(e, base.Add(handshakeStaleAfter))
+}
+
+// Re-evaluate peer now; collectMetrics calls it when latency or loss
+// crosses the failover thresholds
+func (fm *FailoverManager) Notify(peer *Peer) {
+    shard := fm.shardFor(peer)
+    shard.mu.Lock()
+    defer shard.mu.Unlock()
+    
+    if e := shard.entries[peer]; e != nil {
+        shard.schedule(e, time.Now())
     }
 }
 
-func (fm *FailoverManager) checkPeers() {
-    for _, peer := range fm.vpn.peers {
-        if !fm.isPeerHealthy(peer) {
-            fm.handlePeerFailure(peer)
+// Stop tracking a removed peer
+func (fm *FailoverManager) Forget(peer *Peer) {
+    shard := fm.shardFor(peer)
+    shard.mu.Lock()
+    defer shard.mu.Unlock()
+    
+    if e := shard.entries[peer]; e != nil {
+        if e.index >= 0 {
+            heap.Remove(&shard.queue, e.index)
         }
+        delete(shard.entries, peer)
     }
 }
 
-func (fm *FailoverManager) isPeerHealthy(peer *Peer) bool {
-    // Check last handshake time
-    if time.Since(peer.LastHandshake) > HandshakeTimeout {
-        return false
+// Caller holds s.mu
+func (s *failoverShard) schedule(e *failoverEntry, deadline time.Time) {
+    e.deadline = deadline
+    if e.inFlight {
+        return
+    }
+    if e.index < 0 {
+        heap.Push(&s.queue, e)
+    } else {
+        heap.Fix(&s.queue, e.index)
     }
     
-    // Check packet loss
-    if peer.PacketLoss.Load() > 500 { // 5%
-        return false
+    if s.queue[0] == e {
+        select {
+        case s.wake <- struct{}{}:
+        default:
+        }
     }
+}
+
+func (fm *FailoverManager) run(s *failoverShard) {
+    timer := time.NewTimer(time.Hour)
+    defer timer.Stop()
     
-    // Check latency
-    if peer.CurrentLatency.Load() > 200000 { // 200ms
-        return false
+    for {
+        s.mu.Lock()
+        now := time.Now()
+        for s.queue.Len() > 0 && !s.queue[0].deadline.After(now) {
+            e := heap.Pop(&s.queue).(*failoverEntry)
+            if fm.isPeerHealthy(e, now) {
+                e.deadline = e.handshake.Add(handshakeStaleAfter)
+                if !e.deadline.After(now) {
+                    // Idle: compare traffic against this check next time
+                    e.rx, e.tx = e.peer.RxBytes.Load(), e.peer.TxBytes.Load()
+                    e.deadline = now.Add(idleRecheckAfter)
+                }
+                heap.Push(&s.queue, e)
+                continue
+            }
+            e.inFlight = true
+            go fm.failover(s, e)
+        }
+        
+        wait := time.Hour
+        if s.queue.Len() > 0 {
+            wait = s.queue[0].deadline.Sub(now)
+        }
+        s.mu.Unlock()
+        
+        if !timer.Stop() {
+            select {
+            case <-timer.C:
+            default:
+            }
+        }
+        timer.Reset(wait)
+        
+        select {
+        case <-timer.C:
+        case <-s.wake:
+        case <-fm.stop:
+            return
+        }
+    }
+}
+
+func (fm *FailoverManager) failover(s *failoverShard, e *failoverEntry) {
+    s.slots <- struct{}{}
+    fm.handlePeerFailure(e.peer)
+    <-s.slots
+    
+    s.mu.Lock()
+    defer s.mu.Unlock()
+    
+    e.inFlight = false
+    if s.entries[e.peer] != e {
+        return // removed meanwhile
     }
     
-    return true
+    // Give the new endpoint time to handshake unless one already landed
+    deadline := e.deadline
+    if now := time.Now(); !deadline.After(now) {
+        deadline = now.Add(HandshakeTimeout)
+    }
+    s.schedule(e, deadline)
+}
+
+// Caller holds the shard lock
+func (fm *FailoverManager) isPeerHealthy(e *failoverEntry, now time.Time) bool {
+    peer := e.peer
+    
+    // A stale handshake (or none after the grace period) is only a failure
+    // if the peer should have rekeyed: keepalives force handshakes, and so
+    // does sending to it unless nothing comes back. Idle peers are fine.
+    if e.handshake.IsZero() || now.Sub(e.handshake) >= handshakeStaleAfter {
+        sending := peer.TxBytes.Load() != e.tx
+        answering := peer.RxBytes.Load() != e.rx
+        if peer.Keepalive.Load() || (sending && !answering) {
+            return false
+        }
+    }
+    
+    return !degraded(peer.CurrentLatency.Load(), peer.PacketLoss.Load())
+}
+
+func degraded(latency, loss uint32) bool {
+    return loss > failoverMaxLoss || latency > failoverMaxLatency
 }
 
 func (fm *FailoverManager) handlePeerFailure(peer *Peer) {
-    // Try alternate endpoints
-    for _, endpoint := range peer.AlternateEndpoints {
-        peer.Endpoint = &endpoint
-        
-        // Reconfigure peer with new endpoint
-        cfg := wgtypes.Config{
-            Peers: []wgtypes.PeerConfig{{
-                PublicKey: peer.PublicKey,
-                Endpoint:  &endpoint,
-                UpdateOnly: true,
-            }},
+    // Probe all alternate endpoints at once
+    endpoint := fm.probeAlternates(peer)
+    if endpoint == nil {
+        // Mark peer as dead if all endpoints fail
+        peer.IsAlive.Store(false)
+        return
+    }
+    
+    // Reconfigure peer with new endpoint
+    cfg := wgtypes.Config{
+        Peers: []wgtypes.PeerConfig{{
+            PublicKey: peer.PublicKey,
+            Endpoint:  endpoint,
+            UpdateOnly: true,
+        }},
+    }
+    
+    if err := fm.vpn.wgClient.ConfigureDevice(fm.vpn.deviceName, cfg); err != nil {
+        peer.IsAlive.Store(false)
+        return
+    }
+    
+    fm.vpn.mu.Lock()
+    peer.Endpoint = endpoint
+    fm.vpn.mu.Unlock()
+}
+
+// First alternate to pass the probe, or nil if none does in time
+func (fm *FailoverManager) probeAlternates(peer *Peer) *net.UDPAddr {
+    fm.vpn.mu.RLock()
+    current := peer.Endpoint.String()
+    fm.vpn.mu.RUnlock()
+    
+    results := make(chan *net.UDPAddr, len(peer.AlternateEndpoints))
+    probes := 0
+    for i := range peer.AlternateEndpoints {
+        endpoint := &peer.AlternateEndpoints[i]
+        if endpoint.String() == current {
+            continue
         }
         
-        if err := fm.vpn.wgClient.ConfigureDevice(fm.vpn.deviceName, cfg); err == nil {
-            // Test new endpoint
-            if fm.testEndpoint(peer) {
-                return // Success
+        probes++
+        go func() {
+            if fm.probe(endpoint, fm.probeTimeout) != nil {
+                endpoint = nil
             }
+            results <- endpoint
+        }()
+    }
+    
+    for ; probes > 0; probes-- {
+        if endpoint := <-results; endpoint != nil {
+            return endpoint
+        }
+    }
+    return nil
+}
+
+// Default probe. A connected UDP socket reports ICMP unreachable as a read
+// error; WireGuard stays silent to unauthenticated datagrams, so a reply
+// or silence until timeout both pass. The chosen endpoint must still
+// complete a handshake before its deadline comes round again.
+func probeUDPEndpoint(endpoint *net.UDPAddr, timeout time.Duration) error {
+    conn, err := net.DialUDP("udp", nil, endpoint)
+    if err != nil {
+        return err
+    }
+    defer conn.Close()
+    
+    if _, err := conn.Write([]byte{0}); err != nil {
+        return err
+    }
+    
+    conn.SetReadDeadline(time.Now().Add(timeout))
+    var buf [1]byte
+    if _, err := conn.Read(buf[:]); err != nil {
+        var netErr net.Error
+        if errors.As(err, &netErr) && netErr.Timeout() {
+            return nil
+        }
+        return err
+    }
+    return nil
+}
+
+// XDPDropReason mirrors enum drop_reason in xdp_accelerator.c
+type XDPDropReason int
+
+const (
+    DropNone XDPDropReason = iota
+    DropBounds
+    DropRateLimit
+    DropFragment
+    DropTTL
+    DropSYN
+    DropRunt
+    DropUnknownSession
+    DropReasonMax
+)
+
+var dropReasonNames = [DropReasonMax]string{
+    "none", "bounds", "rate_limit", "fragment", "ttl", "syn", "runt", "unknown_session",
+}
+
+func (r XDPDropReason) String() string {
+    if r < 0 || r >= DropReasonMax {
+        return "invalid"
+    }
+    return dropReasonNames[r]
+}
+
+// XDPStats mirrors struct vpn_stats, summed over all CPUs
+type XDPStats struct {
+    RxPackets      uint64
+    RxBytes        uint64
+    TxPackets      uint64
+    TxBytes        uint64
+    DroppedPackets uint64
+    Drops          [DropReasonMax]uint64
+}
+
+// Latest XDP counters gathered by collectMetrics
+func (vpn *UnderTheRadarVPN) XDPStats() *XDPStats {
+    return vpn.xdpStats.Load()
+}
+
+// Read the XDP counters now rather than waiting for collectMetrics
+func (vpn *UnderTheRadarVPN) RefreshXDPStats() (*XDPStats, error) {
+    stats, err := vpn.readXDPStats()
+    if err != nil {
+        return nil, err
+    }
+    vpn.xdpStats.Store(stats)
+    return stats, nil
+}
+
+// Attach the XDP filter to an extra interface, e.g. a benchmark veth.
+// The caller owns the returned link.
+func (vpn *UnderTheRadarVPN) AttachXDP(ifname string) (link.Link, error) {
+    iface, err := net.InterfaceByName(ifname)
+    if err != nil {
+        return nil, err
+    }
+    l, err := link.AttachXDP(link.XDPOptions{
+        Program:   vpn.xdpProgram,
+        Interface: iface.Index,
+    })
+    if err != nil {
+        return nil, fmt.Errorf("failed to attach XDP to %s: %w", ifname, err)
+    }
+    return l, nil
+}
+
+func (vpn *UnderTheRadarVPN) readXDPStats() (*XDPStats, error) {
+    m, err := vpn.ebpfMap("stats_map")
+    if err != nil {
+        return nil, err
+    }
+    
+    var perCPU []XDPStats
+    if err := m.Lookup(uint32(0), &perCPU); err != nil {
+        return nil, fmt.Errorf("failed to read XDP stats: %w", err)
+    }
+    
+    total := &XDPStats{}
+    for _, s := range perCPU {
+        total.RxPackets += s.RxPackets
+        total.RxBytes += s.RxBytes
+        total.TxPackets += s.TxPackets
+        total.TxBytes += s.TxBytes
+        total.DroppedPackets += s.DroppedPackets
+        for reason, n := range s.Drops {
+            total.Drops[reason] += n
+        }
+    }
+    return total, nil
+}
+
+// XDPStage mirrors enum xdp_stage in xdp_accelerator.c
+type XDPStage uint32
+
+const (
+    StageRateLimit XDPStage = iota
+    StageSession
+    StageFlow
+    StageDDoS
+    
+    pipelineMaxStages = 8
+    stageNone         = 0xff // empty slot, skipped by the tail-call loop
+)
+
+// DDoSCheck selects individual heuristics of the DDoS stage
+type DDoSCheck uint32
+
+const (
+    DDoSCheckFragment DDoSCheck = 1 << iota
+    DDoSCheckTTL
+    DDoSCheckSYN
+    DDoSCheckRunt
+    
+    DDoSCheckAll = DDoSCheckFragment | DDoSCheckTTL | DDoSCheckSYN | DDoSCheckRunt
+    
+    ddosChecksSet = 1 << 31 // DDOS_CHECKS_SET: the mask applies without a stage list
+)
+
+// pipelineConfig mirrors struct pipeline_config in xdp_accelerator.c
+type pipelineConfig struct {
+    Count      uint32
+    DDoSChecks uint32
+    Stages     [pipelineMaxStages]uint32
+}
+
+// Reorder or disable XDP stages and DDoS heuristics without reloading the
+// program; the next packet picks up the new pipeline. A nil stages slice
+// restores the default stage order; checks applies either way. Stages
+// can run in any order: CPU steering waits for the end of the pipeline.
+func (vpn *UnderTheRadarVPN) SetXDPPipeline(stages []XDPStage, checks DDoSCheck) error {
+    m, err := vpn.ebpfMap("pipeline_config_map")
+    if err != nil {
+        return err
+    }
+    if len(stages) > pipelineMaxStages {
+        return fmt.Errorf("too many XDP stages: %d (max %d)", len(stages), pipelineMaxStages)
+    }
+    
+    cfg := pipelineConfig{DDoSChecks: uint32(checks&DDoSCheckAll) | ddosChecksSet}
+    if stages != nil {
+        cfg.Count = uint32(len(stages))
+        for i, s := range stages {
+            cfg.Stages[i] = uint32(s)
         }
+        // Count 0 means default, so an empty pipeline gets one empty slot
+        if cfg.Count == 0 {
+            cfg.Count = 1
+            cfg.Stages[0] = stageNone
+        }
+    }
+    
+    if err := m.Update(uint32(0), &cfg, ebpf.UpdateAny); err != nil {
+        return fmt.Errorf("failed to update XDP pipeline: %w", err)
+    }
+    return nil
+}
+
+// RxTuning mirrors the kernel module's per-device receive settings in
+// /sys/class/net/<dev>/undertheradar. With Adaptive set the NAPI weight
+// and rx_queue limit follow the backlog within their bounds: the limit
+// grows as soon as the queue fills and decays back after a few quiet
+// seconds. Pinning a value means setting its min and max equal.
+type RxTuning struct {
+    Adaptive      bool
+    NAPIWeightMin uint32
+    NAPIWeightMax uint32
+    RxQueueMin    uint32
+    RxQueueMax    uint32
+    
+    // Keep NAPI scheduled this long after the last datagram instead of
+    // waiting for the next wakeup; burns a core per device. 0 disables.
+    BusyPoll      time.Duration
+}
+
+var (
+    DefaultRxTuning = RxTuning{
+        Adaptive:      true,
+        NAPIWeightMin: 8,
+        NAPIWeightMax: 256,
+        RxQueueMin:    1024,
+        RxQueueMax:    8192,
     }
     
-    // Mark peer as dead if all endpoints fail
-    peer.IsAlive.Store(false)
+    // Small rounds, spinning for 50us between datagrams; rx_queue stays
+    // at the 1024 floor so a standing queue cannot add delay
+    LowLatencyRxTuning = RxTuning{
+        Adaptive:      true,
+        NAPIWeightMin: 8,
+        NAPIWeightMax: 64,
+        RxQueueMin:    1024,
+        RxQueueMax:    1024,
+        BusyPoll:      50 * time.Microsecond,
+    }
+)
+
+// Apply receive tuning to the module's device without reloading it
+func (vpn *UnderTheRadarVPN) SetRxTuning(t RxTuning) error {
+    dir := filepath.Join("/sys/class/net", vpn.deviceName, "undertheradar")
+    
+    adaptive := uint32(0)
+    if t.Adaptive {
+        adaptive = 1
+    }
+    if err := writeRxTuning(dir, "adaptive", adaptive); err != nil {
+        return err
+    }
+    if err := writeRxBounds(dir, "napi_weight", t.NAPIWeightMin, t.NAPIWeightMax); err != nil {
+        return err
+    }
+    if err := writeRxBounds(dir, "rx_queue", t.RxQueueMin, t.RxQueueMax); err != nil {
+        return err
+    }
+    return writeRxTuning(dir, "busy_poll_usecs", uint32(t.BusyPoll/time.Microsecond))
+}
+
+// The module rejects min > max at every step, so widen towards the new
+// range first: max then min, or min then max if the new max is below the
+// old min
+func writeRxBounds(dir, name string, lo, hi uint32) error {
+    if lo > hi {
+        return fmt.Errorf("%s: min %d above max %d", name, lo, hi)
+    }
+    if writeRxTuning(dir, name+"_max", hi) == nil {
+        return writeRxTuning(dir, name+"_min", lo)
+    }
+    if err := writeRxTuning(dir, name+"_min", lo); err != nil {
+        return err
+    }
+    return writeRxTuning(dir, name+"_max", hi)
+}
+
+func writeRxTuning(dir, name string, val uint32) error {
+    if err := os.WriteFile(filepath.Join(dir, name), []byte(strconv.FormatUint(uint64(val), 10)), 0); err != nil {
+        return fmt.Errorf("failed to set %s: %w", name, err)
+    }
+    return nil
 }
 
 // Performance monitoring and optimization
 func (vpn *UnderTheRadarVPN) collectMetrics() {
+    // XDP counters first; they matter most while under attack
+    if stats, err := vpn.readXDPStats(); err == nil {
+        vpn.xdpStats.Store(stats)
+    }
+    
     device, err := vpn.wgClient.Device(vpn.deviceName)
     if err != nil {
         return
     }
     
-    for _, wgPeer := range device.Peers {
-        peer, exists := vpn.peers[wgPeer.PublicKey.String()]
+    now := time.Now()
+    vpn.mu.RLock()
+    peers := vpn.peers
+    vpn.mu.RUnlock()
+    
+    changed := false
+    for i := range device.Peers {
+        wgPeer := &device.Peers[i]
+        peer, exists := peers[wgPeer.PublicKey]
         if !exists {
             continue
         }
         
-        // Update metrics
-        peer.LastHandshake = wgPeer.LastHandshakeTime
-        peer.RxBytes.Store(uint64(wgPeer.ReceiveBytes))
-        peer.TxBytes.Store(uint64(wgPeer.TransmitBytes))
+        handshook := !wgPeer.LastHandshakeTime.Equal(peer.LastHandshake)
+        wasDegraded := degraded(peer.sample.latency, peer.sample.loss)
+        peer.Keepalive.Store(wgPeer.PersistentKeepaliveInterval > 0)
         
-        // Calculate load score
-        load := peer.RxBytes.Load() + peer.TxBytes.Load()
-        latency := uint64(peer.CurrentLatency.Load())
-        packetLoss := uint64(peer.PacketLoss.Load())
+        if peer.updateLoad(uint64(wgPeer.ReceiveBytes), uint64(wgPeer.TransmitBytes),
+            wgPeer.LastHandshakeTime, now) {
+            changed = true
+        }
         
-        // Weighted score: bandwidth + (latency * 1000) + (packet_loss * 10000)
-        score := load + (latency * 1000) + (packetLoss * 10000)
-        peer.LoadScore.Store(score)
+        // New handshakes push the peer's failover deadline out; crossing
+        // the loss or latency threshold has it re-evaluated right away
+        if handshook {
+            vpn.failoverMgr.Track(peer, wgPeer.LastHandshakeTime)
+        }
+        if !wasDegraded && degraded(peer.sample.latency, peer.sample.loss) {
+            vpn.failoverMgr.Notify(peer)
+        }
     }
+    
+    // Re-rank route candidates against the new scores. The copy is built
+    // without the lock; if a writer swapped the table meanwhile, the next
+    // tick re-ranks theirs.
+    if changed {
+        old := vpn.routes.Load()
+        if next := old.resorted(); next != old {
+            vpn.mu.Lock()
+            vpn.routes.CompareAndSwap(old, next)
+            vpn.mu.Unlock()
+        }
+    }
+}
+
+// Fold a counter sample into the peer's load score. The score tracks the
+// current byte rate rather than lifetime totals, so long-lived peers are
+// not penalised. Idle peers whose score has fully decayed cost nothing
+// and report false.
+func (peer *Peer) updateLoad(rx, tx uint64, handshake, now time.Time) bool {
+    s := &peer.sample
+    latency := peer.CurrentLatency.Load()
+    packetLoss := peer.PacketLoss.Load()
+    
+    if rx == s.rx && tx == s.tx && s.rate == 0 && latency == s.latency &&
+        packetLoss == s.loss && handshake.Equal(peer.LastHandshake) {
+        s.at = now
+        return false
+    }
+    
+    // No rate on the first sample or after a counter reset
+    var rate float64
+    if !s.at.IsZero() && rx >= s.rx && tx >= s.tx {
+        if dt := now.Sub(s.at).Seconds(); dt > 0 {
+            rate = float64(rx-s.rx+tx-s.tx) / dt
+        }
+    }
+    s.rate += loadEWMAAlpha * (rate - s.rate)
+    if s.rate < 1 {
+        s.rate = 0
+    }
+    s.at, s.rx, s.tx = now, rx, tx
+    s.latency, s.loss = latency, packetLoss
+    
+    // Update metrics
+    peer.LastHandshake = handshake
+    peer.RxBytes.Store(rx)
+    peer.TxBytes.Store(tx)
+    
+    // Weighted score: bandwidth + (latency * 1000) + (packet_loss * 10000)
+    score := uint64(s.rate) + uint64(latency)*1000 + uint64(packetLoss)*10000
+    peer.LoadScore.Store(score)
+    return true
 }
 
 // Graceful shutdown
@@ -556,8 +2117,15 @@ func (vpn *UnderTheRadarVPN) Stop() error {
     
     // Stop health checks
     vpn.healthCheck.Stop()
+    vpn.failoverMgr.Stop()
     
     // Detach eBPF programs
+    if vpn.flowReader != nil {
+        vpn.flowReader.Close()
+    }
+    vpn.StopAFXDP()
+    vpn.StopTelemetry()
+    vpn.DisableSessionValidation()
     if vpn.xdpProgram != nil {
         vpn.xdpProgram.Close()
     }
@@ -7,6 +7,7 @@
 #include <linux/tcp.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
+#include <bpf/bpf_tracing.h>
 
 #define MAX_PEERS 10000
 #define WIREGUARD_PORT 51820
@@ -18,6 +19,70 @@
 #define WIREGUARD_MESSAGE_HANDSHAKE_COOKIE 3
 #define WIREGUARD_MESSAGE_DATA 4
 
+/* CPU steering modes for established data flows */
+#define STEER_MODE_OFF 0
+#define STEER_MODE_RECEIVER 1     /* hash of the WireGuard receiver index */
+#define STEER_MODE_FLOW 2         /* hash of the outer UDP flow */
+#define STEER_TABLE_SIZE 256
+
+struct steering_config {
+    __u32 mode;
+    __u32 slots;          /* populated entries in steering_table */
+};
+
+/* CPU redirect map for RSS; value is the per-CPU queue size */
+struct {
+    __uint(type, BPF_MAP_TYPE_CPUMAP);
+    __uint(max_entries, MAX_CPU);
+    __type(key, __u32);
+    __type(value, __u32);
+} cpu_map SEC(".maps");
+
+/* Weighted slot -> CPU table; a CPU with weight w owns w slots */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, STEER_TABLE_SIZE);
+    __type(key, __u32);
+    __type(value, __u32);
+} steering_table SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct steering_config);
+} steering_config_map SEC(".maps");
+
+/* IPv6 extension header walking */
+#define IPV6_MAX_EXT_HEADERS 6
+
+#ifndef IP6_OFFSET
+#define IP6_OFFSET 0xfff8
+#endif
+
+struct ipv6_frag_hdr {
+    __u8 nexthdr;
+    __u8 reserved;
+    __be16 frag_off;
+    __be32 identification;
+} __attribute__((packed));
+
+/* Session validation: counters older than the window below the last
+ * authenticated one can never be accepted by the module's replay check.
+ * Sessions die with their keys, three REJECT_AFTER_TIMEs after creation.
+ */
+#define SESSION_REPLAY_WINDOW 8192
+#define SESSION_REJECT_AFTER_MESSAGES (~0ULL - 8192 - 1)
+#define SESSION_LIFETIME_NS (3ULL * 180 * 1000000000ULL)
+#define MAX_SESSIONS (MAX_PEERS * 3)
+
+/* WireGuard counters are little-endian on the wire */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define wg_le64_to_cpu(x) (x)
+#else
+#define wg_le64_to_cpu(x) __builtin_bswap64(x)
+#endif
+
 struct wireguard_header {
     __u8 type;
     __u8 reserved[3];
@@ -25,6 +90,104 @@ struct wireguard_header {
     __u64 counter;
 } __attribute__((packed));
 
+/* Live sessions keyed by our receiver index, fed from the kernel module's
+ * session anchors by the fentry programs at the end of this file
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_SESSIONS);
+    __type(key, __u32);   /* receiver index, wire byte order */
+    __type(value, struct wg_session);
+} sessions SEC(".maps");
+
+struct wg_session {
+    __u64 established;    /* ktime of the handshake */
+    __u64 counter_floor;  /* last counter reported as authenticated */
+};
+
+/* Enforcement stays off until the control plane has attached the feeders */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+} session_enforce SEC(".maps");
+
+/* Pipeline stages, tail-called in the order given by pipeline_config */
+enum xdp_stage {
+    STAGE_RATE_LIMIT,
+    STAGE_SESSION,
+    STAGE_FLOW,
+    STAGE_DDOS,
+    STAGE_MAX
+};
+
+#define PIPELINE_MAX_STAGES 8
+
+/* Individually switchable DDoS heuristics */
+#define DDOS_CHECK_FRAGMENT 0x1
+#define DDOS_CHECK_TTL 0x2
+#define DDOS_CHECK_SYN 0x4
+#define DDOS_CHECK_RUNT 0x8
+#define DDOS_CHECK_ALL 0xf
+#define DDOS_CHECKS_SET 0x80000000  /* ddos_checks was configured */
+
+/* count == 0 runs every stage in enum order; without DDOS_CHECKS_SET
+ * every check is enabled
+ */
+struct pipeline_config {
+    __u32 count;
+    __u32 ddos_checks;
+    __u32 stages[PIPELINE_MAX_STAGES];
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct pipeline_config);
+} pipeline_config_map SEC(".maps");
+
+/* Parse results handed from one stage to the next; tail calls stay on
+ * the same CPU, so a per-CPU slot is private to the packet
+ */
+#define PKT_OFF_MASK 0x1ff
+
+struct pkt_ctx {
+    __u16 l3_off;
+    __u16 l4_off;
+    __u8 family;
+    __u8 proto;
+    __u8 fragmented;
+    __u8 wireguard;        /* UDP to WIREGUARD_PORT with a full header */
+    __u32 stage;           /* next pipeline slot */
+    __u32 steer_hash;      /* receive core picked by the flow stage */
+    __u8 steer;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct pkt_ctx);
+} pkt_scratch SEC(".maps");
+
+/* AF_XDP sockets of the userspace data plane, one per RX queue */
+struct {
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
+    __uint(max_entries, MAX_CPU);
+    __type(key, __u32);
+    __type(value, __u32);
+} xsks_map SEC(".maps");
+
+/* Non-zero while the userspace engine is running */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+} xsk_config SEC(".maps");
+
 /* Per-CPU statistics for lock-free updates */
 struct {
     __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
@@ -33,24 +196,29 @@ struct {
     __type(value, struct vpn_stats);
 } stats_map SEC(".maps");
 
+/* Why XDP dropped a packet; one counter per reason */
+enum drop_reason {
+    DROP_NONE,
+    DROP_BOUNDS,           /* truncated headers */
+    DROP_RATE_LIMIT,
+    DROP_FRAGMENT,
+    DROP_TTL,
+    DROP_SYN,
+    DROP_RUNT,
+    DROP_UNKNOWN_SESSION,
+    DROP_REASON_MAX
+};
+
+/* Each CPU owns its copy, so plain increments suffice */
 struct vpn_stats {
     __u64 rx_packets;
     __u64 rx_bytes;
     __u64 tx_packets;
     __u64 tx_bytes;
     __u64 dropped_packets;
-    __u64 invalid_packets;
+    __u64 drops[DROP_REASON_MAX];
 };
 
-/* Peer lookup table using LPM trie for efficient IP matching */
-struct {
-    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
-    __uint(max_entries, MAX_PEERS);
-    __uint(key_size, sizeof(struct bpf_lpm_trie_key) + sizeof(__u32));
-    __uint(value_size, sizeof(struct peer_info));
-    __uint(map_flags, BPF_F_NO_PREALLOC);
-} peer_lookup SEC(".maps");
-
 struct peer_info {
     __u32 peer_id;
     __u8 public_key[32];
@@ -61,6 +229,15 @@ struct peer_info {
     __u64 last_handshake;
 };
 
+/* Peer lookup table using LPM trie for efficient IP matching */
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, MAX_PEERS);
+    __uint(key_size, sizeof(struct bpf_lpm_trie_key) + sizeof(__u32));
+    __uint(value_size, sizeof(struct peer_info));
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} peer_lookup SEC(".maps");
+
 /* Connection tracking for stateful filtering */
 struct {
     __uint(type, BPF_MAP_TYPE_LRU_HASH);
@@ -77,177 +254,1047 @@ struct flow_key {
     __u8 protocol;
 } __attribute__((packed));
 
+/* IPv6 flows live in their own table so v4 keys stay 13 bytes */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 1000000);
+    __type(key, struct flow_key6);
+    __type(value, struct flow_state);
+} flow_table6 SEC(".maps");
+
+struct flow_key6 {
+    struct in6_addr src_ip;
+    struct in6_addr dst_ip;
+    __be16 src_port;
+    __be16 dst_port;
+    __u8 protocol;
+} __attribute__((packed));
+
 struct flow_state {
     __u64 packets;
     __u64 bytes;
     __u64 last_seen;
+    __u64 last_export;
     __u8 state;
 };
 
-/* Rate limiting using token bucket */
+/* Flow accounting is sampled: one packet in sample_rate updates the shared
+ * entry, scaled up, so the common case is a lookup with no stores
+ */
+struct flow_config {
+    __u32 sample_rate;     /* 1 = every packet, 0 = default */
+    __u32 pad;
+    __u64 export_interval; /* ns between records for one flow, 0 = default */
+};
+
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct flow_config);
+} flow_config_map SEC(".maps");
+
+/* Aggregate flow records for the control plane */
+struct flow_record {
+    struct in6_addr src_ip;  /* IPv4 flows are v4-mapped */
+    struct in6_addr dst_ip;
+    __be16 src_port;
+    __be16 dst_port;
+    __u8 protocol;
+    __u8 pad[3];
+    __u64 packets;
+    __u64 bytes;
+    __u64 last_seen;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 1 << 20);
+} flow_events SEC(".maps");
+
+/* Rate limiting using per-CPU token buckets; each CPU only ever touches
+ * its own copy, so no atomics and no cross-queue contention. LRU eviction
+ * keeps a spoofed-source flood from filling the map.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
     __uint(max_entries, 100000);
     __type(key, __be32);  /* Source IP */
     __type(value, struct rate_limit);
 } rate_limit_map SEC(".maps");
 
+/* IPv6 sources are limited per /64, since a single client usually owns
+ * the whole prefix and can rotate addresses within it freely
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __uint(max_entries, 100000);
+    __type(key, __u64);  /* Source /64 prefix */
+    __type(value, struct rate_limit);
+} rate_limit_map6 SEC(".maps");
+
 struct rate_limit {
     __u64 tokens;
     __u64 last_update;
+    __u64 carry;          /* refill remainder, in tokens x ns / s */
+};
+
+/* Global per-source budget, set by the control plane at runtime */
+struct rate_limit_config {
+    __u64 rate;           /* packets per second per source */
+    __u64 burst;          /* packets */
+    __u32 pad;
+    __u32 enabled;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct rate_limit_config);
+} rate_limit_config_map SEC(".maps");
+
+/* Per-peer pacing state, keyed by the peer's endpoint. The control plane
+ * sets rate and horizon; the datapath owns t_last.
+ */
+struct pacing_key {
+    struct in6_addr addr;  /* IPv4 endpoints are v4-mapped */
+    __be16 port;
+    __u16 pad;
+};
+
+struct pacing_state {
+    __u64 rate;            /* bytes per second, 0 = unpaced */
+    __u64 horizon;         /* ns of backlog before dropping, 0 = default */
+    __u64 t_last;          /* departure time of the last packet */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_PEERS);
+    __type(key, struct pacing_key);
+    __type(value, struct pacing_state);
+} pacing_map SEC(".maps");
+
+#define RATE_LIMIT_DEFAULT_RATE 10000  /* 10k packets per second */
+#define RATE_LIMIT_DEFAULT_BURST 1000  /* Burst of 1000 packets */
+#define RATE_LIMIT_MAX_RATE (16ULL * 1000000ULL)  /* keeps elapsed * rate in 64 bits */
+
+#define FLOW_DEFAULT_SAMPLE_RATE 16
+#define FLOW_DEFAULT_EXPORT_NS (10ULL * 1000000000ULL)
+
+#define PACING_DEFAULT_HORIZON_NS (2ULL * 1000000000ULL)
+
+#define QOS_PORTS 65536
+#define QOS_MAX_PREFIXES 1024
+#define QOS_MAX_CLASSES 16
+#define QOS_RULE_ACTIVE 0x1
+#define QOS_DSCP_KEEP 0xff
+
+/* QoS classifier: per-port rules in an array and per-destination rules in
+ * an LPM trie, both double-buffered by generation. The control plane
+ * fills the inactive generation, then flips qos_config.gen.
+ */
+struct qos_rule {
+    __u8 flags;
+    __u8 dscp;             /* QOS_DSCP_KEEP leaves the mark alone */
+    __u8 class;            /* index into qos_class_stats */
+    __u8 pad;
+    __u32 priority;        /* skb->priority for qdisc band selection, 0 = keep */
+};
+
+struct qos_config {
+    __u32 gen;
+};
+
+struct qos_prefix_key {
+    struct bpf_lpm_trie_key lpm;
+    __u32 gen;             /* always part of the matched prefix */
+    struct in6_addr addr;  /* IPv4 destinations are v4-mapped */
+};
+
+struct qos_class_stats {
+    __u64 packets;
+    __u64 bytes;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 2 * QOS_PORTS);
+    __type(key, __u32);
+    __type(value, struct qos_rule);
+} qos_ports SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, 2 * QOS_MAX_PREFIXES);
+    __type(key, struct qos_prefix_key);
+    __type(value, struct qos_rule);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} qos_prefixes SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct qos_config);
+} qos_config SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, QOS_MAX_CLASSES);
+    __type(key, __u32);
+    __type(value, struct qos_class_stats);
+} qos_class_stats SEC(".maps");
+
+#ifndef READ_ONCE
+#define READ_ONCE(x) (*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile typeof(x) *)&(x) = (v))
+#endif
+
+static __always_inline bool xsk_enabled(void)
+{
+    __u32 key = 0, *enabled;
+    
+    enabled = bpf_map_lookup_elem(&xsk_config, &key);
+    return enabled && *enabled;
+}
+
+/* Drop data packets that cannot belong to a live session: unknown or
+ * expired receiver index, exhausted counter, or a counter so far behind
+ * the authenticated one that the replay window must reject it.
+ */
+static __always_inline bool session_valid(struct wireguard_header *wg)
+{
+    struct wg_session *session;
+    __u32 key = 0, index = wg->sender, *enforce;
+    __u64 counter;
+    
+    enforce = bpf_map_lookup_elem(&session_enforce, &key);
+    if (!enforce || !*enforce)
+        return true;
+    
+    session = bpf_map_lookup_elem(&sessions, &index);
+    if (!session)
+        return false;
+    
+    if (bpf_ktime_get_ns() - session->established > SESSION_LIFETIME_NS) {
+        bpf_map_delete_elem(&sessions, &index);
+        return false;
+    }
+    
+    counter = wg_le64_to_cpu(wg->counter);
+    if (counter >= SESSION_REJECT_AFTER_MESSAGES)
+        return false;
+    if (counter + SESSION_REPLAY_WINDOW < session->counter_floor)
+        return false;
+    
+    return true;
+}
+
+static __always_inline int xdp_drop(struct vpn_stats *stats, enum drop_reason reason)
+{
+    if (stats) {
+        stats->dropped_packets++;
+        stats->drops[reason]++;
+    }
+    return XDP_DROP;
+}
+
+/* Sampled accounting for an established flow. Returns true when the flow
+ * is due for an export record.
+ */
+static __always_inline bool flow_account(struct flow_state *state, __u64 len)
+{
+    __u64 interval = FLOW_DEFAULT_EXPORT_NS, now;
+    __u32 rate = FLOW_DEFAULT_SAMPLE_RATE;
+    struct flow_config *cfg;
+    __u32 key = 0;
+    
+    cfg = bpf_map_lookup_elem(&flow_config_map, &key);
+    if (cfg) {
+        if (cfg->sample_rate)
+            rate = cfg->sample_rate;
+        if (cfg->export_interval)
+            interval = cfg->export_interval;
+    }
+    
+    if (rate > 1 && bpf_get_prandom_u32() % rate)
+        return false;
+    
+    now = bpf_ktime_get_ns();
+    __sync_fetch_and_add(&state->packets, rate);
+    __sync_fetch_and_add(&state->bytes, len * rate);
+    state->last_seen = now;
+    
+    if (now - state->last_export < interval)
+        return false;
+    state->last_export = now;
+    return true;
+}
+
+static __always_inline void flow_export(const struct in6_addr *src, const struct in6_addr *dst,
+                                        __be16 sport, __be16 dport, struct flow_state *state)
+{
+    struct flow_record *rec;
+    
+    rec = bpf_ringbuf_reserve(&flow_events, sizeof(*rec), 0);
+    if (!rec)
+        return;
+    
+    rec->src_ip = *src;
+    rec->dst_ip = *dst;
+    rec->src_port = sport;
+    rec->dst_port = dport;
+    rec->protocol = IPPROTO_UDP;
+    __builtin_memset(rec->pad, 0, sizeof(rec->pad));
+    rec->packets = state->packets;
+    rec->bytes = state->bytes;
+    rec->last_seen = state->last_seen;
+    bpf_ringbuf_submit(rec, 0);
+}
+
+/* First data packet of a flow; later packets take the fast path */
+static __always_inline void flow_start(void *map, void *flow, __u64 len)
+{
+    __u64 now = bpf_ktime_get_ns();
+    struct flow_state state = {
+        .packets = 1,
+        .bytes = len,
+        .last_seen = now,
+        .last_export = now
+    };
+    
+    bpf_map_update_elem(map, flow, &state, BPF_NOEXIST);
+}
+
+/* Spread receive across cores: hash the packet onto a weighted slot
+ * table filled by the control plane, so every packet of one peer lands on
+ * the same CPU and different peers fan out. The module decrypts there too
+ * while its crypt_on_rx_cpu knob is set. Falls back to the local stack if
+ * steering is off or the chosen CPU has no cpu_map entry.
+ */
+static __always_inline int steer_to_cpu(struct steering_config *cfg, __u32 hash)
+{
+    __u32 slot, *cpu;
+    
+    if (!cfg || cfg->mode == STEER_MODE_OFF || !cfg->slots)
+        return XDP_PASS;
+    
+    /* Fibonacci hashing, then scale onto the populated slots */
+    hash *= 0x9e3779b1;
+    slot = ((__u64)hash * cfg->slots) >> 32;
+    if (slot >= STEER_TABLE_SIZE)
+        return XDP_PASS;
+    
+    cpu = bpf_map_lookup_elem(&steering_table, &slot);
+    if (!cpu)
+        return XDP_PASS;
+    
+    return bpf_redirect_map(&cpu_map, *cpu, XDP_PASS);
+}
+
+static __always_inline __u32 steer_hash_v4(struct iphdr *ip, struct udphdr *udp,
+                                           struct wireguard_header *wg,
+                                           struct steering_config *cfg)
+{
+    if (cfg && cfg->mode == STEER_MODE_RECEIVER)
+        return wg->sender;
+    return ip->saddr ^ ip->daddr ^ ((__u32)udp->source << 16 | udp->dest);
+}
+
+static __always_inline __u32 steer_hash_v6(struct ipv6hdr *ip6, struct udphdr *udp,
+                                           struct wireguard_header *wg,
+                                           struct steering_config *cfg)
+{
+    __u32 hash;
+    int i;
+    
+    if (cfg && cfg->mode == STEER_MODE_RECEIVER)
+        return wg->sender;
+    
+    hash = (__u32)udp->source << 16 | udp->dest;
+#pragma unroll
+    for (i = 0; i < 4; i++)
+        hash ^= ip6->saddr.in6_u.u6_addr32[i] ^ ip6->daddr.in6_u.u6_addr32[i];
+    return hash;
+}
+
+static __always_inline struct steering_config *get_steering_config(void)
+{
+    __u32 key = 0;
+    
+    return bpf_map_lookup_elem(&steering_config_map, &key);
+}
+
+/* Walk the IPv6 extension header chain. Returns the upper-layer protocol
+ * and sets *l4 to its header, or -1 if the chain is truncated or too long.
+ * Fragments stop the walk and are reported through *fragmented.
+ */
+static __always_inline int ipv6_skip_exthdrs(struct ipv6hdr *ip6, void *data_end,
+                                             void **l4, bool *fragmented)
+{
+    void *cursor = (void *)(ip6 + 1);
+    __u8 nexthdr = ip6->nexthdr;
+    int i;
+    
+    *fragmented = false;
+
+#pragma unroll
+    for (i = 0; i < IPV6_MAX_EXT_HEADERS; i++) {
+        switch (nexthdr) {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS: {
+            struct ipv6_opt_hdr *opt = cursor;
+            if ((void *)(opt + 1) > data_end)
+                return -1;
+            nexthdr = opt->nexthdr;
+            cursor += (opt->hdrlen + 1) << 3;
+            break;
+        }
+        case IPPROTO_AH: {
+            struct ipv6_opt_hdr *ah = cursor;
+            if ((void *)(ah + 1) > data_end)
+                return -1;
+            nexthdr = ah->nexthdr;
+            cursor += (ah->hdrlen + 2) << 2;
+            break;
+        }
+        case IPPROTO_FRAGMENT: {
+            struct ipv6_frag_hdr *frag = cursor;
+            if ((void *)(frag + 1) > data_end)
+                return -1;
+            *fragmented = true;
+            *l4 = (void *)(frag + 1);
+            return frag->nexthdr;
+        }
+        default:
+            *l4 = cursor;
+            return nexthdr;
+        }
+    }
+    
+    return -1;
+}
+
+static __always_inline struct pkt_ctx *get_pkt_ctx(void)
+{
+    __u32 key = 0;
+    
+    return bpf_map_lookup_elem(&pkt_scratch, &key);
+}
+
+static __always_inline struct vpn_stats *get_stats(void)
+{
+    __u32 key = 0;
+    
+    return bpf_map_lookup_elem(&stats_map, &key);
+}
+
+/* Packet access for later stages: offsets were validated by the entry
+ * program, the mask keeps the verifier's view of them bounded
+ */
+static __always_inline void *pkt_at(struct xdp_md *ctx, __u32 off)
+{
+    return (void *)(long)ctx->data + (off & PKT_OFF_MASK);
+}
+
+static __always_inline void *pkt_ptr(struct xdp_md *ctx, __u32 off, __u32 len)
+{
+    void *ptr = pkt_at(ctx, off);
+    
+    if (ptr + len > (void *)(long)ctx->data_end)
+        return NULL;
+    return ptr;
+}
+
+/* Data packets on the kernel path; AF_XDP mode hands them all to userspace */
+static __always_inline struct wireguard_header *pkt_wg_data(struct xdp_md *ctx,
+                                                            struct pkt_ctx *pc)
+{
+    struct wireguard_header *wg;
+    
+    if (!pc->wireguard || xsk_enabled())
+        return NULL;
+    
+    wg = pkt_ptr(ctx, pc->l4_off + sizeof(struct udphdr), sizeof(*wg));
+    if (!wg || wg->type != WIREGUARD_MESSAGE_DATA)
+        return NULL;
+    return wg;
+}
+
+/* Stage programs, indexed by enum xdp_stage */
+int xdp_stage_rate_limit(struct xdp_md *ctx);
+int xdp_stage_session(struct xdp_md *ctx);
+int xdp_stage_flow(struct xdp_md *ctx);
+int xdp_stage_ddos(struct xdp_md *ctx);
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+    __uint(max_entries, STAGE_MAX);
+    __uint(key_size, sizeof(__u32));
+    __array(values, int (struct xdp_md *));
+} xdp_stages SEC(".maps") = {
+    .values = {
+        [STAGE_RATE_LIMIT] = (void *)&xdp_stage_rate_limit,
+        [STAGE_SESSION] = (void *)&xdp_stage_session,
+        [STAGE_FLOW] = (void *)&xdp_stage_flow,
+        [STAGE_DDOS] = (void *)&xdp_stage_ddos,
+    },
 };
 
-/* XDP program for ultra-fast packet filtering and acceleration */
+/* Tail-call into the next configured stage. Slots without a program are
+ * skipped; once the pipeline is exhausted the packet is handed on, to the
+ * core the flow stage picked if it ran. Steering only happens here, so a
+ * reordered pipeline still runs every stage.
+ */
+static __always_inline int pipeline_next(struct xdp_md *ctx, struct pkt_ctx *pc)
+{
+    struct pipeline_config *cfg;
+    __u32 key = 0, count = STAGE_MAX, stage;
+    int i;
+    
+    cfg = bpf_map_lookup_elem(&pipeline_config_map, &key);
+    if (cfg && cfg->count)
+        count = cfg->count;
+
+#pragma unroll
+    for (i = 0; i < PIPELINE_MAX_STAGES; i++) {
+        if (pc->stage >= count || pc->stage >= PIPELINE_MAX_STAGES)
+            break;
+        
+        stage = pc->stage;
+        if (cfg && cfg->count)
+            stage = cfg->stages[pc->stage & (PIPELINE_MAX_STAGES - 1)];
+        pc->stage++;
+        
+        bpf_tail_call(ctx, &xdp_stages, stage);
+    }
+    
+    /* Userspace data plane owns WireGuard traffic in AF_XDP mode. It only
+     * parses fixed-size headers, so IPv4 options and IPv6 extension
+     * headers stay on the kernel path.
+     */
+    if (pc->wireguard && xsk_enabled() &&
+        pc->l4_off == pc->l3_off + (pc->family == 6 ? sizeof(struct ipv6hdr)
+                                                    : sizeof(struct iphdr)))
+        return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+    
+    if (pc->steer)
+        return steer_to_cpu(get_steering_config(), pc->steer_hash);
+    
+    return XDP_PASS;
+}
+
+/* XDP program for ultra-fast packet filtering and acceleration. Parses
+ * once into the per-CPU packet context, then runs the stage pipeline.
+ */
 SEC("xdp/undertheradar_vpn")
 int xdp_vpn_filter(struct xdp_md *ctx)
 {
     void *data_end = (void *)(long)ctx->data_end;
     void *data = (void *)(long)ctx->data;
     struct ethhdr *eth = data;
-    struct iphdr *ip;
-    struct udphdr *udp;
     struct wireguard_header *wg;
     struct vpn_stats *stats;
-    __u32 key = 0;
-    
-    /* Bounds checking */
-    if ((void *)(eth + 1) > data_end)
-        return XDP_DROP;
+    struct udphdr *udp;
+    struct pkt_ctx *pc;
+    bool fragmented;
+    void *l4 = NULL;
+    int proto;
     
     /* Update statistics */
-    stats = bpf_map_lookup_elem(&stats_map, &key);
+    stats = get_stats();
     if (stats) {
-        __sync_fetch_and_add(&stats->rx_packets, 1);
-        __sync_fetch_and_add(&stats->rx_bytes, data_end - data);
+        stats->rx_packets++;
+        stats->rx_bytes += data_end - data;
     }
     
-    /* Only process IPv4 for now */
-    if (eth->h_proto != bpf_htons(ETH_P_IP))
+    /* Bounds checking */
+    if ((void *)(eth + 1) > data_end)
+        return xdp_drop(stats, DROP_BOUNDS);
+    
+    pc = get_pkt_ctx();
+    if (!pc)
         return XDP_PASS;
+    __builtin_memset(pc, 0, sizeof(*pc));
+    pc->l3_off = sizeof(*eth);
     
-    ip = (struct iphdr *)(eth + 1);
-    if ((void *)(ip + 1) > data_end)
-        return XDP_DROP;
+    if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+        struct ipv6hdr *ip6 = (struct ipv6hdr *)(eth + 1);
+        
+        if ((void *)(ip6 + 1) > data_end)
+            return xdp_drop(stats, DROP_BOUNDS);
+        
+        proto = ipv6_skip_exthdrs(ip6, data_end, &l4, &fragmented);
+        if (proto < 0)
+            return xdp_drop(stats, DROP_BOUNDS);
+        pc->family = 6;
+    } else if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+        struct iphdr *ip = (struct iphdr *)(eth + 1);
+        
+        if ((void *)(ip + 1) > data_end)
+            return xdp_drop(stats, DROP_BOUNDS);
+        
+        proto = ip->protocol;
+        fragmented = ip->frag_off & bpf_htons(IP_MF | IP_OFFSET);
+        l4 = (void *)ip + ip->ihl * 4;
+        pc->family = 4;
+    } else {
+        return XDP_PASS;
+    }
     
-    /* Fast path for established VPN connections */
-    if (ip->protocol == IPPROTO_UDP) {
-        udp = (struct udphdr *)((void *)ip + ip->ihl * 4);
+    /* Header chains too long for the stages are left to the stack */
+    if (l4 - data > PKT_OFF_MASK)
+        return XDP_PASS;
+    pc->l4_off = l4 - data;
+    pc->proto = proto;
+    pc->fragmented = fragmented;
+    
+    if (proto == IPPROTO_UDP && !fragmented) {
+        udp = l4;
         if ((void *)(udp + 1) > data_end)
-            return XDP_DROP;
+            return xdp_drop(stats, DROP_BOUNDS);
         
         /* Check if it's WireGuard traffic */
         if (udp->dest == bpf_htons(WIREGUARD_PORT)) {
             wg = (struct wireguard_header *)(udp + 1);
             if ((void *)(wg + 1) > data_end)
-                return XDP_DROP;
-            
-            /* Apply rate limiting */
-            if (!check_rate_limit(ip->saddr)) {
-                if (stats)
-                    __sync_fetch_and_add(&stats->dropped_packets, 1);
-                return XDP_DROP;
-            }
-            
-            /* Fast path for data packets */
-            if (wg->type == WIREGUARD_MESSAGE_DATA) {
-                /* Validate sender and update flow state */
-                struct flow_key flow = {
-                    .src_ip = ip->saddr,
-                    .dst_ip = ip->daddr,
-                    .src_port = udp->source,
-                    .dst_port = udp->dest,
-                    .protocol = IPPROTO_UDP
-                };
-                
-                struct flow_state *state = bpf_map_lookup_elem(&flow_table, &flow);
-                if (state) {
-                    /* Update existing flow */
-                    __sync_fetch_and_add(&state->packets, 1);
-                    __sync_fetch_and_add(&state->bytes, data_end - data);
-                    state->last_seen = bpf_ktime_get_ns();
-                    
-                    /* CPU redirect for better cache locality */
-                    return bpf_redirect_map(&cpu_map, 
-                                          bpf_get_smp_processor_id(), 0);
-                }
-            }
+                return xdp_drop(stats, DROP_BOUNDS);
+            pc->wireguard = 1;
         }
     }
     
-    /* Check against DDoS patterns */
-    if (is_ddos_pattern(ip, data_end)) {
-        if (stats)
-            __sync_fetch_and_add(&stats->dropped_packets, 1);
-        return XDP_DROP;
-    }
-    
-    return XDP_PASS;
+    return pipeline_next(ctx, pc);
 }
 
-/* Helper function for rate limiting using token bucket */
-static __always_inline bool check_rate_limit(__be32 src_ip)
+/* Helper function for rate limiting using token bucket. Every per-CPU
+ * bucket gets the full per-source budget: a WireGuard client is one
+ * 5-tuple, so RSS lands all of its packets on one queue and one bucket.
+ * A source spreading over several flows can get up to one budget per
+ * queue it hits.
+ */
+static __always_inline bool rate_limit_consume(void *map, void *src_key)
 {
+    struct rate_limit_config *cfg;
     struct rate_limit *rl;
     __u64 now = bpf_ktime_get_ns();
-    __u64 tokens_to_add;
-    const __u64 rate = 10000;  /* 10k packets per second */
-    const __u64 burst = 1000;   /* Burst of 1000 packets */
+    __u64 rate = RATE_LIMIT_DEFAULT_RATE;
+    __u64 burst = RATE_LIMIT_DEFAULT_BURST;
+    __u64 elapsed, tokens, credit;
+    __u32 key = 0;
+    
+    cfg = bpf_map_lookup_elem(&rate_limit_config_map, &key);
+    if (cfg) {
+        if (!cfg->enabled)
+            return true;
+        if (cfg->rate)
+            rate = cfg->rate < RATE_LIMIT_MAX_RATE ? cfg->rate : RATE_LIMIT_MAX_RATE;
+        if (cfg->burst)
+            burst = cfg->burst;
+    }
     
-    rl = bpf_map_lookup_elem(&rate_limit_map, &src_ip);
+    rl = bpf_map_lookup_elem(map, src_key);
     if (!rl) {
         /* New source, create rate limit entry */
         struct rate_limit new_rl = {
-            .tokens = burst,
+            .tokens = burst - 1,
             .last_update = now
         };
-        bpf_map_update_elem(&rate_limit_map, &src_ip, &new_rl, BPF_ANY);
+        bpf_map_update_elem(map, src_key, &new_rl, BPF_NOEXIST);
         return true;
     }
     
-    /* Calculate tokens to add based on time elapsed */
-    tokens_to_add = (now - rl->last_update) * rate / 1000000000;
-    rl->tokens = rl->tokens + tokens_to_add;
-    if (rl->tokens > burst)
-        rl->tokens = burst;
+    /* Calculate tokens to add based on time elapsed; plain stores are
+     * safe because this CPU owns the value. The sub-token remainder is
+     * carried, so packets closer than a token's worth of time still
+     * accrue credit instead of each rounding down to nothing.
+     */
+    elapsed = now - rl->last_update;
+    tokens = rl->tokens;
+    if (elapsed >= 1000000000ULL) {
+        tokens = burst;
+        rl->carry = 0;
+    } else {
+        credit = rl->carry + elapsed * rate;
+        tokens += credit / 1000000000ULL;
+        rl->carry = credit % 1000000000ULL;
+    }
+    if (tokens >= burst) {
+        tokens = burst;
+        rl->carry = 0;
+    }
     
     rl->last_update = now;
     
-    if (rl->tokens > 0) {
-        rl->tokens--;
+    if (tokens) {
+        rl->tokens = tokens - 1;
         return true;
     }
     
+    rl->tokens = tokens;
     return false;
 }
 
+static __always_inline bool check_rate_limit(__be32 src_ip)
+{
+    return rate_limit_consume(&rate_limit_map, &src_ip);
+}
+
+static __always_inline bool check_rate_limit6(const struct in6_addr *src_ip)
+{
+    __u64 prefix;
+    
+    __builtin_memcpy(&prefix, src_ip, sizeof(prefix));
+    return rate_limit_consume(&rate_limit_map6, &prefix);
+}
+
 /* DDoS pattern detection */
-static __always_inline bool is_ddos_pattern(struct iphdr *ip, void *data_end)
+static __always_inline enum drop_reason is_ddos_pattern(struct iphdr *ip, void *data_end,
+                                                        __u32 checks)
 {
     /* Check for common DDoS patterns */
     
     /* 1. IP fragment attacks */
-    if (ip->frag_off & bpf_htons(IP_MF | IP_OFFSET))
-        return true;
+    if ((checks & DDOS_CHECK_FRAGMENT) && (ip->frag_off & bpf_htons(IP_MF | IP_OFFSET)))
+        return DROP_FRAGMENT;
     
     /* 2. Small packet floods */
-    if ((void *)ip + bpf_ntohs(ip->tot_len) < data_end - 64)
-        return true;
+    if ((checks & DDOS_CHECK_RUNT) && (void *)ip + bpf_ntohs(ip->tot_len) < data_end - 64)
+        return DROP_RUNT;
     
     /* 3. Invalid TTL (spoofed packets often have low TTL) */
-    if (ip->ttl < 5)
-        return true;
+    if ((checks & DDOS_CHECK_TTL) && ip->ttl < 5)
+        return DROP_TTL;
     
     /* 4. TCP SYN floods */
-    if (ip->protocol == IPPROTO_TCP) {
+    if ((checks & DDOS_CHECK_SYN) && ip->protocol == IPPROTO_TCP) {
         struct tcphdr *tcp = (struct tcphdr *)((void *)ip + ip->ihl * 4);
         if ((void *)(tcp + 1) <= data_end) {
             /* SYN without ACK */
             if (tcp->syn && !tcp->ack)
-                return true;
+                return DROP_SYN;
         }
     }
     
-    return false;
+    return DROP_NONE;
+}
+
+/* IPv6 variant of is_ddos_pattern */
+static __always_inline enum drop_reason is_ddos_pattern6(struct ipv6hdr *ip6, int proto,
+                                                         void *l4, bool fragmented,
+                                                         void *data_end, __u32 checks)
+{
+    /* 1. Fragment attacks */
+    if ((checks & DDOS_CHECK_FRAGMENT) && fragmented)
+        return DROP_FRAGMENT;
+    
+    /* 2. Small packet floods */
+    if ((checks & DDOS_CHECK_RUNT) &&
+        (void *)(ip6 + 1) + bpf_ntohs(ip6->payload_len) < data_end - 64)
+        return DROP_RUNT;
+    
+    /* 3. Invalid hop limit */
+    if ((checks & DDOS_CHECK_TTL) && ip6->hop_limit < 5)
+        return DROP_TTL;
+    
+    /* 4. TCP SYN floods */
+    if ((checks & DDOS_CHECK_SYN) && proto == IPPROTO_TCP) {
+        struct tcphdr *tcp = l4;
+        if ((void *)(tcp + 1) <= data_end) {
+            /* SYN without ACK */
+            if (tcp->syn && !tcp->ack)
+                return DROP_SYN;
+        }
+    }
+    
+    return DROP_NONE;
+}
+
+/* Stage: per-source token buckets for WireGuard traffic */
+SEC("xdp")
+int xdp_stage_rate_limit(struct xdp_md *ctx)
+{
+    struct pkt_ctx *pc = get_pkt_ctx();
+    bool allowed = true;
+    
+    if (!pc)
+        return XDP_PASS;
+    
+    if (pc->wireguard && pc->family == 4) {
+        struct iphdr *ip = pkt_ptr(ctx, pc->l3_off, sizeof(*ip));
+        if (!ip)
+            return xdp_drop(get_stats(), DROP_BOUNDS);
+        allowed = check_rate_limit(ip->saddr);
+    } else if (pc->wireguard) {
+        struct ipv6hdr *ip6 = pkt_ptr(ctx, pc->l3_off, sizeof(*ip6));
+        if (!ip6)
+            return xdp_drop(get_stats(), DROP_BOUNDS);
+        allowed = check_rate_limit6(&ip6->saddr);
+    }
+    
+    if (!allowed)
+        return xdp_drop(get_stats(), DROP_RATE_LIMIT);
+    
+    return pipeline_next(ctx, pc);
+}
+
+/* Stage: drop data packets that cannot belong to a live session */
+SEC("xdp")
+int xdp_stage_session(struct xdp_md *ctx)
+{
+    struct pkt_ctx *pc = get_pkt_ctx();
+    struct wireguard_header *wg;
+    
+    if (!pc)
+        return XDP_PASS;
+    
+    wg = pkt_wg_data(ctx, pc);
+    if (wg && !session_valid(wg))
+        return xdp_drop(get_stats(), DROP_UNKNOWN_SESSION);
+    
+    return pipeline_next(ctx, pc);
+}
+
+/* Stage: flow accounting and CPU steering for established data flows */
+SEC("xdp")
+int xdp_stage_flow(struct xdp_md *ctx)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    struct pkt_ctx *pc = get_pkt_ctx();
+    struct wireguard_header *wg;
+    struct flow_state *state;
+    struct udphdr *udp;
+    
+    if (!pc)
+        return XDP_PASS;
+    
+    wg = pkt_wg_data(ctx, pc);
+    udp = pkt_ptr(ctx, pc->l4_off, sizeof(*udp));
+    if (!wg || !udp)
+        return pipeline_next(ctx, pc);
+    
+    if (pc->family == 4) {
+        struct iphdr *ip = pkt_ptr(ctx, pc->l3_off, sizeof(*ip));
+        if (!ip)
+            return pipeline_next(ctx, pc);
+        
+        struct flow_key flow = {
+            .src_ip = ip->saddr,
+            .dst_ip = ip->daddr,
+            .src_port = udp->source,
+            .dst_port = udp->dest,
+            .protocol = IPPROTO_UDP
+        };
+        
+        state = bpf_map_lookup_elem(&flow_table, &flow);
+        if (!state) {
+            flow_start(&flow_table, &flow, data_end - data);
+            return pipeline_next(ctx, pc);
+        }
+        
+        if (flow_account(state, data_end - data)) {
+            struct in6_addr src = {}, dst = {};
+            
+            src.in6_u.u6_addr32[2] = dst.in6_u.u6_addr32[2] = bpf_htonl(0xffff);
+            src.in6_u.u6_addr32[3] = flow.src_ip;
+            dst.in6_u.u6_addr32[3] = flow.dst_ip;
+            flow_export(&src, &dst, flow.src_port, flow.dst_port, state);
+        }
+        
+        /* Pin the peer to its receive core once the pipeline is done */
+        pc->steer_hash = steer_hash_v4(ip, udp, wg, get_steering_config());
+        pc->steer = 1;
+        return pipeline_next(ctx, pc);
+    }
+    
+    struct ipv6hdr *ip6 = pkt_ptr(ctx, pc->l3_off, sizeof(*ip6));
+    if (!ip6)
+        return pipeline_next(ctx, pc);
+    
+    struct flow_key6 flow6 = {
+        .src_ip = ip6->saddr,
+        .dst_ip = ip6->daddr,
+        .src_port = udp->source,
+        .dst_port = udp->dest,
+        .protocol = IPPROTO_UDP
+    };
+    
+    state = bpf_map_lookup_elem(&flow_table6, &flow6);
+    if (!state) {
+        flow_start(&flow_table6, &flow6, data_end - data);
+        return pipeline_next(ctx, pc);
+    }
+    
+    if (flow_account(state, data_end - data))
+        flow_export(&flow6.src_ip, &flow6.dst_ip, flow6.src_port, flow6.dst_port, state);
+    
+    /* Pin the peer to its receive core once the pipeline is done */
+    pc->steer_hash = steer_hash_v6(ip6, udp, wg, get_steering_config());
+    pc->steer = 1;
+    return pipeline_next(ctx, pc);
+}
+
+/* Stage: DDoS heuristics, each individually switchable */
+SEC("xdp")
+int xdp_stage_ddos(struct xdp_md *ctx)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    struct pkt_ctx *pc = get_pkt_ctx();
+    struct pipeline_config *cfg;
+    __u32 key = 0, checks = DDOS_CHECK_ALL;
+    enum drop_reason reason;
+    
+    if (!pc)
+        return XDP_PASS;
+    
+    cfg = bpf_map_lookup_elem(&pipeline_config_map, &key);
+    if (cfg && (cfg->ddos_checks & DDOS_CHECKS_SET))
+        checks = cfg->ddos_checks & DDOS_CHECK_ALL;
+    
+    if (pc->family == 4) {
+        struct iphdr *ip = pkt_ptr(ctx, pc->l3_off, sizeof(*ip));
+        if (!ip)
+            return xdp_drop(get_stats(), DROP_BOUNDS);
+        reason = is_ddos_pattern(ip, data_end, checks);
+    } else {
+        struct ipv6hdr *ip6 = pkt_ptr(ctx, pc->l3_off, sizeof(*ip6));
+        if (!ip6)
+            return xdp_drop(get_stats(), DROP_BOUNDS);
+        reason = is_ddos_pattern6(ip6, pc->proto, pkt_at(ctx, pc->l4_off),
+                                  pc->fragmented, data_end, checks);
+    }
+    
+    if (reason != DROP_NONE)
+        return xdp_drop(get_stats(), reason);
+    
+    return pipeline_next(ctx, pc);
+}
+
+/* Classify by destination: a prefix rule wins over a port rule. Rules
+ * are read from the active generation only, so a ruleset swap by the
+ * control plane is a single write to qos_config.
+ */
+static __always_inline struct qos_rule *qos_classify(const struct in6_addr *daddr,
+                                                     __u16 dport)
+{
+    struct qos_prefix_key pkey;
+    struct qos_config *cfg;
+    struct qos_rule *rule;
+    __u32 key = 0, index;
+    
+    cfg = bpf_map_lookup_elem(&qos_config, &key);
+    if (!cfg)
+        return NULL;
+    
+    pkey.lpm.prefixlen = 32 + 128;
+    pkey.gen = cfg->gen;
+    pkey.addr = *daddr;
+    rule = bpf_map_lookup_elem(&qos_prefixes, &pkey);
+    if (rule && (rule->flags & QOS_RULE_ACTIVE))
+        return rule;
+    
+    index = (cfg->gen & 1) * QOS_PORTS + dport;
+    rule = bpf_map_lookup_elem(&qos_ports, &index);
+    if (rule && (rule->flags & QOS_RULE_ACTIVE))
+        return rule;
+    
+    return NULL;
+}
+
+static __always_inline void qos_account(struct __sk_buff *skb, struct qos_rule *rule)
+{
+    __u32 class_id = rule->class;
+    struct qos_class_stats *stats;
+    
+    stats = bpf_map_lookup_elem(&qos_class_stats, &class_id);
+    if (stats) {
+        stats->packets++;
+        stats->bytes += skb->len;
+    }
+    if (rule->priority)
+        skb->priority = rule->priority;
+}
+
+/* Earliest departure time pacing. Each peer keeps the departure time of
+ * its last packet; a new packet leaves one serialisation delay after it,
+ * or immediately if the peer has been idle. fq on the egress device
+ * holds packets until skb->tstamp. Peers without a rate are not paced.
+ */
+static __always_inline int edt_schedule(struct __sk_buff *skb, struct pacing_key *key)
+{
+    struct pacing_state *pace;
+    __u64 now, t, t_next, delay;
+    
+    pace = bpf_map_lookup_elem(&pacing_map, key);
+    if (!pace || !pace->rate)
+        return TC_ACT_OK;
+    
+    delay = (__u64)skb->wire_len * 1000000000ULL / pace->rate;
+    now = bpf_ktime_get_ns();
+    t = skb->tstamp;
+    if (t < now)
+        t = now;
+    
+    t_next = READ_ONCE(pace->t_last) + delay;
+    if (t_next <= t) {
+        /* Idle or under rate: send now, restart the schedule from here */
+        WRITE_ONCE(pace->t_last, t);
+        return TC_ACT_OK;
+    }
+    
+    /* Too far ahead means the peer is oversubscribed; drop, don't queue */
+    if (t_next - now >= (pace->horizon ? pace->horizon : PACING_DEFAULT_HORIZON_NS))
+        return TC_ACT_SHOT;
+    
+    WRITE_ONCE(pace->t_last, t_next);
+    skb->tstamp = t_next;
+    return TC_ACT_OK;
+}
+
+/* IPv6 egress: DSCP lives in the traffic class, split across two fields */
+static __always_inline int tc_vpn_egress_v6(struct __sk_buff *skb, struct ipv6hdr *ip6,
+                                            void *data_end)
+{
+    struct qos_rule *rule;
+    struct udphdr *udp;
+    bool fragmented;
+    void *l4 = NULL;
+    __u16 dport = 0;
+    int proto;
+    
+    if ((void *)(ip6 + 1) > data_end)
+        return TC_ACT_OK;
+    
+    proto = ipv6_skip_exthdrs(ip6, data_end, &l4, &fragmented);
+    udp = l4;
+    if ((proto == IPPROTO_UDP || proto == IPPROTO_TCP) && !fragmented &&
+        (void *)(udp + 1) <= data_end)
+        dport = bpf_ntohs(udp->dest);
+    
+    rule = qos_classify(&ip6->daddr, dport);
+    if (rule) {
+        if (rule->dscp != QOS_DSCP_KEEP) {
+            __u8 tclass = (ip6->priority << 4) | (ip6->flow_lbl[0] >> 4);
+            
+            tclass = (rule->dscp << 2) | (tclass & 0x3);
+            ip6->priority = tclass >> 4;
+            ip6->flow_lbl[0] = (tclass << 4) | (ip6->flow_lbl[0] & 0x0f);
+        }
+        qos_account(skb, rule);
+    }
+    
+    if (proto != IPPROTO_UDP || fragmented || (void *)(udp + 1) > data_end ||
+        udp->source != bpf_htons(WIREGUARD_PORT))
+        return TC_ACT_OK;
+    
+    struct pacing_key key = {
+        .addr = ip6->daddr,
+        .port = udp->dest
+    };
+    return edt_schedule(skb, &key);
 }
 
 /* TC egress program for packet manipulation and QoS */
@@ -257,11 +1304,21 @@ int tc_vpn_egress(struct __sk_buff *skb)
     void *data = (void *)(long)skb->data;
     void *data_end = (void *)(long)skb->data_end;
     struct ethhdr *eth = data;
+    struct pacing_key pkey = {};
+    struct in6_addr daddr = {};
+    struct qos_rule *rule;
+    struct udphdr *udp;
     struct iphdr *ip;
+    bool tunnel = false;
+    __u16 dport = 0;
+    __u8 old_tos;
     
     if ((void *)(eth + 1) > data_end)
         return TC_ACT_OK;
     
+    if (eth->h_proto == bpf_htons(ETH_P_IPV6))
+        return tc_vpn_egress_v6(skb, (struct ipv6hdr *)(eth + 1), data_end);
+    
     if (eth->h_proto != bpf_htons(ETH_P_IP))
         return TC_ACT_OK;
     
@@ -269,52 +1326,206 @@ int tc_vpn_egress(struct __sk_buff *skb)
     if ((void *)(ip + 1) > data_end)
         return TC_ACT_OK;
     
-    /* Apply DSCP marking for QoS */
-    if (ip->protocol == IPPROTO_UDP) {
-        struct udphdr *udp = (struct udphdr *)((void *)ip + ip->ihl * 4);
+    daddr.in6_u.u6_addr32[2] = bpf_htonl(0xffff);
+    daddr.in6_u.u6_addr32[3] = ip->daddr;
+    
+    /* TCP and UDP share the port layout classification needs */
+    if (ip->protocol == IPPROTO_UDP || ip->protocol == IPPROTO_TCP) {
+        udp = (struct udphdr *)((void *)ip + ip->ihl * 4);
         if ((void *)(udp + 1) <= data_end) {
-            /* VoIP traffic gets highest priority */
-            if (udp->dest == bpf_htons(5060) || udp->dest == bpf_htons(5061)) {
-                ip->tos = 0xb8;  /* EF (Expedited Forwarding) */
-            }
-            /* Gaming traffic gets high priority */
-            else if (udp->dest >= bpf_htons(27000) && udp->dest <= bpf_htons(27100)) {
-                ip->tos = 0x88;  /* AF41 */
-            }
-            /* VPN traffic gets medium priority */
-            else if (udp->dest == bpf_htons(WIREGUARD_PORT)) {
-                ip->tos = 0x68;  /* AF31 */
+            dport = bpf_ntohs(udp->dest);
+            if (ip->protocol == IPPROTO_UDP && udp->source == bpf_htons(WIREGUARD_PORT)) {
+                tunnel = true;
+                pkey.addr = daddr;
+                pkey.port = udp->dest;
             }
         }
     }
     
-    /* Implement packet pacing for better throughput */
-    __u64 now = bpf_ktime_get_ns();
-    __u64 delay = calculate_pacing_delay(skb->len);
-    if (delay > 0) {
-        skb->tstamp = now + delay;
+    /* Apply DSCP marking for QoS, keeping the header checksum valid */
+    rule = qos_classify(&daddr, dport);
+    if (rule) {
+        old_tos = ip->tos;
+        if (rule->dscp != QOS_DSCP_KEEP && (old_tos >> 2) != rule->dscp) {
+            __u8 tos = (rule->dscp << 2) | (old_tos & 0x3);
+            
+            bpf_l3_csum_replace(skb, ETH_HLEN + offsetof(struct iphdr, check),
+                                bpf_htons(old_tos), bpf_htons(tos), 2);
+            bpf_skb_store_bytes(skb, ETH_HLEN + offsetof(struct iphdr, tos),
+                                &tos, sizeof(tos), 0);
+        }
+        qos_account(skb, rule);
     }
     
+    /* Pace tunnel traffic towards each peer at its configured rate */
+    if (tunnel)
+        return edt_schedule(skb, &pkey);
+    
     return TC_ACT_OK;
 }
 
-/* Calculate pacing delay to smooth traffic */
-static __always_inline __u64 calculate_pacing_delay(__u32 pkt_len)
+/* Session feeders, attached to the kernel module's session anchors */
+SEC("fentry/undertheradar_session_established")
+int BPF_PROG(session_established, __u32 local_index)
+{
+    struct wg_session session = {
+        .established = bpf_ktime_get_ns(),
+        .counter_floor = 0
+    };
+    
+    /* Republishing an existing keypair must not extend its lifetime */
+    bpf_map_update_elem(&sessions, &local_index, &session, BPF_NOEXIST);
+    return 0;
+}
+
+SEC("fentry/undertheradar_session_counter")
+int BPF_PROG(session_counter, __u32 local_index, __u64 counter)
 {
-    /* Target: 10 Gbps with microsecond precision */
-    const __u64 target_bps = 10ULL * 1000 * 1000 * 1000;
-    const __u64 ns_per_byte = 1000000000ULL * 8 / target_bps;
+    struct wg_session *session = bpf_map_lookup_elem(&sessions, &local_index);
     
-    return pkt_len * ns_per_byte;
+    /* Decrypt workers race; only ever move the floor forward */
+    if (session && counter > session->counter_floor)
+        session->counter_floor = counter;
+    return 0;
+}
+
+SEC("fentry/undertheradar_session_zeroed")
+int BPF_PROG(session_zeroed, __u32 local_index)
+{
+    bpf_map_delete_elem(&sessions, &local_index);
+    return 0;
 }
 
-/* CPU redirect map for RSS */
+/* Hot-path telemetry from the kernel module's tracepoints. Every event
+ * is counted per CPU; one in sample_rate per stage and CPU is also sent to
+ * latency_events for the control plane's histograms.
+ */
+enum telemetry_stage {
+    TELEMETRY_ENCRYPT,
+    TELEMETRY_DECRYPT,
+    TELEMETRY_NAPI_POLL,
+    TELEMETRY_RX_QUEUE,
+    TELEMETRY_STAGE_MAX
+};
+
+#define TELEMETRY_DEFAULT_SAMPLE_RATE 64
+
+struct telemetry_config {
+    __u32 sample_rate;    /* 1 = every event, 0 = default */
+    __u32 pad;
+};
+
 struct {
-    __uint(type, BPF_MAP_TYPE_CPUMAP);
-    __uint(max_entries, MAX_CPU);
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
     __type(key, __u32);
-    __type(value, __u32);
-} cpu_map SEC(".maps");
+    __type(value, struct telemetry_config);
+} telemetry_config_map SEC(".maps");
+
+struct telemetry_stats {
+    __u64 events[TELEMETRY_STAGE_MAX];
+    __u64 budget_exhausted;
+    __u64 rx_dropped;
+    __u64 samples_lost;   /* ring buffer full */
+    __u32 skip[TELEMETRY_STAGE_MAX];
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct telemetry_stats);
+} telemetry_stats_map SEC(".maps");
+
+struct latency_record {
+    __u64 ns;             /* time spent in the stage, 0 for rx_queue */
+    __u32 stage;
+    __u32 cpu;
+    __u32 value;          /* bytes, work done or queue depth */
+    __u32 aux;            /* segments or backlog */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 1 << 18);
+} latency_events SEC(".maps");
+
+static __always_inline struct telemetry_stats *telemetry_count(__u32 stage)
+{
+    __u32 key = 0;
+    struct telemetry_stats *stats = bpf_map_lookup_elem(&telemetry_stats_map, &key);
+    
+    if (stats && stage < TELEMETRY_STAGE_MAX)
+        stats->events[stage]++;
+    return stats;
+}
+
+static __always_inline void telemetry_sample(struct telemetry_stats *stats, __u32 stage,
+                                             __u64 ns, __u32 value, __u32 aux)
+{
+    struct telemetry_config *cfg;
+    struct latency_record *rec;
+    __u32 key = 0, rate;
+    
+    if (!stats || stage >= TELEMETRY_STAGE_MAX)
+        return;
+    if (stats->skip[stage]) {
+        stats->skip[stage]--;
+        return;
+    }
+    
+    cfg = bpf_map_lookup_elem(&telemetry_config_map, &key);
+    rate = cfg && cfg->sample_rate ? cfg->sample_rate : TELEMETRY_DEFAULT_SAMPLE_RATE;
+    stats->skip[stage] = rate - 1;
+    
+    rec = bpf_ringbuf_reserve(&latency_events, sizeof(*rec), 0);
+    if (!rec) {
+        stats->samples_lost++;
+        return;
+    }
+    rec->ns = ns;
+    rec->stage = stage;
+    rec->cpu = bpf_get_smp_processor_id();
+    rec->value = value;
+    rec->aux = aux;
+    bpf_ringbuf_submit(rec, 0);
+}
+
+SEC("tp_btf/undertheradar_encrypt")
+int BPF_PROG(trace_encrypt, unsigned int segs, unsigned int bytes, __u64 ns)
+{
+    telemetry_sample(telemetry_count(TELEMETRY_ENCRYPT), TELEMETRY_ENCRYPT, ns, bytes, segs);
+    return 0;
+}
+
+SEC("tp_btf/undertheradar_decrypt")
+int BPF_PROG(trace_decrypt, unsigned int bytes, __u64 ns)
+{
+    telemetry_sample(telemetry_count(TELEMETRY_DECRYPT), TELEMETRY_DECRYPT, ns, bytes, 1);
+    return 0;
+}
+
+SEC("tp_btf/undertheradar_napi_poll")
+int BPF_PROG(trace_napi_poll, int work_done, int budget, unsigned int backlog, __u64 ns)
+{
+    struct telemetry_stats *stats = telemetry_count(TELEMETRY_NAPI_POLL);
+    
+    if (stats && work_done >= budget)
+        stats->budget_exhausted++;
+    telemetry_sample(stats, TELEMETRY_NAPI_POLL, ns, work_done, backlog);
+    return 0;
+}
+
+SEC("tp_btf/undertheradar_rx_enqueue")
+int BPF_PROG(trace_rx_enqueue, unsigned int depth, bool dropped)
+{
+    struct telemetry_stats *stats = telemetry_count(TELEMETRY_RX_QUEUE);
+    
+    if (stats && dropped)
+        stats->rx_dropped++;
+    telemetry_sample(stats, TELEMETRY_RX_QUEUE, 0, depth, dropped);
+    return 0;
+}
 
 /* Program info */
 char _license[] SEC("license") = "GPL";
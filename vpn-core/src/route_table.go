@@ -0,0 +1,204 @@
+package main
+
+import (
+    "net"
+    "sort"
+    
+    "golang.zx2c4.com/wireguard/wgctrl/wgtypes"
+)
+
+// Longest-prefix-match routing snapshot used by routePacket. A published
+// table is never modified: writers copy the path to the prefix they change
+// and swap the new root in, so readers need no lock.
+type routeTable struct {
+    v4 *routeNode
+    v6 *routeNode
+}
+
+type routeNode struct {
+    child [2]*routeNode
+    
+    // Peers owning exactly this prefix, lowest LoadScore first
+    peers []*Peer
+}
+
+// One slot per prefix length, 0 through 128
+const routeMaxDepth = 8*net.IPv6len + 1
+
+func addrBit(addr net.IP, depth int) int {
+    return int(addr[depth>>3]>>(7-depth&7)) & 1
+}
+
+func (t *routeTable) root(ip net.IP) (*routeNode, net.IP) {
+    if v4 := ip.To4(); v4 != nil {
+        return t.v4, v4
+    }
+    if len(ip) == net.IPv6len {
+        return t.v6, ip
+    }
+    return nil, nil
+}
+
+// Best live peer on the longest matching prefix. If every peer there is
+// down, shorter prefixes are tried in turn. Does not allocate.
+func (t *routeTable) lookup(ip net.IP) *Peer {
+    if t == nil {
+        return nil
+    }
+    
+    var matches [routeMaxDepth]*routeNode
+    n := 0
+    
+    node, addr := t.root(ip)
+    for depth := 0; node != nil; depth++ {
+        if len(node.peers) > 0 {
+            matches[n] = node
+            n++
+        }
+        if depth == len(addr)*8 {
+            break
+        }
+        node = node.child[addrBit(addr, depth)]
+    }
+    
+    for i := n - 1; i >= 0; i-- {
+        for _, peer := range matches[i].peers {
+            if peer.IsAlive.Load() {
+                return peer
+            }
+        }
+    }
+    return nil
+}
+
+// Copy of t with peer added to, or removed from, prefix
+func (t *routeTable) with(prefix net.IPNet, peer *Peer, remove bool) *routeTable {
+    next := &routeTable{}
+    if t != nil {
+        *next = *t
+    }
+    
+    if slot, addr, ones := next.slot(prefix); slot != nil {
+        *slot = updateRoute(*slot, addr, ones, 0, peer, remove)
+    }
+    return next
+}
+
+// Root pointer, address bytes and length for prefix; nil if malformed
+func (t *routeTable) slot(prefix net.IPNet) (**routeNode, net.IP, int) {
+    ones, bits := prefix.Mask.Size()
+    if v4 := prefix.IP.To4(); v4 != nil && bits == 32 {
+        return &t.v4, v4, ones
+    }
+    if len(prefix.IP) == net.IPv6len && bits == 128 {
+        return &t.v6, prefix.IP, ones
+    }
+    return nil, nil, 0
+}
+
+func updateRoute(node *routeNode, addr net.IP, ones, depth int, peer *Peer, remove bool) *routeNode {
+    next := &routeNode{}
+    if node != nil {
+        *next = *node
+    }
+    
+    if depth == ones {
+        next.peers = withPeer(next.peers, peer, remove)
+    } else {
+        bit := addrBit(addr, depth)
+        next.child[bit] = updateRoute(next.child[bit], addr, ones, depth+1, peer, remove)
+    }
+    
+    // Prune branches that no longer lead to a route
+    if len(next.peers) == 0 && next.child[0] == nil && next.child[1] == nil {
+        return nil
+    }
+    return next
+}
+
+func withPeer(peers []*Peer, peer *Peer, remove bool) []*Peer {
+    next := make([]*Peer, 0, len(peers)+1)
+    for _, p := range peers {
+        if p != peer {
+            next = append(next, p)
+        }
+    }
+    if !remove {
+        next = append(next, peer)
+    }
+    if len(next) == 0 {
+        return nil
+    }
+    sortByLoad(next)
+    return next
+}
+
+func sortByLoad(peers []*Peer) {
+    sort.SliceStable(peers, func(i, j int) bool {
+        return peers[i].LoadScore.Load() < peers[j].LoadScore.Load()
+    })
+}
+
+func sortedByLoad(peers []*Peer) bool {
+    return sort.SliceIsSorted(peers, func(i, j int) bool {
+        return peers[i].LoadScore.Load() < peers[j].LoadScore.Load()
+    })
+}
+
+// t with every candidate list re-sorted by current load. Only the paths
+// to lists whose order changed are copied, the rest is shared; t itself
+// comes back if nothing moved.
+func (t *routeTable) resorted() *routeTable {
+    if t == nil {
+        return nil
+    }
+    v4, v6 := resortRoute(t.v4), resortRoute(t.v6)
+    if v4 == t.v4 && v6 == t.v6 {
+        return t
+    }
+    return &routeTable{v4: v4, v6: v6}
+}
+
+func resortRoute(node *routeNode) *routeNode {
+    if node == nil {
+        return nil
+    }
+    
+    c0, c1 := resortRoute(node.child[0]), resortRoute(node.child[1])
+    peers := node.peers
+    resort := len(peers) > 1 && !sortedByLoad(peers)
+    if !resort && c0 == node.child[0] && c1 == node.child[1] {
+        return node
+    }
+    
+    if resort {
+        peers = append([]*Peer(nil), peers...)
+        sortByLoad(peers)
+    }
+    return &routeNode{child: [2]*routeNode{c0, c1}, peers: peers}
+}
+
+// Fresh table for a whole peer set. Built in place, which is only safe
+// because nothing has seen it before it is published.
+func buildRouteTable(peers map[wgtypes.Key]*Peer) *routeTable {
+    t := &routeTable{}
+    for _, peer := range peers {
+        for _, prefix := range peer.AllowedIPs {
+            slot, addr, ones := t.slot(prefix)
+            if slot == nil {
+                continue
+            }
+            for depth := 0; ; depth++ {
+                if *slot == nil {
+                    *slot = &routeNode{}
+                }
+                if depth == ones {
+                    break
+                }
+                slot = &(*slot).child[addrBit(addr, depth)]
+            }
+            (*slot).peers = withPeer((*slot).peers, peer, false)
+        }
+    }
+    return t
+}
@@ -0,0 +1,351 @@
+package main
+
+import (
+    "bufio"
+    "encoding/binary"
+    "errors"
+    "fmt"
+    "log"
+    "net"
+    "net/http"
+    "os"
+    "strconv"
+    "strings"
+    "sync"
+    "time"
+    
+    "github.com/cilium/ebpf"
+    "github.com/cilium/ebpf/link"
+    "github.com/cilium/ebpf/ringbuf"
+    "github.com/prometheus/client_golang/prometheus"
+    "github.com/prometheus/client_golang/prometheus/promhttp"
+)
+
+// Hot-path stages, mirroring enum telemetry_stage in xdp_accelerator.c
+type TelemetryStage uint32
+
+const (
+    StageEncrypt  TelemetryStage = 0 // one sealed batch
+    StageDecrypt  TelemetryStage = 1
+    StageNAPIPoll TelemetryStage = 2 // one device NAPI round
+    StageRxQueue  TelemetryStage = 3 // encap handler enqueue
+    
+    telemetryStageMax = 4
+)
+
+func (s TelemetryStage) String() string {
+    switch s {
+    case StageEncrypt:
+        return "encrypt"
+    case StageDecrypt:
+        return "decrypt"
+    case StageNAPIPoll:
+        return "napi_poll"
+    case StageRxQueue:
+        return "rx_queue"
+    }
+    return "stage" + strconv.Itoa(int(s))
+}
+
+type TelemetryConfig struct {
+    ListenAddr string // e.g. ":9586"; empty keeps the samplers without HTTP
+    SampleRate uint32 // one event in SampleRate per stage and CPU; 0 = default
+}
+
+// telemetryConfig mirrors struct telemetry_config in xdp_accelerator.c
+type telemetryConfig struct {
+    SampleRate uint32
+    Pad        uint32
+}
+
+// telemetryStats mirrors struct telemetry_stats in xdp_accelerator.c
+type telemetryStats struct {
+    Events          [telemetryStageMax]uint64
+    BudgetExhausted uint64
+    RxDropped       uint64
+    SamplesLost     uint64
+    Skip            [telemetryStageMax]uint32
+}
+
+// struct latency_record
+const latencyRecordSize = 8 + 4 + 4 + 4 + 4
+
+type telemetry struct {
+    links    []link.Link
+    reader   *ringbuf.Reader
+    server   *http.Server
+    registry *prometheus.Registry
+    
+    latency    *prometheus.HistogramVec
+    queueDepth *prometheus.HistogramVec
+}
+
+// Attach the tracepoint samplers to the kernel module and serve their
+// histograms, the per-CPU counters and CPU utilization on /metrics.
+// Until this runs the module's timing branches stay patched out.
+func (vpn *UnderTheRadarVPN) StartTelemetry(cfg TelemetryConfig) error {
+    if vpn.telemetry != nil {
+        return nil
+    }
+    
+    m, err := vpn.ebpfMap("telemetry_config_map")
+    if err != nil {
+        return err
+    }
+    if err := m.Update(uint32(0), &telemetryConfig{SampleRate: cfg.SampleRate}, ebpf.UpdateAny); err != nil {
+        return fmt.Errorf("failed to update telemetry sampling: %w", err)
+    }
+    
+    events, err := vpn.ebpfMap("latency_events")
+    if err != nil {
+        return err
+    }
+    stats, err := vpn.ebpfMap("telemetry_stats_map")
+    if err != nil {
+        return err
+    }
+    
+    t := newTelemetry(stats)
+    vpn.telemetry = t
+    
+    coll, err := vpn.loadTracing("trace_")
+    if err != nil {
+        vpn.StopTelemetry()
+        return fmt.Errorf("failed to load telemetry programs: %w", err)
+    }
+    defer coll.Close()
+    
+    for name, prog := range coll.Programs {
+        l, err := link.AttachTracing(link.TracingOptions{Program: prog})
+        if err != nil {
+            vpn.StopTelemetry()
+            return fmt.Errorf("failed to attach %s: %w", name, err)
+        }
+        t.links = append(t.links, l)
+    }
+    
+    if t.reader, err = ringbuf.NewReader(events); err != nil {
+        vpn.StopTelemetry()
+        return fmt.Errorf("failed to open latency ring buffer: %w", err)
+    }
+    go t.consume()
+    
+    if cfg.ListenAddr != "" {
+        ln, err := net.Listen("tcp", cfg.ListenAddr)
+        if err != nil {
+            vpn.StopTelemetry()
+            return fmt.Errorf("failed to listen on %s: %w", cfg.ListenAddr, err)
+        }
+        mux := http.NewServeMux()
+        mux.Handle("/metrics", promhttp.HandlerFor(t.registry, promhttp.HandlerOpts{}))
+        t.server = &http.Server{Handler: mux, ReadHeaderTimeout: 5 * time.Second}
+        go func() {
+            if err := t.server.Serve(ln); err != nil && !errors.Is(err, http.ErrServerClosed) {
+                log.Printf("Telemetry endpoint stopped: %v", err)
+            }
+        }()
+    }
+    return nil
+}
+
+// Detach the samplers, which patches the module's timing branches back
+// out, and close the endpoint
+func (vpn *UnderTheRadarVPN) StopTelemetry() {
+    t := vpn.telemetry
+    if t == nil {
+        return
+    }
+    vpn.telemetry = nil
+    
+    for _, l := range t.links {
+        l.Close()
+    }
+    if t.reader != nil {
+        t.reader.Close()
+    }
+    if t.server != nil {
+        t.server.Close()
+    }
+}
+
+// Registry behind /metrics, for embedding in another HTTP server
+func (vpn *UnderTheRadarVPN) TelemetryRegistry() *prometheus.Registry {
+    if vpn.telemetry == nil {
+        return nil
+    }
+    return vpn.telemetry.registry
+}
+
+func newTelemetry(stats *ebpf.Map) *telemetry {
+    t := &telemetry{
+        registry: prometheus.NewRegistry(),
+        latency: prometheus.NewHistogramVec(prometheus.HistogramOpts{
+            Name:    "undertheradar_stage_latency_seconds",
+            Help:    "Sampled time spent per hot-path stage; encrypt covers one batch.",
+            Buckets: prometheus.ExponentialBuckets(250e-9, 2, 16), // 250ns to ~8ms
+        }, []string{"stage"}),
+        queueDepth: prometheus.NewHistogramVec(prometheus.HistogramOpts{
+            Name:    "undertheradar_queue_depth",
+            Help:    "Sampled rx_queue depth on enqueue, and backlog left after a NAPI round.",
+            Buckets: append([]float64{0}, prometheus.ExponentialBuckets(1, 2, 14)...), // up to RxQueueMax 8192
+        }, []string{"queue"}),
+    }
+    t.registry.MustRegister(t.latency, t.queueDepth, &telemetryCollector{stats: stats})
+    return t
+}
+
+// Feed ring buffer samples into the histograms until the reader closes
+func (t *telemetry) consume() {
+    encrypt := t.latency.WithLabelValues(StageEncrypt.String())
+    decrypt := t.latency.WithLabelValues(StageDecrypt.String())
+    poll := t.latency.WithLabelValues(StageNAPIPoll.String())
+    rxQueue := t.queueDepth.WithLabelValues("rx_queue")
+    backlog := t.queueDepth.WithLabelValues("napi_backlog")
+    
+    var rec ringbuf.Record
+    for {
+        if err := t.reader.ReadInto(&rec); err != nil {
+            if errors.Is(err, ringbuf.ErrClosed) {
+                return
+            }
+            continue
+        }
+        b := rec.RawSample
+        if len(b) < latencyRecordSize {
+            continue
+        }
+        
+        seconds := float64(binary.NativeEndian.Uint64(b[0:8])) / 1e9
+        aux := float64(binary.NativeEndian.Uint32(b[20:24]))
+        switch TelemetryStage(binary.NativeEndian.Uint32(b[8:12])) {
+        case StageEncrypt:
+            encrypt.Observe(seconds)
+        case StageDecrypt:
+            decrypt.Observe(seconds)
+        case StageNAPIPoll:
+            poll.Observe(seconds)
+            backlog.Observe(aux)
+        case StageRxQueue:
+            rxQueue.Observe(float64(binary.NativeEndian.Uint32(b[16:20])))
+        }
+    }
+}
+
+var (
+    telemetryEventsDesc = prometheus.NewDesc("undertheradar_hotpath_events_total",
+        "Tracepoint hits per hot-path stage, sampled or not.", []string{"stage"}, nil)
+    budgetExhaustedDesc = prometheus.NewDesc("undertheradar_napi_budget_exhausted_total",
+        "Device NAPI rounds that used their whole budget.", []string{"cpu"}, nil)
+    rxQueueDroppedDesc = prometheus.NewDesc("undertheradar_rx_queue_dropped_total",
+        "Datagrams dropped because rx_queue was full.", []string{"cpu"}, nil)
+    samplesLostDesc = prometheus.NewDesc("undertheradar_telemetry_samples_lost_total",
+        "Latency samples dropped because the ring buffer was full.", nil, nil)
+    cpuUtilizationDesc = prometheus.NewDesc("undertheradar_cpu_utilization_ratio",
+        "Share of each CPU spent busy, and in softirq, since the previous scrape.",
+        []string{"cpu", "mode"}, nil)
+)
+
+// Reads the per-CPU BPF counters and /proc/stat at scrape time
+type telemetryCollector struct {
+    stats *ebpf.Map
+    
+    mu   sync.Mutex
+    prev map[string]cpuTimes
+}
+
+type cpuTimes struct {
+    total, idle, softirq uint64
+}
+
+func (c *telemetryCollector) Describe(ch chan<- *prometheus.Desc) {
+    ch <- telemetryEventsDesc
+    ch <- budgetExhaustedDesc
+    ch <- rxQueueDroppedDesc
+    ch <- samplesLostDesc
+    ch <- cpuUtilizationDesc
+}
+
+func (c *telemetryCollector) Collect(ch chan<- prometheus.Metric) {
+    var perCPU []telemetryStats
+    if err := c.stats.Lookup(uint32(0), &perCPU); err == nil {
+        var events [telemetryStageMax]uint64
+        var lost uint64
+        for cpu, s := range perCPU {
+            label := strconv.Itoa(cpu)
+            for i, n := range s.Events {
+                events[i] += n
+            }
+            lost += s.SamplesLost
+            ch <- prometheus.MustNewConstMetric(budgetExhaustedDesc, prometheus.CounterValue,
+                float64(s.BudgetExhausted), label)
+            ch <- prometheus.MustNewConstMetric(rxQueueDroppedDesc, prometheus.CounterValue,
+                float64(s.RxDropped), label)
+        }
+        for i, n := range events {
+            ch <- prometheus.MustNewConstMetric(telemetryEventsDesc, prometheus.CounterValue,
+                float64(n), TelemetryStage(i).String())
+        }
+        ch <- prometheus.MustNewConstMetric(samplesLostDesc, prometheus.CounterValue, float64(lost))
+    }
+    
+    cur, err := readCPUTimes()
+    if err != nil {
+        return
+    }
+    
+    c.mu.Lock()
+    prev := c.prev
+    c.prev = cur
+    c.mu.Unlock()
+    
+    for cpu, now := range cur {
+        last, ok := prev[cpu]
+        if !ok || now.total <= last.total {
+            continue
+        }
+        total := float64(now.total - last.total)
+        busy := total - float64(now.idle-last.idle)
+        ch <- prometheus.MustNewConstMetric(cpuUtilizationDesc, prometheus.GaugeValue,
+            busy/total, cpu, "busy")
+        ch <- prometheus.MustNewConstMetric(cpuUtilizationDesc, prometheus.GaugeValue,
+            float64(now.softirq-last.softirq)/total, cpu, "softirq")
+    }
+}
+
+// Per-CPU jiffies from /proc/stat; idle includes iowait
+func readCPUTimes() (map[string]cpuTimes, error) {
+    f, err := os.Open("/proc/stat")
+    if err != nil {
+        return nil, err
+    }
+    defer f.Close()
+    
+    times := make(map[string]cpuTimes)
+    scanner := bufio.NewScanner(f)
+    for scanner.Scan() {
+        fields := strings.Fields(scanner.Text())
+        if len(fields) < 8 || !strings.HasPrefix(fields[0], "cpu") || fields[0] == "cpu" {
+            continue
+        }
+        
+        var t cpuTimes
+        for i, field := range fields[1:] {
+            v, err := strconv.ParseUint(field, 10, 64)
+            if err != nil {
+                break
+            }
+            // guest and guest_nice are already counted in user and nice
+            if i < 8 {
+                t.total += v
+            }
+            switch i {
+            case 3, 4: // idle, iowait
+                t.idle += v
+            case 6:
+                t.softirq = v
+            }
+        }
+        times[strings.TrimPrefix(fields[0], "cpu")] = t
+    }
+    return times, scanner.Err()
+}
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM undertheradar
+
+#if !defined(_UNDERTHERADAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UNDERTHERADAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Attaching any timed event flips undertheradar_timing, so the hot paths
+ * only read the clock while someone is listening
+ */
+int undertheradar_timing_reg(void);
+void undertheradar_timing_unreg(void);
+
+/* One sealed batch: segments, ciphertext bytes and time spent */
+TRACE_EVENT_FN(undertheradar_encrypt,
+    TP_PROTO(unsigned int segs, unsigned int bytes, u64 ns),
+    TP_ARGS(segs, bytes, ns),
+    
+    TP_STRUCT__entry(
+        __field(unsigned int, segs)
+        __field(unsigned int, bytes)
+        __field(u64, ns)
+    ),
+    
+    TP_fast_assign(
+        __entry->segs = segs;
+        __entry->bytes = bytes;
+        __entry->ns = ns;
+    ),
+    
+    TP_printk("segs=%u bytes=%u ns=%llu", __entry->segs, __entry->bytes, __entry->ns),
+    
+    undertheradar_timing_reg, undertheradar_timing_unreg
+);
+
+TRACE_EVENT_FN(undertheradar_decrypt,
+    TP_PROTO(unsigned int bytes, u64 ns),
+    TP_ARGS(bytes, ns),
+    
+    TP_STRUCT__entry(
+        __field(unsigned int, bytes)
+        __field(u64, ns)
+    ),
+    
+    TP_fast_assign(
+        __entry->bytes = bytes;
+        __entry->ns = ns;
+    ),
+    
+    TP_printk("bytes=%u ns=%llu", __entry->bytes, __entry->ns),
+    
+    undertheradar_timing_reg, undertheradar_timing_unreg
+);
+
+/* One device NAPI round; work_done == budget means the budget ran out
+ * with backlog datagrams still waiting in rx_queue
+ */
+TRACE_EVENT_FN(undertheradar_napi_poll,
+    TP_PROTO(int work_done, int budget, unsigned int backlog, u64 ns),
+    TP_ARGS(work_done, budget, backlog, ns),
+    
+    TP_STRUCT__entry(
+        __field(int, work_done)
+        __field(int, budget)
+        __field(unsigned int, backlog)
+        __field(u64, ns)
+    ),
+    
+    TP_fast_assign(
+        __entry->work_done = work_done;
+        __entry->budget = budget;
+        __entry->backlog = backlog;
+        __entry->ns = ns;
+    ),
+    
+    TP_printk("work_done=%d budget=%d backlog=%u ns=%llu", __entry->work_done,
+              __entry->budget, __entry->backlog, __entry->ns),
+    
+    undertheradar_timing_reg, undertheradar_timing_unreg
+);
+
+/* rx_queue depth seen by the encap handler, and whether it had to drop */
+TRACE_EVENT(undertheradar_rx_enqueue,
+    TP_PROTO(unsigned int depth, bool dropped),
+    TP_ARGS(depth, dropped),
+    
+    TP_STRUCT__entry(
+        __field(unsigned int, depth)
+        __field(bool, dropped)
+    ),
+    
+    TP_fast_assign(
+        __entry->depth = depth;
+        __entry->dropped = dropped;
+    ),
+    
+    TP_printk("depth=%u dropped=%d", __entry->depth, __entry->dropped)
+);
+
+#endif /* _UNDERTHERADAR_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE undertheradar_trace
+#include <trace/define_trace.h>
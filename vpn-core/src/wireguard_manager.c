@@ -6,57 +6,322 @@
 #include <linux/ip.h>
 #include <linux/udp.h>
 #include <linux/crypto.h>
+#include <linux/rculist.h>
+#include <linux/ptr_ring.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/highmem.h>
+#include <linux/jump_label.h>
+#include <linux/sched/clock.h>
+#include <asm/unaligned.h>
 #include <net/ipv6.h>
 #include <net/udp_tunnel.h>
+#include <net/udp.h>
+#include <net/ip6_route.h>
+#include <net/netevent.h>
+#include <net/route.h>
 #include <crypto/curve25519.h>
 #include <crypto/chacha20poly1305.h>
+#include <linux/scatterlist.h>
+
+#define CREATE_TRACE_POINTS
+#include "undertheradar_trace.h"
 
 #define UNDERTHERADAR_VERSION "1.0.0"
 #define WG_KEY_LEN 32
 #define WG_HANDSHAKE_TIMEOUT 120
 #define REKEY_AFTER_MESSAGES (1ULL << 60)
-#define REJECT_AFTER_MESSAGES (1ULL << 64)
+#define REJECT_AFTER_MESSAGES (U64_MAX - 8192 - 1)
 #define REKEY_AFTER_TIME 120
+#define REJECT_AFTER_TIME 180
 #define KEEPALIVE_TIMEOUT 10
+#define REKEY_TIMEOUT (5 * HZ)
+
+/* WireGuard message types */
+enum message_type {
+    MESSAGE_INVALID = 0,
+    MESSAGE_HANDSHAKE_INITIATION = 1,
+    MESSAGE_HANDSHAKE_RESPONSE = 2,
+    MESSAGE_HANDSHAKE_COOKIE = 3,
+    MESSAGE_DATA = 4
+};
 
 /* Performance optimizations */
 #define UNDERTHERADAR_GSO_ENABLED 1
 #define UNDERTHERADAR_GRO_ENABLED 1
 #define UNDERTHERADAR_NAPI_WEIGHT 64
 #define UNDERTHERADAR_QUEUE_LEN 1024
+#define UNDERTHERADAR_CRYPT_RING_LEN 1024
+#define UNDERTHERADAR_PEER_RING_LEN 1024
+#define UNDERTHERADAR_CRYPT_BATCH 16
+#define UNDERTHERADAR_UDP_ENCAP_TYPE 1
+#define UNDERTHERADAR_LOAD_INTERVAL (HZ / 4)
 
-struct undertheradar_peer {
-    struct list_head peer_list;
-    struct rcu_head rcu;
+/* Adaptive receive: NAPI weight and rx_queue limit move between per-device
+ * bounds, starting from UNDERTHERADAR_NAPI_WEIGHT and UNDERTHERADAR_QUEUE_LEN
+ */
+#define UNDERTHERADAR_NAPI_WEIGHT_MIN 8
+#define UNDERTHERADAR_NAPI_WEIGHT_MAX 256
+#define UNDERTHERADAR_NAPI_WEIGHT_LIMIT 1024
+#define UNDERTHERADAR_NAPI_SHRINK_ROUNDS 16
+#define UNDERTHERADAR_QUEUE_LEN_MIN UNDERTHERADAR_QUEUE_LEN
+#define UNDERTHERADAR_QUEUE_LEN_MAX 8192
+#define UNDERTHERADAR_QUEUE_LEN_LIMIT 65536
+#define UNDERTHERADAR_QUEUE_SHRINK_INTERVALS 16   /* quiet load intervals, ~4s */
+#define UNDERTHERADAR_BUSY_POLL_MAX_USECS 10000
+
+/* Handshake offload and cookie load shedding */
+#define UNDERTHERADAR_MAX_QUEUED_HANDSHAKES 4096
+#define UNDERTHERADAR_HANDSHAKE_LOAD_THRESHOLD (UNDERTHERADAR_MAX_QUEUED_HANDSHAKES / 8)
+#define UNDERTHERADAR_UNDER_LOAD_HOLD HZ
+
+/* Authenticated receive counters are reported to the XDP session map
+ * once per stride, which is plenty to keep its replay floor current.
+ */
+#define UNDERTHERADAR_SESSION_COUNTER_STRIDE 1024
+
+/* Obfuscation: padding is 1..UNDERTHERADAR_OBFS_MAX_PAD bytes, last byte
+ * holding its length; drawn from a per-CPU pool of random bytes.
+ */
+#define UNDERTHERADAR_OBFS_MAX_PAD 32
+#define UNDERTHERADAR_OBFS_POOL_LEN 1024
+
+/* Peer timer wheel: 100ms ticks, 512 slots (~51s) below 64 coarse slots */
+#define UNDERTHERADAR_WHEEL_TICK (HZ / 10)
+#define UNDERTHERADAR_WHEEL_L0_BITS 9
+#define UNDERTHERADAR_WHEEL_L1_BITS 6
+#define UNDERTHERADAR_WHEEL_L0_SIZE (1UL << UNDERTHERADAR_WHEEL_L0_BITS)
+#define UNDERTHERADAR_WHEEL_L1_SIZE (1UL << UNDERTHERADAR_WHEEL_L1_BITS)
+#define UNDERTHERADAR_KEEPALIVE_JITTER (HZ / 2)
+#define UNDERTHERADAR_REKEY_JITTER (HZ / 3)
+
+enum undertheradar_peer_timer {
+    TIMER_RETRANSMIT_HANDSHAKE,
+    TIMER_PERSISTENT_KEEPALIVE,
+    TIMER_ZERO_KEY_MATERIAL,
+    UNDERTHERADAR_TIMER_MAX
+};
+
+/* One wheel per device replaces three timer_lists per peer; each peer is
+ * filed once, under its earliest armed deadline.
+ */
+struct undertheradar_timer_wheel {
     spinlock_t lock;
-    
-    /* Keys and crypto */
+    unsigned long next_tick;
+    struct hlist_head level0[UNDERTHERADAR_WHEEL_L0_SIZE];
+    struct hlist_head level1[UNDERTHERADAR_WHEEL_L1_SIZE];
+    struct hlist_head fire_list;
+    struct delayed_work work;
+};
+
+/* Per-packet crypto state, published by workers and consumed in order */
+enum undertheradar_packet_state {
+    PACKET_STATE_UNCRYPTED,
+    PACKET_STATE_CRYPTED,
+    PACKET_STATE_DEAD
+};
+
+struct undertheradar_skb_cb {
+    struct undertheradar_peer *peer;
+    struct noise_keypair *keypair;  /* TX batch head; RX set by decrypt */
+    u64 nonce;                      /* TX first counter of the batch; RX counter */
+    atomic_t state;
+    int rx_cpu;                     /* RX CPU that ran encap_rcv */
+};
+
+#define PACKET_CB(skb) ((struct undertheradar_skb_cb *)((skb)->cb))
+
+/* One ring and worker per CPU; producers spread packets round-robin,
+ * except RX with crypt_on_rx_cpu, which stays on the receiving CPU
+ */
+struct crypt_queue_cpu {
+    struct ptr_ring ring;
+    struct work_struct work;
+    struct crypt_queue *queue;
+};
+
+struct crypt_queue {
+    struct crypt_queue_cpu __percpu *cpu;
+    struct undertheradar_device *wg;
+    int last_cpu;
+};
+
+/* Allowed-IPs longest-prefix-match trie, one per device and family */
+struct allowedips_node {
+    struct allowedips_node __rcu *bit[2];
+    struct allowedips_node __rcu **parent_slot;
+    struct allowedips_node *parent;
+    struct list_head entries;   /* allowedips_entry, one per claiming peer */
+    struct rcu_head rcu;
+    u8 cidr, bit_at_a, bit_at_b, bitlen;
+    u8 bits[16] __aligned(__alignof(u64));
+};
+
+struct allowedips_entry {
+    struct list_head node_list;  /* RCU, on allowedips_node.entries */
+    struct list_head peer_list;  /* on undertheradar_peer_ext.allowed_ips */
+    struct undertheradar_peer *peer;
+    struct allowedips_node *node;
+    struct rcu_head rcu;
+};
+
+struct undertheradar_allowedips {
+    struct allowedips_node __rcu *root4;
+    struct allowedips_node __rcu *root6;
+    u64 seq;
+};
+
+/* Per-CPU peer counters; writers run with BH disabled on their own CPU */
+struct undertheradar_peer_stats {
+    u64 rx_bytes, tx_bytes;
+    u64 rx_packets, tx_packets;
+    u64 rx_errors, tx_errors;
+    struct u64_stats_sync syncp;
+};
+
+#define PEER_STATS_ADD(peer, field, val) do {                               \
+        struct undertheradar_peer_stats *__s = this_cpu_ptr((peer)->stats); \
+                                                                           \
+        u64_stats_update_begin(&__s->syncp);                               \
+        __s->field += (val);                                               \
+        u64_stats_update_end(&__s->syncp);                                 \
+    } while (0)
+
+/* Fake TLS record header prepended to obfuscated datagrams */
+struct obfuscation_header {
+    u8 fake_content_type;
+    __be16 fake_tls_version;
+    __be16 length;
+} __packed;
+
+/* Compact outer endpoint; sockaddr_storage alone would cost two cache lines */
+struct undertheradar_endpoint {
+    union {
+        struct sockaddr addr;
+        struct sockaddr_in addr4;
+        struct sockaddr_in6 addr6;
+    };
+};
+
+/* Per-CPU cached route to a peer's endpoint, with the endpoint snapshot it
+ * was resolved for. Valid while both generations match and dst_check()
+ * passes.
+ */
+struct undertheradar_dst_slot {
+    struct dst_entry *dst;
+    struct undertheradar_endpoint endpoint;
+    union {
+        __be32 saddr4;
+        struct in6_addr saddr6;
+    };
+    u32 cookie;
+    u32 route_gen;
+    u32 endpoint_gen;
+};
+
+/* Multi-hop chain member; peers whose next hop it is hang off peers */
+struct hop_node {
+    struct list_head list;
     u8 public_key[WG_KEY_LEN];
+    struct undertheradar_endpoint endpoint;
+    struct list_head peers;
+};
+
+/* Cold per-peer state, allocated separately so it never shares cache lines
+ * with the packet path.
+ */
+struct undertheradar_peer_ext {
+    struct undertheradar_peer *peer;
     u8 preshared_key[WG_KEY_LEN];
-    struct noise_handshake handshake;
-    struct noise_keypairs keypairs;
     
-    /* Endpoint */
-    struct sockaddr_storage endpoint;
-    struct dst_cache endpoint_cache;
+    /* Timers, driven by the device timer wheel; a zero deadline is unarmed */
+    struct hlist_node wheel_node;
+    struct hlist_node fire_node;
+    unsigned long deadline[UNDERTHERADAR_TIMER_MAX];
+    unsigned long filed_tick;
+    unsigned long fire_mask;
+    bool is_dead;
+    unsigned long persistent_keepalive_interval;
+    unsigned long handshake_retry_interval;
+    unsigned int handshake_failures;
     
-    /* Timers */
-    struct timer_list timer_retransmit_handshake;
-    struct timer_list timer_persistent_keepalive;
-    struct timer_list timer_zero_key_material;
-    
-    /* Statistics */
-    atomic64_t rx_bytes, tx_bytes;
-    atomic64_t rx_packets, tx_packets;
-    atomic64_t rx_errors, tx_errors;
+    /* Receiver indices last announced to the XDP session map, under lock */
+    __le32 session_index[3];
+    unsigned int session_count;
     
     /* Rate limiting */
     struct ratelimiter_entry *ratelimiter_entry;
     
-    /* Advanced features */
-    bool split_tunnel_enabled;
-    struct list_head allowed_ips;
+    /* Routing bookkeeping, under device_update_lock */
+    struct list_head allowed_ips;   /* allowedips_entry */
+    struct list_head hop_peer_list; /* on hop_node.peers */
+    struct hop_node *hop;           /* also under lock; NULL sends direct */
+    bool via_hops;
+    u64 load_last_tx_bytes;
+};
+
+/* Field order is part of the fast path: the first two cache lines hold
+ * everything xmit and receive touch per packet, pointers first so there
+ * are no holes. The obfuscation key gets the third line to itself, so
+ * only obfuscated peers pay for it. Checked by the static_asserts below;
+ * keep them passing when adding fields.
+ */
+struct undertheradar_peer {
+    /* TX/RX hot path */
+    struct noise_keypairs keypairs;
+    struct undertheradar_peer_stats __percpu *stats;
+    struct undertheradar_device *device;
+    struct undertheradar_dst_slot __percpu *dst_slots;
+    u64 load_estimate;              /* refreshed every UNDERTHERADAR_LOAD_INTERVAL */
+    struct undertheradar_endpoint endpoint;   /* written under lock */
+    u32 last_handshake_rtt;
     u32 fwmark;
+    int serial_work_cpu;
+    u32 endpoint_gen;
+    bool split_tunnel_enabled;
+    bool obfuscation_enabled;
+    
+    u8 obfuscation_key[WG_KEY_LEN] ____cacheline_aligned_in_smp;
+    
+    /* Ordered queues: packets leave in arrival order once crypted */
+    struct ptr_ring tx_ordered ____cacheline_aligned_in_smp;
+    struct ptr_ring rx_ordered;
+    struct work_struct transmit_packet_work;
+    struct napi_struct napi;
+    
+    /* Control plane */
+    struct list_head peer_list ____cacheline_aligned_in_smp;
+    struct rcu_head rcu;
+    spinlock_t lock;
+    u8 public_key[WG_KEY_LEN];
+    struct noise_handshake handshake;
+    struct undertheradar_peer_ext *ext;
+};
+
+/* Debug spinlocks inflate noise_keypairs; only production layouts count */
+#if !defined(CONFIG_DEBUG_SPINLOCK) && !defined(CONFIG_DEBUG_LOCK_ALLOC)
+static_assert(offsetofend(struct undertheradar_peer, obfuscation_enabled) <=
+              2 * SMP_CACHE_BYTES,
+              "undertheradar_peer hot fields spill past two cache lines");
+static_assert(offsetofend(struct undertheradar_peer, obfuscation_key) <=
+              3 * SMP_CACHE_BYTES,
+              "undertheradar_peer obfuscation key spills past its cache line");
+#endif
+static_assert(offsetof(struct undertheradar_peer, tx_ordered) % SMP_CACHE_BYTES == 0,
+              "undertheradar_peer ordered queues must start a cache line");
+
+/* Per-device receive settings, written under device_update_lock from
+ * sysfs (/sys/class/net/<dev>/undertheradar) and read locklessly
+ */
+struct undertheradar_rx_tuning {
+    u32 adaptive;
+    u32 napi_weight_min;
+    u32 napi_weight_max;
+    u32 rx_queue_min;
+    u32 rx_queue_max;
+    u32 busy_poll_usecs;    /* 0 = complete NAPI as soon as rx_queue drains */
+    u32 crypt_on_rx_cpu;    /* decrypt where encap_rcv ran, for XDP-steered peers */
 };
 
 struct undertheradar_device {
@@ -76,6 +341,34 @@ struct undertheradar_device {
     /* Performance features */
     struct napi_struct napi;
     struct sk_buff_head rx_queue;
+    struct undertheradar_allowedips peer_allowedips;
+    
+    /* Adaptive receive state; the NAPI weight itself lives in napi.weight */
+    struct undertheradar_rx_tuning rx_tuning;
+    u32 rx_queue_limit;
+    u32 rx_depth_peak;          /* deepest backlog since the last tune */
+    bool rx_overflowed;
+    u16 rx_quiet_intervals;     /* written only by undertheradar_rx_tune */
+    u16 napi_light_rounds;      /* written only by undertheradar_poll */
+    u64 rx_busy_since;
+    
+    /* Parallel crypto */
+    struct workqueue_struct *packet_crypt_wq;
+    struct crypt_queue encrypt_queue;
+    struct crypt_queue decrypt_queue;
+    
+    /* Periodic per-peer load estimation for routing */
+    struct delayed_work load_work;
+    
+    /* Rekey, keepalive and key zeroing for all peers */
+    struct undertheradar_timer_wheel timers;
+    
+    /* Handshakes run on their own per-CPU queues, apart from data */
+    struct workqueue_struct *handshake_wq;
+    struct crypt_queue handshake_queue;
+    atomic_t handshake_queue_len;
+    unsigned long last_under_load;
+    struct cookie_checker cookie_checker;
     
     /* Kill switch */
     bool kill_switch_enabled;
@@ -90,267 +383,2353 @@ struct undertheradar_device {
     struct list_head hop_chain;
 };
 
-/* High-performance packet processing with GSO/GRO support */
-static netdev_tx_t undertheradar_xmit(struct sk_buff *skb, 
-                                       struct net_device *dev)
+/* Defined further down, next to the code they belong with */
+static void undertheradar_timer_arm(struct undertheradar_peer *peer,
+                                    enum undertheradar_peer_timer which,
+                                    unsigned long delay);
+static void undertheradar_timer_disarm(struct undertheradar_peer *peer,
+                                       enum undertheradar_peer_timer which);
+static int undertheradar_socket_send_skb_to_peer(struct undertheradar_peer *peer,
+                                                 struct sk_buff *skb);
+static int undertheradar_obfuscate_packet(struct sk_buff *skb,
+                                          struct undertheradar_peer *peer);
+static struct sk_buff *undertheradar_rx_split_train(struct undertheradar_device *wg,
+                                                    struct sk_buff *skb);
+static struct undertheradar_peer *undertheradar_routing_lookup(struct undertheradar_device *wg,
+                                                              struct sk_buff *skb);
+
+/* Hot-path timing, patched in only while a timed tracepoint is attached */
+static DEFINE_STATIC_KEY_FALSE(undertheradar_timing);
+
+int undertheradar_timing_reg(void)
 {
-    struct undertheradar_device *wg = netdev_priv(dev);
-    struct undertheradar_peer *peer;
-    struct sk_buff *segs;
-    int ret = NETDEV_TX_OK;
-    
-    /* GSO segmentation for better performance */
-    if (skb_is_gso(skb)) {
-        segs = skb_gso_segment(skb, dev->features);
-        if (IS_ERR(segs)) {
-            ret = PTR_ERR(segs);
-            goto err;
-        }
-        
-        consume_skb(skb);
-        skb = segs;
-    }
+    static_branch_inc(&undertheradar_timing);
+    return 0;
+}
+
+void undertheradar_timing_unreg(void)
+{
+    static_branch_dec(&undertheradar_timing);
+}
+
+static __always_inline u64 undertheradar_timing_start(void)
+{
+    return static_branch_unlikely(&undertheradar_timing) ? ktime_get_ns() : 0;
+}
+
+/* Session lifecycle anchors. The XDP object attaches fentry programs
+ * here to keep its receiver-index map in step with our keypairs; they
+ * are empty and cost one call when nothing is attached.
+ */
+noinline void undertheradar_session_established(__le32 local_index)
+{
+    barrier();
+}
+
+noinline void undertheradar_session_counter(__le32 local_index, u64 counter)
+{
+    barrier();
+}
+
+noinline void undertheradar_session_zeroed(__le32 local_index)
+{
+    barrier();
+}
+
+/* Parallel crypto: packets fan out across per-CPU rings for ChaCha20-Poly1305
+ * and are reassembled per peer, in order, before transmit or GRO receive.
+ */
+static int undertheradar_cpumask_next_online(int *last_cpu)
+{
+    int cpu = cpumask_next(READ_ONCE(*last_cpu), cpu_online_mask);
     
-    /* Find peer based on routing decision */
-    peer = undertheradar_routing_lookup(wg, skb);
-    if (unlikely(!peer)) {
-        net_dbg_ratelimited("%s: No peer for packet\n", dev->name);
-        ret = -ENOKEY;
-        goto err;
-    }
+    if (cpu >= nr_cpu_ids)
+        cpu = cpumask_first(cpu_online_mask);
+    WRITE_ONCE(*last_cpu, cpu);
+    return cpu;
+}
+
+static int undertheradar_crypt_queue_init(struct undertheradar_device *wg,
+                                          struct crypt_queue *queue,
+                                          work_func_t function)
+{
+    int cpu, ret;
     
-    /* Apply split tunneling if enabled */
-    if (peer->split_tunnel_enabled) {
-        if (should_bypass_tunnel(skb, peer)) {
-            return undertheradar_bypass_tunnel(skb);
-        }
-    }
+    queue->wg = wg;
+    queue->last_cpu = -1;
+    queue->cpu = alloc_percpu(struct crypt_queue_cpu);
+    if (!queue->cpu)
+        return -ENOMEM;
     
-    /* Encrypt and queue packet */
-    do {
-        struct sk_buff *next = skb->next;
+    for_each_possible_cpu(cpu) {
+        struct crypt_queue_cpu *qc = per_cpu_ptr(queue->cpu, cpu);
         
-        skb->next = NULL;
-        skb->prev = NULL;
-        
-        /* ChaCha20-Poly1305 AEAD encryption */
-        if (undertheradar_packet_encrypt(skb, peer) == 0) {
-            undertheradar_packet_queue_tx(peer, skb);
-        } else {
-            kfree_skb(skb);
-            atomic64_inc(&peer->tx_errors);
-        }
-        
-        skb = next;
-    } while (skb);
-    
-    /* Trigger transmission */
-    undertheradar_packet_send_now(peer);
+        ret = ptr_ring_init(&qc->ring, UNDERTHERADAR_CRYPT_RING_LEN, GFP_KERNEL);
+        if (ret < 0)
+            goto err;
+        qc->queue = queue;
+        INIT_WORK(&qc->work, function);
+    }
     
-    return NETDEV_TX_OK;
+    return 0;
     
 err:
-    kfree_skb_list(skb);
-    atomic64_inc(&dev->stats.tx_errors);
+    while (--cpu >= 0)
+        ptr_ring_cleanup(&per_cpu_ptr(queue->cpu, cpu)->ring, NULL);
+    free_percpu(queue->cpu);
     return ret;
 }
 
-/* NAPI polling for high-performance packet reception */
-static int undertheradar_poll(struct napi_struct *napi, int budget)
+static void undertheradar_crypt_queue_free(struct crypt_queue *queue)
 {
-    struct undertheradar_device *wg = container_of(napi, 
-                                    struct undertheradar_device, napi);
-    struct sk_buff *skb;
-    int work_done = 0;
+    int cpu;
     
-    while (work_done < budget) {
-        skb = skb_dequeue(&wg->rx_queue);
-        if (!skb)
-            break;
-        
-        /* Decrypt packet */
-        if (undertheradar_packet_decrypt(skb, wg) == 0) {
-            /* GRO aggregation for better performance */
-            napi_gro_receive(napi, skb);
-            work_done++;
-        } else {
-            kfree_skb(skb);
-            atomic64_inc(&wg->dev->stats.rx_errors);
-        }
-    }
-    
-    if (work_done < budget)
-        napi_complete_done(napi, work_done);
-    
-    return work_done;
+    /* Ordered queues own the skbs; crypt rings only borrow them */
+    for_each_possible_cpu(cpu)
+        ptr_ring_cleanup(&per_cpu_ptr(queue->cpu, cpu)->ring, NULL);
+    free_percpu(queue->cpu);
 }
 
-/* Kill switch implementation */
-static int undertheradar_enable_kill_switch(struct undertheradar_device *wg)
+/* Queue on the peer's ordered ring first, then hand to a crypto CPU:
+ * the given one if it is still online, else the next in round-robin
+ */
+static int undertheradar_queue_enqueue_per_device_and_peer(struct crypt_queue *queue,
+                                                           struct ptr_ring *ordered,
+                                                           struct sk_buff *skb, int cpu)
 {
-    struct iptables_rule *rule;
-    int ret;
+    struct crypt_queue_cpu *qc;
     
-    if (wg->kill_switch_enabled)
-        return 0;
-    
-    /* Drop all traffic not going through VPN */
-    rule = iptables_create_rule("-A OUTPUT -o %s -j ACCEPT", wg->dev->name);
-    if (!rule)
-        return -ENOMEM;
+    atomic_set_release(&PACKET_CB(skb)->state, PACKET_STATE_UNCRYPTED);
+    if (unlikely(ptr_ring_produce_bh(ordered, skb)))
+        return -ENOSPC;
     
-    ret = iptables_add_rule(rule);
-    if (ret < 0) {
-        iptables_free_rule(rule);
-        return ret;
+    if (cpu < 0 || !cpu_online(cpu))
+        cpu = undertheradar_cpumask_next_online(&queue->last_cpu);
+    qc = per_cpu_ptr(queue->cpu, cpu);
+    if (unlikely(ptr_ring_produce_bh(&qc->ring, skb))) {
+        /* Already ordered, so let the serial consumer free it in turn */
+        atomic_set_release(&PACKET_CB(skb)->state, PACKET_STATE_DEAD);
+        return -EPIPE;
     }
     
-    /* Drop all other traffic */
-    rule = iptables_create_rule("-A OUTPUT -j DROP");
-    ret = iptables_add_rule(rule);
-    
-    wg->kill_switch_enabled = true;
-    return ret;
+    queue_work_on(cpu, queue->wg->packet_crypt_wq, &qc->work);
+    return 0;
 }
 
-/* DNS leak protection */
-static int undertheradar_setup_secure_dns(struct undertheradar_device *wg)
+/* Reserve one counter per segment with a single atomic on the keypair */
+static struct noise_keypair *undertheradar_reserve_nonces(struct undertheradar_peer *peer,
+                                                          unsigned int count,
+                                                          u64 *first_nonce)
 {
-    struct dns_config *dns;
-    int ret;
-    
-    dns = kzalloc(sizeof(*dns), GFP_KERNEL);
-    if (!dns)
-        return -ENOMEM;
+    struct noise_keypair *keypair;
+    u64 nonce;
     
-    /* Force all DNS through VPN tunnel */
-    dns->servers[0] = "10.0.0.1";  /* Internal DNS */
-    dns->servers[1] = "10.0.0.2";  /* Backup DNS */
+    rcu_read_lock_bh();
+    keypair = rcu_dereference_bh(peer->keypairs.current_keypair);
+    if (unlikely(!keypair || !READ_ONCE(keypair->sending.is_valid)))
+        goto out_nokey;
     
-    /* Block all other DNS servers */
-    ret = iptables_block_dns_except(dns->servers, 2);
-    if (ret < 0) {
-        kfree(dns);
-        return ret;
+    nonce = atomic64_fetch_add(count, &keypair->sending_counter);
+    if (unlikely(nonce + count >= REJECT_AFTER_MESSAGES)) {
+        WRITE_ONCE(keypair->sending.is_valid, false);
+        goto out_nokey;
     }
     
-    /* Enable DNS-over-HTTPS for extra security */
-    dns->doh_enabled = true;
-    dns->doh_server = "https://dns.undertheradar.work/dns-query";
+    /* Held until the batch has been sealed */
+    if (unlikely(!kref_get_unless_zero(&keypair->refcount)))
+        goto out_nokey;
+    rcu_read_unlock_bh();
     
-    wg->secure_dns = dns;
-    wg->dns_leak_protection = true;
+    *first_nonce = nonce;
+    return keypair;
     
-    return 0;
+out_nokey:
+    rcu_read_unlock_bh();
+    return NULL;
 }
 
-/* Multi-hop VPN chain */
-static int undertheradar_add_hop(struct undertheradar_device *wg,
-                                 const u8 *public_key,
-                                 struct sockaddr_storage *endpoint)
+static int undertheradar_packet_encrypt_one(struct sk_buff *skb,
+                                            struct noise_keypair *keypair,
+                                            u64 nonce)
 {
-    struct hop_node *hop;
+    struct scatterlist sg[MAX_SKB_FRAGS + 8];
+    struct message_data *header;
+    unsigned int padding_len, plaintext_len, trailer_len;
+    struct sk_buff *trailer;
+    int num_frags;
     
-    hop = kzalloc(sizeof(*hop), GFP_KERNEL);
-    if (!hop)
-        return -ENOMEM;
+    /* Pad to a multiple of 16 and make room for the Poly1305 tag */
+    plaintext_len = skb->len;
+    padding_len = ALIGN(plaintext_len, 16) - plaintext_len;
+    trailer_len = padding_len + CHACHA20POLY1305_AUTHTAG_SIZE;
     
-    memcpy(hop->public_key, public_key, WG_KEY_LEN);
-    memcpy(&hop->endpoint, endpoint, sizeof(*endpoint));
+    num_frags = skb_cow_data(skb, trailer_len, &trailer);
+    if (unlikely(num_frags < 0 || num_frags > ARRAY_SIZE(sg)))
+        return -EINVAL;
     
-    /* Add to chain maintaining order */
-    list_add_tail(&hop->list, &wg->hop_chain);
+    memset(pskb_put(skb, trailer, padding_len), 0, padding_len);
     
-    /* Recalculate routing through all hops */
-    undertheradar_recalculate_hop_routing(wg);
+    header = skb_push(skb, sizeof(*header));
+    header->header.type = cpu_to_le32(MESSAGE_DATA);
+    header->key_idx = keypair->remote_index;
+    header->counter = cpu_to_le64(nonce);
+    pskb_put(skb, trailer, CHACHA20POLY1305_AUTHTAG_SIZE);
     
-    return 0;
+    sg_init_table(sg, num_frags);
+    if (skb_to_sgvec(skb, sg, sizeof(*header), plaintext_len + padding_len +
+                     CHACHA20POLY1305_AUTHTAG_SIZE) <= 0)
+        return -EINVAL;
+    
+    /* lib/crypto dispatches to the AVX2/AVX-512/NEON backends */
+    return chacha20poly1305_encrypt_sg_inplace(sg, plaintext_len + padding_len,
+                                               NULL, 0, nonce,
+                                               keypair->sending.key) ? 0 : -EINVAL;
 }
 
-/* Advanced connection stability with automatic failover */
-static void undertheradar_peer_check_handshake(struct timer_list *timer)
+/* Seal a whole segment list with one keypair and a contiguous nonce range */
+static int undertheradar_packet_encrypt_batch(struct sk_buff *first,
+                                              struct undertheradar_peer *peer)
 {
-    struct undertheradar_peer *peer = from_timer(peer, timer, 
-                                                 timer_retransmit_handshake);
+    struct noise_keypair *keypair = PACKET_CB(first)->keypair;
+    u64 start = undertheradar_timing_start();
+    u64 nonce = PACKET_CB(first)->nonce;
+    unsigned int segs = 0, bytes = 0;
+    struct sk_buff *skb;
+    int ret = 0;
     
-    /* If handshake fails, try alternative endpoints */
-    if (peer->handshake_failures > 3) {
-        undertheradar_try_alternative_endpoint(peer);
+    for (skb = first; skb; skb = skb->next, ++nonce, ++segs) {
+        if (skb->next)
+            prefetch(skb->next->data);
+        
+        ret = undertheradar_packet_encrypt_one(skb, keypair, nonce);
+        if (unlikely(ret))
+            break;
+        
+        /* Obfuscate while the sealed segment is still in cache */
+        if (peer->obfuscation_enabled) {
+            ret = undertheradar_obfuscate_packet(skb, peer);
+            if (unlikely(ret))
+                break;
+        }
+        bytes += skb->len;
     }
     
-    /* Implement aggressive retry with exponential backoff */
-    peer->handshake_retry_interval = min(peer->handshake_retry_interval * 2,
-                                         MAX_HANDSHAKE_RETRY);
-    
-    undertheradar_packet_send_handshake_initiation(peer);
+    noise_keypair_put(keypair, false);
     
-    mod_timer(&peer->timer_retransmit_handshake,
-              jiffies + peer->handshake_retry_interval);
+    if (static_branch_unlikely(&undertheradar_timing))
+        trace_undertheradar_encrypt(segs, bytes, ktime_get_ns() - start);
+    return ret;
 }
 
-/* Protocol obfuscation for censorship resistance */
-static struct sk_buff *undertheradar_obfuscate_packet(struct sk_buff *skb,
-                                                      struct undertheradar_peer *peer)
+/* Split a segment list into batches and reserve their counters up front */
+static void undertheradar_xmit_batches(struct undertheradar_device *wg,
+                                       struct undertheradar_peer *peer,
+                                       struct sk_buff *skb)
 {
-    struct obfuscation_header *obfs;
-    u8 random_padding[32];
-    
-    /* Add random padding to hide packet patterns */
-    get_random_bytes(random_padding, sizeof(random_padding));
-    
-    /* Make packet look like HTTPS traffic */
-    obfs = (struct obfuscation_header *)skb_push(skb, sizeof(*obfs));
-    obfs->fake_tls_version = htons(0x0303);  /* TLS 1.2 */
-    obfs->fake_content_type = 0x17;          /* Application data */
+    struct noise_keypair *keypair;
+    struct sk_buff *batch, *tail;
+    unsigned int count;
+    u64 nonce;
+    int ret;
     
-    /* XOR with time-based key to prevent pattern detection */
-    undertheradar_xor_obfuscate(skb->data, skb->len, 
-                                peer->obfuscation_key);
+    while (skb) {
+        batch = skb;
+        count = 1;
+        for (tail = skb; tail->next && count < UNDERTHERADAR_CRYPT_BATCH; tail = tail->next)
+            count++;
+        skb = tail->next;
+        tail->next = NULL;
+        batch->prev = NULL;
+        
+        PACKET_CB(batch)->peer = peer;
+        keypair = undertheradar_reserve_nonces(peer, count, &nonce);
+        PACKET_CB(batch)->keypair = keypair;
+        if (unlikely(!keypair)) {
+            /* No usable session, so kick off a fresh handshake */
+            undertheradar_packet_send_handshake_initiation(peer);
+            kfree_skb_list(batch);
+            PEER_STATS_ADD(peer, tx_errors, count);
+            continue;
+        }
+        PACKET_CB(batch)->nonce = nonce;
+        
+        ret = undertheradar_queue_enqueue_per_device_and_peer(&wg->encrypt_queue,
+                                                              &peer->tx_ordered,
+                                                              batch, -1);
+        if (ret == -ENOSPC) {
+            noise_keypair_put(keypair, false);
+            kfree_skb_list(batch);
+            PEER_STATS_ADD(peer, tx_errors, count);
+            continue;
+        }
+        
+        /* A dead batch never reaches encrypt_batch(), which would drop the
+         * reference; the tx worker may already be freeing it, so use the
+         * local copy rather than the cb.
+         */
+        if (unlikely(ret == -EPIPE))
+            noise_keypair_put(keypair, false);
+        
+        /* Dead batches are freed in order once the tx worker reaches them */
+        queue_work_on(peer->serial_work_cpu, wg->packet_crypt_wq,
+                      &peer->transmit_packet_work);
+    }
+}
+
+static void undertheradar_packet_encrypt_worker(struct work_struct *work)
+{
+    struct crypt_queue_cpu *qc = container_of(work, struct crypt_queue_cpu, work);
+    struct sk_buff *skb;
     
-    return skb;
+    while ((skb = ptr_ring_consume_bh(&qc->ring)) != NULL) {
+        struct undertheradar_peer *peer = PACKET_CB(skb)->peer;
+        enum undertheradar_packet_state state = PACKET_STATE_CRYPTED;
+        
+        /* ChaCha20-Poly1305 AEAD encryption over the whole batch */
+        if (undertheradar_packet_encrypt_batch(skb, peer) != 0)
+            state = PACKET_STATE_DEAD;
+        
+        atomic_set_release(&PACKET_CB(skb)->state, state);
+        queue_work_on(peer->serial_work_cpu, qc->queue->wg->packet_crypt_wq,
+                      &peer->transmit_packet_work);
+        cond_resched();
+    }
 }
 
-/* Network performance optimization */
-static void undertheradar_optimize_socket(struct socket *sock)
+static void undertheradar_packet_decrypt_worker(struct work_struct *work)
 {
-    int val;
+    struct crypt_queue_cpu *qc = container_of(work, struct crypt_queue_cpu, work);
+    struct sk_buff *skb;
+    
+    while ((skb = ptr_ring_consume_bh(&qc->ring)) != NULL) {
+        struct undertheradar_peer *peer = PACKET_CB(skb)->peer;
+        enum undertheradar_packet_state state = PACKET_STATE_CRYPTED;
+        u64 start = undertheradar_timing_start();
+        
+        if (undertheradar_packet_decrypt(skb, qc->queue->wg) != 0)
+            state = PACKET_STATE_DEAD;
+        else if (!(PACKET_CB(skb)->nonce & (UNDERTHERADAR_SESSION_COUNTER_STRIDE - 1)))
+            undertheradar_session_counter(PACKET_CB(skb)->keypair->local_index,
+                                          PACKET_CB(skb)->nonce);
+        
+        /* Before the release store: NAPI may consume the skb right after */
+        if (static_branch_unlikely(&undertheradar_timing))
+            trace_undertheradar_decrypt(skb->len, ktime_get_ns() - start);
+        
+        atomic_set_release(&PACKET_CB(skb)->state, state);
+        napi_schedule(&peer->napi);
+        cond_resched();
+    }
+}
+
+/* Peek the head of an ordered ring once its crypto has finished */
+static struct sk_buff *undertheradar_ordered_dequeue(struct ptr_ring *ordered,
+                                                     enum undertheradar_packet_state *state)
+{
+    struct sk_buff *skb = __ptr_ring_peek(ordered);
+    
+    if (!skb)
+        return NULL;
+    
+    *state = atomic_read_acquire(&PACKET_CB(skb)->state);
+    if (*state == PACKET_STATE_UNCRYPTED)
+        return NULL;
+    
+    __ptr_ring_discard_one(ordered);
+    return skb;
+}
+
+/* Outer UDP GSO: chain a sealed batch into one super-skb so the stack or NIC
+ * segments it past the UDP layer instead of traversing it per datagram.
+ */
+static struct sk_buff *undertheradar_coalesce_udp_gso(struct sk_buff *first)
+{
+    struct sk_buff *skb, *last = first;
+    unsigned int gso_size = first->len;
+    unsigned int segs = 1, len = 0, truesize = 0;
+    
+    if (!UNDERTHERADAR_GSO_ENABLED || !first->next)
+        return NULL;
+    
+    /* UDP_SEGMENT requires equal sizes, with only the last one shorter */
+    for (skb = first->next; skb; skb = skb->next) {
+        if (skb->len > gso_size || (last != first && last->len != gso_size))
+            return NULL;
+        if (skb_has_frag_list(skb) || ++segs > UDP_MAX_SEGMENTS)
+            return NULL;
+        len += skb->len;
+        truesize += skb->truesize;
+        last = skb;
+    }
+    
+    skb_shinfo(first)->frag_list = first->next;
+    first->next = NULL;
+    first->len += len;
+    first->data_len += len;
+    first->truesize += truesize;
+    
+    skb_shinfo(first)->gso_size = gso_size;
+    skb_shinfo(first)->gso_segs = segs;
+    skb_shinfo(first)->gso_type = SKB_GSO_UDP_L4;
+    return first;
+}
+
+/* Serial per-peer transmit, preserving the order packets entered xmit */
+static void undertheradar_packet_tx_worker(struct work_struct *work)
+{
+    struct undertheradar_peer *peer = container_of(work, struct undertheradar_peer,
+                                                   transmit_packet_work);
+    enum undertheradar_packet_state state;
+    struct sk_buff *skb;
+    
+    spin_lock_bh(&peer->tx_ordered.consumer_lock);
+    while ((skb = undertheradar_ordered_dequeue(&peer->tx_ordered, &state)) != NULL) {
+        if (likely(state == PACKET_STATE_CRYPTED)) {
+            struct sk_buff *next, *super;
+            
+            /* One UDP_SEGMENT super-skb per batch when the sizes allow it */
+            super = undertheradar_coalesce_udp_gso(skb);
+            if (super) {
+                PEER_STATS_ADD(peer, tx_packets, skb_shinfo(super)->gso_segs);
+                PEER_STATS_ADD(peer, tx_bytes, super->len);
+                undertheradar_socket_send_skb_to_peer(peer, super);
+                continue;
+            }
+            
+            for (; skb; skb = next) {
+                next = skb->next;
+                skb_mark_not_on_list(skb);
+                PEER_STATS_ADD(peer, tx_packets, 1);
+                PEER_STATS_ADD(peer, tx_bytes, skb->len);
+                undertheradar_socket_send_skb_to_peer(peer, skb);
+            }
+        } else {
+            unsigned int count = 0;
+            struct sk_buff *iter;
+            
+            for (iter = skb; iter; iter = iter->next)
+                count++;
+            kfree_skb_list(skb);
+            PEER_STATS_ADD(peer, tx_errors, count);
+        }
+    }
+    spin_unlock_bh(&peer->tx_ordered.consumer_lock);
+}
+
+/* Per-peer NAPI: deliver decrypted packets to GRO in receive order */
+static int undertheradar_peer_rx_poll(struct napi_struct *napi, int budget)
+{
+    struct undertheradar_peer *peer = container_of(napi, struct undertheradar_peer,
+                                                   napi);
+    enum undertheradar_packet_state state;
+    struct sk_buff *skb;
+    int work_done = 0;
+    
+    spin_lock(&peer->rx_ordered.consumer_lock);
+    while (work_done < budget &&
+           (skb = undertheradar_ordered_dequeue(&peer->rx_ordered, &state)) != NULL) {
+        if (likely(state == PACKET_STATE_CRYPTED)) {
+            PEER_STATS_ADD(peer, rx_packets, 1);
+            PEER_STATS_ADD(peer, rx_bytes, skb->len);
+            
+            /* GRO aggregation for better performance */
+            napi_gro_receive(napi, skb);
+        } else {
+            kfree_skb(skb);
+            PEER_STATS_ADD(peer, rx_errors, 1);
+        }
+        work_done++;
+    }
+    spin_unlock(&peer->rx_ordered.consumer_lock);
+    
+    if (work_done < budget)
+        napi_complete_done(napi, work_done);
+    
+    return work_done;
+}
+
+static int undertheradar_peer_queues_init(struct undertheradar_device *wg,
+                                          struct undertheradar_peer *peer)
+{
+    int ret;
+    
+    ret = ptr_ring_init(&peer->tx_ordered, UNDERTHERADAR_PEER_RING_LEN, GFP_KERNEL);
+    if (ret < 0)
+        return ret;
+    
+    ret = ptr_ring_init(&peer->rx_ordered, UNDERTHERADAR_PEER_RING_LEN, GFP_KERNEL);
+    if (ret < 0) {
+        ptr_ring_cleanup(&peer->tx_ordered, NULL);
+        return ret;
+    }
+    
+    peer->device = wg;
+    peer->serial_work_cpu = undertheradar_cpumask_next_online(&wg->encrypt_queue.last_cpu);
+    INIT_WORK(&peer->transmit_packet_work, undertheradar_packet_tx_worker);
+    netif_napi_add(wg->dev, &peer->napi, undertheradar_peer_rx_poll);
+    napi_enable(&peer->napi);
+    
+    return 0;
+}
+
+static void undertheradar_skb_free(void *ptr)
+{
+    kfree_skb_list(ptr);
+}
+
+/* Caller must have unpublished the peer so no new packets reach it */
+static void undertheradar_peer_queues_free(struct undertheradar_peer *peer)
+{
+    flush_workqueue(peer->device->packet_crypt_wq);
+    napi_disable(&peer->napi);
+    netif_napi_del(&peer->napi);
+    cancel_work_sync(&peer->transmit_packet_work);
+    
+    ptr_ring_cleanup(&peer->tx_ordered, undertheradar_skb_free);
+    ptr_ring_cleanup(&peer->rx_ordered, undertheradar_skb_free);
+}
+
+static int undertheradar_crypt_init(struct undertheradar_device *wg)
+{
+    int ret;
+    
+    wg->packet_crypt_wq = alloc_workqueue("undertheradar-crypt-%s",
+                                          WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 0,
+                                          wg->dev->name);
+    if (!wg->packet_crypt_wq)
+        return -ENOMEM;
+    
+    ret = undertheradar_crypt_queue_init(wg, &wg->encrypt_queue,
+                                         undertheradar_packet_encrypt_worker);
+    if (ret < 0)
+        goto err_wq;
+    
+    ret = undertheradar_crypt_queue_init(wg, &wg->decrypt_queue,
+                                         undertheradar_packet_decrypt_worker);
+    if (ret < 0)
+        goto err_encrypt;
+    
+    return 0;
+    
+err_encrypt:
+    undertheradar_crypt_queue_free(&wg->encrypt_queue);
+err_wq:
+    destroy_workqueue(wg->packet_crypt_wq);
+    return ret;
+}
+
+static void undertheradar_crypt_uninit(struct undertheradar_device *wg)
+{
+    destroy_workqueue(wg->packet_crypt_wq);
+    undertheradar_crypt_queue_free(&wg->decrypt_queue);
+    undertheradar_crypt_queue_free(&wg->encrypt_queue);
+}
+
+/* High-performance packet processing with GSO/GRO support */
+static netdev_tx_t undertheradar_xmit(struct sk_buff *skb, 
+                                       struct net_device *dev)
+{
+    struct undertheradar_device *wg = netdev_priv(dev);
+    struct undertheradar_peer *peer;
+    struct sk_buff *segs;
+    int ret = NETDEV_TX_OK;
+    
+    /* GSO segmentation for better performance */
+    if (skb_is_gso(skb)) {
+        segs = skb_gso_segment(skb, dev->features);
+        if (IS_ERR(segs)) {
+            ret = PTR_ERR(segs);
+            goto err;
+        }
+        
+        consume_skb(skb);
+        skb = segs;
+    }
+    
+    /* Find peer based on routing decision */
+    peer = undertheradar_routing_lookup(wg, skb);
+    if (unlikely(!peer)) {
+        net_dbg_ratelimited("%s: No peer for packet\n", dev->name);
+        ret = -ENOKEY;
+        goto err;
+    }
+    
+    /* Apply split tunneling if enabled */
+    if (peer->split_tunnel_enabled) {
+        if (should_bypass_tunnel(skb, peer)) {
+            return undertheradar_bypass_tunnel(skb);
+        }
+    }
+    
+    /* Fan segment batches out to the crypto workers, keeping per-peer order */
+    undertheradar_xmit_batches(wg, peer, skb);
+    
+    return NETDEV_TX_OK;
+    
+err:
+    kfree_skb_list(skb);
+    DEV_STATS_INC(dev, tx_errors);
+    return ret;
+}
+
+/* Grow the weight while rounds exhaust it with backlog left over, halve
+ * it after a run of light rounds. The core reads napi->weight afresh for
+ * every round, so the new value applies from the next one.
+ */
+static void undertheradar_napi_adapt(struct undertheradar_device *wg,
+                                     int work_done, int budget)
+{
+    const struct undertheradar_rx_tuning *t = &wg->rx_tuning;
+    int weight = wg->napi.weight;
+    
+    if (!READ_ONCE(t->adaptive))
+        return;
+    
+    if (work_done >= budget) {
+        wg->napi_light_rounds = 0;
+        if (skb_queue_len(&wg->rx_queue) > weight)
+            weight *= 2;
+    } else if (work_done < weight / 4 &&
+               ++wg->napi_light_rounds >= UNDERTHERADAR_NAPI_SHRINK_ROUNDS) {
+        wg->napi_light_rounds = 0;
+        weight /= 2;
+    }
+    
+    weight = clamp_t(int, weight, READ_ONCE(t->napi_weight_min),
+                     READ_ONCE(t->napi_weight_max));
+    if (weight != wg->napi.weight)
+        WRITE_ONCE(wg->napi.weight, weight);
+}
+
+/* Busy poll: while traffic arrived within the last busy_poll_usecs, claim
+ * the whole budget instead of completing, so NAPI stays scheduled and the
+ * next datagram is picked up without the wakeup through napi_schedule()
+ */
+static bool undertheradar_busy_poll(struct undertheradar_device *wg, int work_done)
+{
+    u32 usecs = READ_ONCE(wg->rx_tuning.busy_poll_usecs);
+    u64 now;
+    
+    if (!usecs)
+        return false;
+    
+    now = local_clock();
+    if (work_done) {
+        wg->rx_busy_since = now;
+        return true;
+    }
+    return now - wg->rx_busy_since < (u64)usecs * NSEC_PER_USEC;
+}
+
+/* Keep the first @keep datagrams of a split train and put the rest back
+ * at the head of rx_queue, in order, for the next NAPI round
+ */
+static void undertheradar_rx_requeue_tail(struct undertheradar_device *wg,
+                                          struct sk_buff *skb, int keep)
+{
+    struct sk_buff_head tail;
+    struct sk_buff *next;
+    unsigned long flags;
+    
+    while (--keep > 0 && skb->next)
+        skb = skb->next;
+    next = skb->next;
+    if (!next)
+        return;
+    skb->next = NULL;
+    
+    __skb_queue_head_init(&tail);
+    for (skb = next; skb; skb = next) {
+        next = skb->next;
+        skb_mark_not_on_list(skb);
+        __skb_queue_tail(&tail, skb);
+    }
+    
+    spin_lock_irqsave(&wg->rx_queue.lock, flags);
+    skb_queue_splice(&tail, &wg->rx_queue);
+    spin_unlock_irqrestore(&wg->rx_queue.lock, flags);
+}
+
+/* NAPI polling for high-performance packet reception; decryption and GRO
+ * happen on the crypto workers and the peer's own NAPI instance.
+ */
+static int undertheradar_poll(struct napi_struct *napi, int budget)
+{
+    struct undertheradar_device *wg = container_of(napi, 
+                                    struct undertheradar_device, napi);
+    u32 backlog = skb_queue_len(&wg->rx_queue);
+    u64 start = undertheradar_timing_start();
+    struct undertheradar_peer *peer;
+    bool local = READ_ONCE(wg->rx_tuning.crypt_on_rx_cpu);
+    struct sk_buff *skb, *next;
+    int work_done = 0;
+    int cpu, err;
+    
+    if (backlog > READ_ONCE(wg->rx_depth_peak))
+        WRITE_ONCE(wg->rx_depth_peak, backlog);
+    
+    while (work_done < budget) {
+        skb = skb_dequeue(&wg->rx_queue);
+        if (!skb)
+            break;
+        
+        /* UDP GRO trains are split here and handled as one batch, up
+         * to what is left of the budget
+         */
+        if (skb_is_gso(skb)) {
+            skb = undertheradar_rx_split_train(wg, skb);
+            if (unlikely(!skb)) {
+                DEV_STATS_INC(wg->dev, rx_errors);
+                work_done++;
+                continue;
+            }
+            undertheradar_rx_requeue_tail(wg, skb, budget - work_done);
+        }
+        
+        /* Receiver index identifies the peer before decryption; every
+         * datagram of a train shares the 5-tuple and hence the peer.
+         */
+        peer = undertheradar_packet_peer_lookup(wg, skb);
+        if (unlikely(!peer)) {
+            for (; skb; skb = next, work_done++) {
+                next = skb->next;
+                kfree_skb(skb);
+                DEV_STATS_INC(wg->dev, rx_errors);
+            }
+            continue;
+        }
+        
+        /* With XDP steering one peer's datagrams all arrive on one CPU;
+         * decrypt there too rather than fanning out, the ordered ring
+         * keeps the sequence either way
+         */
+        cpu = local ? PACKET_CB(skb)->rx_cpu : -1;
+        
+        for (; skb; skb = next, work_done++) {
+            next = skb->next;
+            skb_mark_not_on_list(skb);
+            
+            PACKET_CB(skb)->peer = peer;
+            err = undertheradar_queue_enqueue_per_device_and_peer(&wg->decrypt_queue,
+                                                                  &peer->rx_ordered,
+                                                                  skb, cpu);
+            if (unlikely(err == -ENOSPC)) {
+                kfree_skb(skb);
+                PEER_STATS_ADD(peer, rx_errors, 1);
+            } else if (unlikely(err)) {
+                napi_schedule(&peer->napi);
+            }
+        }
+    }
+    
+    if (static_branch_unlikely(&undertheradar_timing))
+        trace_undertheradar_napi_poll(work_done, budget, skb_queue_len(&wg->rx_queue),
+                                      ktime_get_ns() - start);
+    
+    undertheradar_napi_adapt(wg, work_done, budget);
+    
+    if (work_done < budget) {
+        if (undertheradar_busy_poll(wg, work_done))
+            return budget;
+        napi_complete_done(napi, work_done);
+    }
+    
+    return work_done;
+}
+
+/* Sum a peer's per-CPU counters; used by ndo_get_stats64 and netlink dumps */
+static void undertheradar_peer_stats_fold(const struct undertheradar_peer *peer,
+                                          struct undertheradar_peer_stats *sum)
+{
+    int cpu;
+    
+    memset(sum, 0, sizeof(*sum));
+    
+    for_each_possible_cpu(cpu) {
+        const struct undertheradar_peer_stats *s = per_cpu_ptr(peer->stats, cpu);
+        u64 rx_bytes, tx_bytes, rx_packets, tx_packets, rx_errors, tx_errors;
+        unsigned int start;
+        
+        do {
+            start = u64_stats_fetch_begin(&s->syncp);
+            rx_bytes = s->rx_bytes;
+            tx_bytes = s->tx_bytes;
+            rx_packets = s->rx_packets;
+            tx_packets = s->tx_packets;
+            rx_errors = s->rx_errors;
+            tx_errors = s->tx_errors;
+        } while (u64_stats_fetch_retry(&s->syncp, start));
+        
+        sum->rx_bytes += rx_bytes;
+        sum->tx_bytes += tx_bytes;
+        sum->rx_packets += rx_packets;
+        sum->tx_packets += tx_packets;
+        sum->rx_errors += rx_errors;
+        sum->tx_errors += tx_errors;
+    }
+}
+
+static int undertheradar_peer_stats_init(struct undertheradar_peer *peer)
+{
+    int cpu;
+    
+    peer->stats = alloc_percpu(struct undertheradar_peer_stats);
+    if (!peer->stats)
+        return -ENOMEM;
+    
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(peer->stats, cpu)->syncp);
+    
+    peer->load_estimate = 0;
+    return 0;
+}
+
+static void undertheradar_peer_stats_free(struct undertheradar_peer *peer)
+{
+    free_percpu(peer->stats);
+}
+
+static void undertheradar_get_stats64(struct net_device *dev,
+                                      struct rtnl_link_stats64 *stats)
+{
+    struct undertheradar_device *wg = netdev_priv(dev);
+    struct undertheradar_peer_stats sum;
+    struct undertheradar_peer *peer;
+    
+    /* Device-level drops and errors, then per-peer traffic */
+    netdev_stats_to_stats64(stats, &dev->stats);
+    
+    rcu_read_lock();
+    list_for_each_entry_rcu(peer, &wg->peer_list, peer_list) {
+        undertheradar_peer_stats_fold(peer, &sum);
+        stats->rx_bytes += sum.rx_bytes;
+        stats->tx_bytes += sum.tx_bytes;
+        stats->rx_packets += sum.rx_packets;
+        stats->tx_packets += sum.tx_packets;
+        stats->rx_errors += sum.rx_errors;
+        stats->tx_errors += sum.tx_errors;
+    }
+    rcu_read_unlock();
+}
+
+/* Growth happens in the encap handler as the queue fills; here the limit
+ * only comes back down, by half after UNDERTHERADAR_QUEUE_SHRINK_INTERVALS
+ * intervals in a row peaked under a quarter of it, never below
+ * rx_queue_min. An idle device keeps its floor for the next burst.
+ * Caller holds device_update_lock.
+ */
+static void undertheradar_rx_tune(struct undertheradar_device *wg)
+{
+    const struct undertheradar_rx_tuning *t = &wg->rx_tuning;
+    u32 limit = READ_ONCE(wg->rx_queue_limit);
+    u32 peak = READ_ONCE(wg->rx_depth_peak);
+    bool overflowed = READ_ONCE(wg->rx_overflowed);
+    
+    WRITE_ONCE(wg->rx_depth_peak, 0);
+    if (overflowed)
+        WRITE_ONCE(wg->rx_overflowed, false);
+    
+    if (!t->adaptive || overflowed || peak >= limit / 4 || limit <= t->rx_queue_min) {
+        wg->rx_quiet_intervals = 0;
+        return;
+    }
+    if (++wg->rx_quiet_intervals < UNDERTHERADAR_QUEUE_SHRINK_INTERVALS)
+        return;
+    
+    /* Lose to a concurrent grow rather than undo it */
+    wg->rx_quiet_intervals = 0;
+    cmpxchg(&wg->rx_queue_limit, limit, max(limit / 2, t->rx_queue_min));
+}
+
+/* rx_queue is full: with adaptive on, double the limit on the spot, so the
+ * burst that filled it is absorbed instead of dropped until the next tune.
+ * False once the limit is at rx_queue_max.
+ */
+static bool undertheradar_rx_grow(struct undertheradar_device *wg)
+{
+    const struct undertheradar_rx_tuning *t = &wg->rx_tuning;
+    u32 limit = READ_ONCE(wg->rx_queue_limit);
+    u32 max = READ_ONCE(t->rx_queue_max);
+    
+    if (!READ_ONCE(t->adaptive) || limit >= max)
+        return false;
+    
+    cmpxchg(&wg->rx_queue_limit, limit, min(limit * 2, max));
+    if (!READ_ONCE(wg->rx_overflowed))
+        WRITE_ONCE(wg->rx_overflowed, true);
+    return true;
+}
+
+/* Refresh the routing load estimate off the fast path: an EWMA of each
+ * peer's transmit rate in bytes per second, so routing never touches
+ * the hot per-CPU counters.
+ */
+static void undertheradar_load_worker(struct work_struct *work)
+{
+    struct undertheradar_device *wg = container_of(to_delayed_work(work),
+                                                   struct undertheradar_device,
+                                                   load_work);
+    struct undertheradar_peer_stats sum;
+    struct undertheradar_peer *peer;
+    
+    mutex_lock(&wg->device_update_lock);
+    list_for_each_entry(peer, &wg->peer_list, peer_list) {
+        u64 delta, rate;
+        
+        undertheradar_peer_stats_fold(peer, &sum);
+        delta = sum.tx_bytes - peer->ext->load_last_tx_bytes;
+        peer->ext->load_last_tx_bytes = sum.tx_bytes;
+        
+        rate = div_u64(delta * HZ, UNDERTHERADAR_LOAD_INTERVAL);
+        WRITE_ONCE(peer->load_estimate,
+                   (READ_ONCE(peer->load_estimate) * 3 + rate) / 4);
+    }
+    undertheradar_rx_tune(wg);
+    mutex_unlock(&wg->device_update_lock);
+    
+    queue_delayed_work(system_power_efficient_wq, &wg->load_work,
+                       UNDERTHERADAR_LOAD_INTERVAL);
+}
+
+/* Handshake offload. Message types 1-3 bypass NAPI and go to per-CPU
+ * handshake rings served by their own workqueue, so a flood only competes
+ * with other handshakes. Past UNDERTHERADAR_HANDSHAKE_LOAD_THRESHOLD queued
+ * messages the device stays under load for UNDERTHERADAR_UNDER_LOAD_HOLD
+ * and answers initiations without a valid cookie with a cookie reply.
+ */
+static bool undertheradar_handshake_under_load(struct undertheradar_device *wg)
+{
+    unsigned long last;
+    
+    if (atomic_read(&wg->handshake_queue_len) >= UNDERTHERADAR_HANDSHAKE_LOAD_THRESHOLD) {
+        WRITE_ONCE(wg->last_under_load, jiffies);
+        return true;
+    }
+    
+    last = READ_ONCE(wg->last_under_load);
+    return last && time_is_after_jiffies(last + UNDERTHERADAR_UNDER_LOAD_HOLD);
+}
+
+/* Announce every keypair a peer currently holds and retract the ones it
+ * no longer does: rotation inside noise drops the old previous keypair
+ * without telling us, so the last announced set is kept to diff against.
+ * With zeroed, everything announced is retracted.
+ */
+static void undertheradar_session_publish(struct undertheradar_peer *peer, bool zeroed)
+{
+    struct undertheradar_peer_ext *ext = peer->ext;
+    struct noise_keypair *keypair[3];
+    __le32 live[3];
+    unsigned int i, j, count = 0;
+    
+    spin_lock_bh(&peer->lock);
+    if (!zeroed) {
+        rcu_read_lock_bh();
+        keypair[0] = rcu_dereference_bh(peer->keypairs.current_keypair);
+        keypair[1] = rcu_dereference_bh(peer->keypairs.previous_keypair);
+        keypair[2] = rcu_dereference_bh(peer->keypairs.next_keypair);
+        for (i = 0; i < ARRAY_SIZE(keypair); i++) {
+            if (keypair[i])
+                live[count++] = keypair[i]->local_index;
+        }
+        rcu_read_unlock_bh();
+    }
+    
+    for (i = 0; i < ext->session_count; i++) {
+        for (j = 0; j < count && live[j] != ext->session_index[i]; j++)
+            ;
+        if (j == count)
+            undertheradar_session_zeroed(ext->session_index[i]);
+    }
+    
+    /* The map ignores indices it already holds */
+    for (i = 0; i < count; i++)
+        undertheradar_session_established(live[i]);
+    
+    memcpy(ext->session_index, live, count * sizeof(live[0]));
+    ext->session_count = count;
+    spin_unlock_bh(&peer->lock);
+}
+
+/* Handshake messages have fixed sizes; 0 for anything else */
+static size_t undertheradar_handshake_len(u8 type)
+{
+    switch (type) {
+    case MESSAGE_HANDSHAKE_INITIATION:
+        return sizeof(struct message_handshake_initiation);
+    case MESSAGE_HANDSHAKE_RESPONSE:
+        return sizeof(struct message_handshake_response);
+    case MESSAGE_HANDSHAKE_COOKIE:
+        return sizeof(struct message_handshake_cookie);
+    }
+    return 0;
+}
+
+/* encap_rcv only queues messages of exactly their type's size, linear */
+static void undertheradar_handshake_receive(struct undertheradar_device *wg,
+                                            struct sk_buff *skb)
+{
+    enum cookie_mac_state mac_state;
+    struct undertheradar_peer *peer;
+    bool under_load;
+    u8 type;
+    
+    type = ((struct message_header *)skb->data)->type;
+    if (type == MESSAGE_HANDSHAKE_COOKIE) {
+        undertheradar_cookie_message_consume(wg, skb);
+        goto out;
+    }
+    
+    under_load = undertheradar_handshake_under_load(wg);
+    mac_state = cookie_validate_packet(&wg->cookie_checker, skb, under_load);
+    if (under_load && mac_state == VALID_MAC_BUT_NO_COOKIE) {
+        /* Shed load: make the sender prove its address first */
+        undertheradar_packet_send_handshake_cookie(wg, skb,
+                        ((struct message_handshake_initiation *)skb->data)->sender_index);
+        goto out;
+    }
+    if (mac_state != VALID_MAC_BUT_NO_COOKIE && mac_state != VALID_MAC_WITH_COOKIE) {
+        net_dbg_ratelimited("%s: Invalid MAC on handshake message\n", wg->dev->name);
+        goto out;
+    }
+    
+    switch (type) {
+    case MESSAGE_HANDSHAKE_INITIATION:
+        peer = undertheradar_noise_handshake_consume_initiation(wg, skb);
+        if (likely(peer)) {
+            undertheradar_packet_send_handshake_response(peer);
+            undertheradar_session_publish(peer, false);
+            undertheradar_timer_arm(peer, TIMER_ZERO_KEY_MATERIAL,
+                                    REJECT_AFTER_TIME * 3 * HZ);
+        }
+        break;
+    case MESSAGE_HANDSHAKE_RESPONSE:
+        peer = undertheradar_noise_handshake_consume_response(wg, skb);
+        if (likely(peer)) {
+            undertheradar_timer_disarm(peer, TIMER_RETRANSMIT_HANDSHAKE);
+            undertheradar_session_publish(peer, false);
+            undertheradar_timer_arm(peer, TIMER_ZERO_KEY_MATERIAL,
+                                    REJECT_AFTER_TIME * 3 * HZ);
+        }
+        break;
+    }
+    
+out:
+    kfree_skb(skb);
+}
+
+static void undertheradar_handshake_worker(struct work_struct *work)
+{
+    struct crypt_queue_cpu *qc = container_of(work, struct crypt_queue_cpu, work);
+    struct undertheradar_device *wg = qc->queue->wg;
+    struct sk_buff *skb;
+    
+    while ((skb = ptr_ring_consume_bh(&qc->ring)) != NULL) {
+        undertheradar_handshake_receive(wg, skb);
+        atomic_dec(&wg->handshake_queue_len);
+        cond_resched();
+    }
+}
+
+static void undertheradar_handshake_enqueue(struct undertheradar_device *wg,
+                                            struct sk_buff *skb)
+{
+    struct crypt_queue_cpu *qc;
+    int cpu;
+    
+    if (unlikely(atomic_inc_return(&wg->handshake_queue_len) >
+                 UNDERTHERADAR_MAX_QUEUED_HANDSHAKES))
+        goto drop;
+    
+    cpu = undertheradar_cpumask_next_online(&wg->handshake_queue.last_cpu);
+    qc = per_cpu_ptr(wg->handshake_queue.cpu, cpu);
+    if (unlikely(ptr_ring_produce_bh(&qc->ring, skb)))
+        goto drop;
+    
+    queue_work_on(cpu, wg->handshake_wq, &qc->work);
+    return;
+    
+drop:
+    atomic_dec(&wg->handshake_queue_len);
+    net_dbg_ratelimited("%s: Dropping handshake packet, queue full\n",
+                        wg->dev->name);
+    kfree_skb(skb);
+    DEV_STATS_INC(wg->dev, rx_dropped);
+}
+
+static int undertheradar_handshake_init(struct undertheradar_device *wg)
+{
+    int ret;
+    
+    wg->handshake_wq = alloc_workqueue("undertheradar-handshake-%s",
+                                       WQ_CPU_INTENSIVE | WQ_FREEZABLE, 0,
+                                       wg->dev->name);
+    if (!wg->handshake_wq)
+        return -ENOMEM;
+    
+    ret = undertheradar_crypt_queue_init(wg, &wg->handshake_queue,
+                                         undertheradar_handshake_worker);
+    if (ret < 0) {
+        destroy_workqueue(wg->handshake_wq);
+        return ret;
+    }
+    
+    atomic_set(&wg->handshake_queue_len, 0);
+    wg->last_under_load = 0;
+    cookie_checker_init(&wg->cookie_checker, wg);
+    return 0;
+}
+
+static void undertheradar_handshake_uninit(struct undertheradar_device *wg)
+{
+    int cpu;
+    
+    destroy_workqueue(wg->handshake_wq);
+    
+    /* Unlike the crypt rings, handshake rings own their skbs */
+    for_each_possible_cpu(cpu)
+        ptr_ring_cleanup(&per_cpu_ptr(wg->handshake_queue.cpu, cpu)->ring,
+                         undertheradar_skb_free);
+    free_percpu(wg->handshake_queue.cpu);
+}
+
+/* Kill switch implementation */
+static int undertheradar_enable_kill_switch(struct undertheradar_device *wg)
+{
+    struct iptables_rule *rule;
+    int ret;
+    
+    if (wg->kill_switch_enabled)
+        return 0;
+    
+    /* Drop all traffic not going through VPN */
+    rule = iptables_create_rule("-A OUTPUT -o %s -j ACCEPT", wg->dev->name);
+    if (!rule)
+        return -ENOMEM;
+    
+    ret = iptables_add_rule(rule);
+    if (ret < 0) {
+        iptables_free_rule(rule);
+        return ret;
+    }
+    
+    /* Drop all other traffic */
+    rule = iptables_create_rule("-A OUTPUT -j DROP");
+    ret = iptables_add_rule(rule);
+    
+    wg->kill_switch_enabled = true;
+    return ret;
+}
+
+/* DNS leak protection */
+static int undertheradar_setup_secure_dns(struct undertheradar_device *wg)
+{
+    struct dns_config *dns;
+    int ret;
+    
+    dns = kzalloc(sizeof(*dns), GFP_KERNEL);
+    if (!dns)
+        return -ENOMEM;
+    
+    /* Force all DNS through VPN tunnel */
+    dns->servers[0] = "10.0.0.1";  /* Internal DNS */
+    dns->servers[1] = "10.0.0.2";  /* Backup DNS */
+    
+    /* Block all other DNS servers */
+    ret = iptables_block_dns_except(dns->servers, 2);
+    if (ret < 0) {
+        kfree(dns);
+        return ret;
+    }
+    
+    /* Enable DNS-over-HTTPS for extra security */
+    dns->doh_enabled = true;
+    dns->doh_server = "https://dns.undertheradar.work/dns-query";
+    
+    wg->secure_dns = dns;
+    wg->dns_leak_protection = true;
+    
+    return 0;
+}
+
+/* Peer timer wheel. Ticks run from a delayed work; due peers are moved to
+ * fire_list under the lock and their events run outside it, so a tick
+ * costs O(due peers) rather than one kernel timer per event.
+ */
+static unsigned long undertheradar_peer_earliest_deadline(const struct undertheradar_peer_ext *ext)
+{
+    unsigned long earliest = 0;
+    int i;
+    
+    for (i = 0; i < UNDERTHERADAR_TIMER_MAX; ++i) {
+        if (ext->deadline[i] &&
+            (!earliest || time_before(ext->deadline[i], earliest)))
+            earliest = ext->deadline[i];
+    }
+    
+    return earliest;
+}
+
+static void undertheradar_wheel_file(struct undertheradar_timer_wheel *wheel,
+                                     struct undertheradar_peer_ext *ext)
+{
+    unsigned long deadline = undertheradar_peer_earliest_deadline(ext);
+    unsigned long tick, delta;
+    
+    lockdep_assert_held(&wheel->lock);
+    hlist_del_init(&ext->wheel_node);
+    if (!deadline || ext->is_dead)
+        return;
+    
+    tick = DIV_ROUND_UP(deadline, UNDERTHERADAR_WHEEL_TICK);
+    if (time_before(tick, wheel->next_tick))
+        tick = wheel->next_tick;
+    delta = tick - wheel->next_tick;
+    
+    if (delta < UNDERTHERADAR_WHEEL_L0_SIZE) {
+        hlist_add_head(&ext->wheel_node,
+                       &wheel->level0[tick & (UNDERTHERADAR_WHEEL_L0_SIZE - 1)]);
+    } else {
+        /* Far deadlines wait in a coarse slot and cascade down later;
+         * anything beyond the wheel span is clamped and re-filed.
+         */
+        if (delta >= UNDERTHERADAR_WHEEL_L0_SIZE * UNDERTHERADAR_WHEEL_L1_SIZE)
+            tick = wheel->next_tick + UNDERTHERADAR_WHEEL_L0_SIZE *
+                   (UNDERTHERADAR_WHEEL_L1_SIZE - 1);
+        hlist_add_head(&ext->wheel_node,
+                       &wheel->level1[(tick >> UNDERTHERADAR_WHEEL_L0_BITS) &
+                                      (UNDERTHERADAR_WHEEL_L1_SIZE - 1)]);
+    }
+    ext->filed_tick = tick;
+}
+
+static void undertheradar_timer_arm(struct undertheradar_peer *peer,
+                                    enum undertheradar_peer_timer which,
+                                    unsigned long delay)
+{
+    struct undertheradar_timer_wheel *wheel = &peer->device->timers;
+    struct undertheradar_peer_ext *ext = peer->ext;
+    
+    spin_lock_bh(&wheel->lock);
+    ext->deadline[which] = (jiffies + delay) ?: 1;
+    undertheradar_wheel_file(wheel, ext);
+    spin_unlock_bh(&wheel->lock);
+}
+
+static void undertheradar_timer_disarm(struct undertheradar_peer *peer,
+                                       enum undertheradar_peer_timer which)
+{
+    struct undertheradar_timer_wheel *wheel = &peer->device->timers;
+    
+    spin_lock_bh(&wheel->lock);
+    peer->ext->deadline[which] = 0;
+    undertheradar_wheel_file(wheel, peer->ext);
+    spin_unlock_bh(&wheel->lock);
+}
+
+/* Stop all timers for a peer that is being removed */
+static void undertheradar_timer_del_all(struct undertheradar_peer *peer)
+{
+    struct undertheradar_timer_wheel *wheel = &peer->device->timers;
+    struct undertheradar_peer_ext *ext = peer->ext;
+    
+    spin_lock_bh(&wheel->lock);
+    ext->is_dead = true;
+    memset(ext->deadline, 0, sizeof(ext->deadline));
+    hlist_del_init(&ext->wheel_node);
+    hlist_del_init(&ext->fire_node);
+    ext->fire_mask = 0;
+    spin_unlock_bh(&wheel->lock);
+}
+
+/* Advanced connection stability with automatic failover */
+static void undertheradar_peer_check_handshake(struct undertheradar_peer *peer)
+{
+    struct undertheradar_peer_ext *ext = peer->ext;
+    
+    /* If handshake fails, try alternative endpoints */
+    if (ext->handshake_failures > 3) {
+        undertheradar_try_alternative_endpoint(peer);
+    }
+    
+    /* Implement aggressive retry with exponential backoff */
+    ext->handshake_retry_interval = min(ext->handshake_retry_interval * 2,
+                                        MAX_HANDSHAKE_RETRY);
+    
+    undertheradar_packet_send_handshake_initiation(peer);
+    
+    /* Jitter keeps retries from many peers from lining up */
+    undertheradar_timer_arm(peer, TIMER_RETRANSMIT_HANDSHAKE,
+                            ext->handshake_retry_interval +
+                            get_random_u32_below(UNDERTHERADAR_REKEY_JITTER));
+}
+
+static void undertheradar_peer_send_keepalive(struct undertheradar_peer *peer)
+{
+    unsigned long interval = READ_ONCE(peer->ext->persistent_keepalive_interval);
+    
+    undertheradar_packet_send_keepalive(peer);
+    
+    /* Spread keepalives so a restart does not synchronise every peer */
+    if (interval)
+        undertheradar_timer_arm(peer, TIMER_PERSISTENT_KEEPALIVE,
+                                interval + get_random_u32_below(UNDERTHERADAR_KEEPALIVE_JITTER));
+}
+
+static void undertheradar_peer_timers_fire(struct undertheradar_peer *peer,
+                                           unsigned long mask)
+{
+    if (mask & BIT(TIMER_ZERO_KEY_MATERIAL)) {
+        undertheradar_session_publish(peer, true);
+        noise_keypairs_clear(&peer->keypairs);
+    }
+    if (mask & BIT(TIMER_RETRANSMIT_HANDSHAKE))
+        undertheradar_peer_check_handshake(peer);
+    if (mask & BIT(TIMER_PERSISTENT_KEEPALIVE))
+        undertheradar_peer_send_keepalive(peer);
+}
+
+static void undertheradar_wheel_expire_slot(struct undertheradar_timer_wheel *wheel,
+                                            struct hlist_head *slot,
+                                            unsigned long now)
+{
+    struct undertheradar_peer_ext *ext;
+    struct hlist_node *tmp;
+    int i;
+    
+    hlist_for_each_entry_safe(ext, tmp, slot, wheel_node) {
+        for (i = 0; i < UNDERTHERADAR_TIMER_MAX; ++i) {
+            if (ext->deadline[i] && !time_after(ext->deadline[i], now)) {
+                ext->deadline[i] = 0;
+                ext->fire_mask |= BIT(i);
+            }
+        }
+        
+        if (ext->fire_mask && hlist_unhashed(&ext->fire_node))
+            hlist_add_head(&ext->fire_node, &wheel->fire_list);
+        undertheradar_wheel_file(wheel, ext);
+    }
+}
+
+static void undertheradar_wheel_worker(struct work_struct *work)
+{
+    struct undertheradar_timer_wheel *wheel = container_of(to_delayed_work(work),
+                                                           struct undertheradar_timer_wheel,
+                                                           work);
+    unsigned long now = jiffies;
+    unsigned long now_tick = now / UNDERTHERADAR_WHEEL_TICK;
+    struct undertheradar_peer_ext *ext;
+    struct hlist_node *tmp;
+    unsigned long mask;
+    
+    spin_lock_bh(&wheel->lock);
+    
+    /* Catch up on every tick since the last run */
+    while (!time_after(wheel->next_tick, now_tick)) {
+        unsigned long tick = wheel->next_tick;
+        
+        /* Entering a new coarse slot: cascade it into level 0 */
+        if (!(tick & (UNDERTHERADAR_WHEEL_L0_SIZE - 1))) {
+            struct hlist_head *coarse = &wheel->level1[(tick >> UNDERTHERADAR_WHEEL_L0_BITS) &
+                                                       (UNDERTHERADAR_WHEEL_L1_SIZE - 1)];
+            
+            hlist_for_each_entry_safe(ext, tmp, coarse, wheel_node)
+                undertheradar_wheel_file(wheel, ext);
+        }
+        
+        undertheradar_wheel_expire_slot(wheel,
+                                        &wheel->level0[tick & (UNDERTHERADAR_WHEEL_L0_SIZE - 1)],
+                                        now);
+        wheel->next_tick = tick + 1;
+    }
+    
+    /* Fire outside the lock; handlers re-arm through the wheel */
+    rcu_read_lock_bh();
+    while (!hlist_empty(&wheel->fire_list)) {
+        ext = hlist_entry(wheel->fire_list.first, struct undertheradar_peer_ext,
+                          fire_node);
+        hlist_del_init(&ext->fire_node);
+        mask = ext->fire_mask;
+        ext->fire_mask = 0;
+        spin_unlock_bh(&wheel->lock);
+        
+        undertheradar_peer_timers_fire(ext->peer, mask);
+        
+        spin_lock_bh(&wheel->lock);
+    }
+    rcu_read_unlock_bh();
+    spin_unlock_bh(&wheel->lock);
+    
+    queue_delayed_work(system_power_efficient_wq, &wheel->work,
+                       UNDERTHERADAR_WHEEL_TICK);
+}
+
+static void undertheradar_timer_wheel_init(struct undertheradar_timer_wheel *wheel)
+{
+    unsigned long i;
+    
+    spin_lock_init(&wheel->lock);
+    wheel->next_tick = jiffies / UNDERTHERADAR_WHEEL_TICK;
+    for (i = 0; i < UNDERTHERADAR_WHEEL_L0_SIZE; ++i)
+        INIT_HLIST_HEAD(&wheel->level0[i]);
+    for (i = 0; i < UNDERTHERADAR_WHEEL_L1_SIZE; ++i)
+        INIT_HLIST_HEAD(&wheel->level1[i]);
+    INIT_HLIST_HEAD(&wheel->fire_list);
+    INIT_DELAYED_WORK(&wheel->work, undertheradar_wheel_worker);
+    queue_delayed_work(system_power_efficient_wq, &wheel->work,
+                       UNDERTHERADAR_WHEEL_TICK);
+}
+
+/* Peers must already be removed with undertheradar_timer_del_all() */
+static void undertheradar_timer_wheel_uninit(struct undertheradar_timer_wheel *wheel)
+{
+    cancel_delayed_work_sync(&wheel->work);
+}
+
+/* Protocol obfuscation for censorship resistance */
+struct undertheradar_pad_pool {
+    u8 bytes[UNDERTHERADAR_OBFS_POOL_LEN];
+    unsigned int pos;
+};
+
+static DEFINE_PER_CPU(struct undertheradar_pad_pool, undertheradar_pad_pool);
+
+/* Padding only shapes traffic, so one get_random_bytes() per pool refill
+ * is plenty; the pool is consumed with preemption disabled.
+ */
+static void undertheradar_pad_fill(u8 *dst, unsigned int len)
+{
+    struct undertheradar_pad_pool *pool = get_cpu_ptr(&undertheradar_pad_pool);
+    
+    if (!pool->pos || pool->pos + len > UNDERTHERADAR_OBFS_POOL_LEN) {
+        get_random_bytes(pool->bytes, UNDERTHERADAR_OBFS_POOL_LEN);
+        pool->pos = 0;
+    }
+    memcpy(dst, pool->bytes + pool->pos, len);
+    pool->pos += len;
+    
+    put_cpu_ptr(&undertheradar_pad_pool);
+}
+
+/* Word-wide XOR against the repeating 32-byte key; offset carries the key
+ * phase across fragments.
+ */
+static void undertheradar_xor_keystream(u8 *data, unsigned int len,
+                                        const u8 *key, unsigned int *offset)
+{
+    unsigned int off = *offset;
+    
+    while (len && (off & 7)) {
+        *data++ ^= key[off++ % WG_KEY_LEN];
+        len--;
+    }
+    
+    /* Unrolled over a full key period so the compiler can vectorize */
+    while (len >= WG_KEY_LEN && !(off % WG_KEY_LEN)) {
+        put_unaligned(get_unaligned((u64 *)data) ^ get_unaligned((const u64 *)key),
+                      (u64 *)data);
+        put_unaligned(get_unaligned((u64 *)(data + 8)) ^ get_unaligned((const u64 *)(key + 8)),
+                      (u64 *)(data + 8));
+        put_unaligned(get_unaligned((u64 *)(data + 16)) ^ get_unaligned((const u64 *)(key + 16)),
+                      (u64 *)(data + 16));
+        put_unaligned(get_unaligned((u64 *)(data + 24)) ^ get_unaligned((const u64 *)(key + 24)),
+                      (u64 *)(data + 24));
+        data += WG_KEY_LEN;
+        off += WG_KEY_LEN;
+        len -= WG_KEY_LEN;
+    }
+    
+    while (len >= 8) {
+        put_unaligned(get_unaligned((u64 *)data) ^
+                      get_unaligned((const u64 *)(key + off % WG_KEY_LEN)),
+                      (u64 *)data);
+        data += 8;
+        off += 8;
+        len -= 8;
+    }
+    
+    while (len) {
+        *data++ ^= key[off++ % WG_KEY_LEN];
+        len--;
+    }
+    
+    *offset = off;
+}
+
+/* XOR the skb payload in place, walking page frags without linearizing */
+static int undertheradar_xor_skb(struct sk_buff *skb, const u8 *key)
+{
+    unsigned int offset = 0;
+    int i;
+    
+    if (unlikely(skb_has_frag_list(skb)) && skb_linearize(skb))
+        return -ENOMEM;
+    
+    undertheradar_xor_keystream(skb->data, skb_headlen(skb), key, &offset);
+    
+    for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+        const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+        u32 p_off, p_len, copied;
+        struct page *p;
+        
+        skb_frag_foreach_page(frag, skb_frag_off(frag), skb_frag_size(frag),
+                              p, p_off, p_len, copied) {
+            u8 *vaddr = kmap_local_page(p);
+            
+            undertheradar_xor_keystream(vaddr + p_off, p_len, key, &offset);
+            kunmap_local(vaddr);
+        }
+    }
+    
+    return 0;
+}
+
+/* Runs on sealed, already-writable segments; head and tail room come from
+ * dev->needed_headroom/needed_tailroom so neither push nor put reallocates.
+ */
+static int undertheradar_obfuscate_packet(struct sk_buff *skb,
+                                          struct undertheradar_peer *peer)
+{
+    struct obfuscation_header *obfs;
+    struct sk_buff *trailer;
+    unsigned int pad_len;
+    u8 *pad, rnd;
+    
+    /* Add random padding to hide packet patterns */
+    undertheradar_pad_fill(&rnd, 1);
+    pad_len = 1 + (rnd & (UNDERTHERADAR_OBFS_MAX_PAD - 1));
+    
+    if (likely(!skb_is_nonlinear(skb) && skb_tailroom(skb) >= pad_len)) {
+        pad = skb_put(skb, pad_len);
+    } else {
+        if (unlikely(skb_cow_data(skb, pad_len, &trailer) < 0))
+            return -ENOMEM;
+        pad = pskb_put(skb, trailer, pad_len);
+    }
+    undertheradar_pad_fill(pad, pad_len - 1);
+    pad[pad_len - 1] = pad_len;
+    
+    /* XOR with time-based key to prevent pattern detection */
+    if (unlikely(undertheradar_xor_skb(skb, peer->obfuscation_key)))
+        return -ENOMEM;
+    
+    if (unlikely(skb_cow_head(skb, sizeof(*obfs))))
+        return -ENOMEM;
+    
+    /* Make packet look like HTTPS traffic */
+    obfs = (struct obfuscation_header *)skb_push(skb, sizeof(*obfs));
+    obfs->fake_tls_version = htons(0x0303);  /* TLS 1.2 */
+    obfs->fake_content_type = 0x17;          /* Application data */
+    obfs->length = htons(skb->len - sizeof(*obfs));
+    
+    return 0;
+}
+
+/* Endpoint routing. The send path always goes through the per-CPU dst
+ * slots; route lookups happen only on a miss. Invalidation is lazy and
+ * generation based: netdev and redirect events bump a global generation,
+ * endpoint and hop changes bump the affected peer's endpoint_gen.
+ */
+static atomic_t undertheradar_route_gen = ATOMIC_INIT(1);
+
+static void undertheradar_peer_invalidate_route(struct undertheradar_peer *peer)
+{
+    WRITE_ONCE(peer->endpoint_gen, READ_ONCE(peer->endpoint_gen) + 1);
+}
+
+static void undertheradar_peer_set_endpoint(struct undertheradar_peer *peer,
+                                            const struct sockaddr *addr)
+{
+    spin_lock_bh(&peer->lock);
+    if (addr->sa_family == AF_INET)
+        memcpy(&peer->endpoint.addr4, addr, sizeof(peer->endpoint.addr4));
+    else
+        memcpy(&peer->endpoint.addr6, addr, sizeof(peer->endpoint.addr6));
+    undertheradar_peer_invalidate_route(peer);
+    spin_unlock_bh(&peer->lock);
+}
+
+/* Multi-hop VPN chain. Outer datagrams of a multi-hop peer go to the
+ * first hop, which relays them along the chain; the session itself stays
+ * end to end with the peer. Hops are only appended, so the first one is
+ * every multi-hop peer's next hop for the life of the device.
+ */
+static void undertheradar_peer_set_hop(struct undertheradar_peer *peer,
+                                       struct hop_node *hop)
+{
+    struct undertheradar_peer_ext *ext = peer->ext;
+    
+    lockdep_assert_held(&peer->device->device_update_lock);
+    if (ext->hop == hop)
+        return;
+    
+    list_del_init(&ext->hop_peer_list);
+    if (hop)
+        list_add_tail(&ext->hop_peer_list, &hop->peers);
+    
+    spin_lock_bh(&peer->lock);
+    ext->hop = hop;
+    undertheradar_peer_invalidate_route(peer);
+    spin_unlock_bh(&peer->lock);
+}
+
+int undertheradar_add_hop(struct undertheradar_device *wg, const u8 *public_key,
+                          const struct sockaddr *endpoint)
+{
+    struct undertheradar_peer *peer;
+    struct hop_node *hop;
+    bool first;
+    
+    if (endpoint->sa_family != AF_INET && endpoint->sa_family != AF_INET6)
+        return -EAFNOSUPPORT;
+    
+    hop = kzalloc(sizeof(*hop), GFP_KERNEL);
+    if (!hop)
+        return -ENOMEM;
+    
+    memcpy(hop->public_key, public_key, WG_KEY_LEN);
+    if (endpoint->sa_family == AF_INET)
+        memcpy(&hop->endpoint.addr4, endpoint, sizeof(hop->endpoint.addr4));
+    else
+        memcpy(&hop->endpoint.addr6, endpoint, sizeof(hop->endpoint.addr6));
+    INIT_LIST_HEAD(&hop->peers);
+    
+    mutex_lock(&wg->device_update_lock);
+    first = list_empty(&wg->hop_chain);
+    
+    /* Add to chain maintaining order */
+    list_add_tail(&hop->list, &wg->hop_chain);
+    
+    /* Later hops only lengthen the relay path past the first one */
+    if (first) {
+        list_for_each_entry(peer, &wg->peer_list, peer_list) {
+            if (peer->ext->via_hops)
+                undertheradar_peer_set_hop(peer, hop);
+        }
+        WRITE_ONCE(wg->multi_hop_enabled, true);
+    }
+    mutex_unlock(&wg->device_update_lock);
+    
+    return 0;
+}
+
+/* Peers must already be gone */
+static void undertheradar_hop_chain_free(struct undertheradar_device *wg)
+{
+    struct hop_node *hop, *tmp;
+    
+    list_for_each_entry_safe(hop, tmp, &wg->hop_chain, list) {
+        list_del(&hop->list);
+        kfree(hop);
+    }
+    wg->multi_hop_enabled = false;
+}
+
+static void undertheradar_dst_slot_reset(struct undertheradar_dst_slot *slot)
+{
+    dst_release(slot->dst);
+    slot->dst = NULL;
+}
+
+/* Called with BH disabled; returns a held dst or NULL on a miss */
+static struct dst_entry *undertheradar_dst_slot_get(struct undertheradar_peer *peer,
+                                                    struct undertheradar_dst_slot *slot,
+                                                    u32 route_gen)
+{
+    struct dst_entry *dst = slot->dst;
+    
+    if (!dst)
+        return NULL;
+    
+    if (unlikely(slot->route_gen != route_gen ||
+                 slot->endpoint_gen != READ_ONCE(peer->endpoint_gen) ||
+                 (dst->obsolete && !dst_check(dst, slot->cookie)))) {
+        undertheradar_dst_slot_reset(slot);
+        return NULL;
+    }
+    
+    dst_hold(dst);
+    return dst;
+}
+
+/* Called under rcu_read_lock_bh(); slot->endpoint is where the dst leads */
+static struct dst_entry *undertheradar_endpoint_route(struct undertheradar_device *wg,
+                                                      struct undertheradar_peer *peer,
+                                                      struct undertheradar_dst_slot *slot)
+{
+    u32 route_gen = atomic_read(&undertheradar_route_gen);
+    struct dst_entry *dst;
+    struct hop_node *hop;
+    struct socket *sock;
+    struct sock *sk;
+    
+    dst = undertheradar_dst_slot_get(peer, slot, route_gen);
+    if (likely(dst))
+        return dst;
+    
+    /* Miss: snapshot the endpoint, or the next hop's, and resolve it
+     * once for this CPU
+     */
+    spin_lock(&peer->lock);
+    hop = peer->ext->hop;
+    slot->endpoint = hop ? hop->endpoint : peer->endpoint;
+    slot->endpoint_gen = READ_ONCE(peer->endpoint_gen);
+    spin_unlock(&peer->lock);
+    
+    sock = slot->endpoint.addr.sa_family == AF_INET6 ? rcu_dereference_bh(wg->sock6) :
+                                                       rcu_dereference_bh(wg->sock4);
+    if (unlikely(!sock))
+        return ERR_PTR(-ENONET);
+    sk = sock->sk;
+    
+    if (slot->endpoint.addr.sa_family == AF_INET) {
+        struct flowi4 fl = {
+            .daddr = slot->endpoint.addr4.sin_addr.s_addr,
+            .fl4_dport = slot->endpoint.addr4.sin_port,
+            .fl4_sport = htons(wg->listen_port),
+            .flowi4_mark = peer->fwmark,
+            .flowi4_proto = IPPROTO_UDP
+        };
+        struct rtable *rt = ip_route_output_flow(sock_net(sk), &fl, sk);
+        
+        if (IS_ERR(rt))
+            return ERR_CAST(rt);
+        slot->saddr4 = fl.saddr;
+        slot->cookie = 0;
+        dst = &rt->dst;
+    } else {
+        struct flowi6 fl = {
+            .daddr = slot->endpoint.addr6.sin6_addr,
+            .fl6_dport = slot->endpoint.addr6.sin6_port,
+            .fl6_sport = htons(wg->listen_port),
+            .flowi6_mark = peer->fwmark,
+            .flowi6_oif = slot->endpoint.addr6.sin6_scope_id,
+            .flowi6_proto = IPPROTO_UDP
+        };
+        
+        dst = ipv6_stub->ipv6_dst_lookup_flow(sock_net(sk), sk, &fl, NULL);
+        if (IS_ERR(dst))
+            return dst;
+        slot->saddr6 = fl.saddr;
+        slot->cookie = rt6_get_cookie((struct rt6_info *)dst);
+    }
+    
+    slot->route_gen = route_gen;
+    slot->dst = dst;
+    dst_hold(dst);
+    return dst;
+}
+
+static int undertheradar_socket_send_skb_to_peer(struct undertheradar_peer *peer,
+                                                 struct sk_buff *skb)
+{
+    struct undertheradar_device *wg = peer->device;
+    struct undertheradar_dst_slot *slot;
+    struct dst_entry *dst;
+    struct socket *sock;
+    bool ipv6;
+    int ret = 0;
+    
+    rcu_read_lock_bh();
+    slot = this_cpu_ptr(peer->dst_slots);
+    dst = undertheradar_endpoint_route(wg, peer, slot);
+    if (IS_ERR(dst)) {
+        ret = PTR_ERR(dst);
+        net_dbg_ratelimited("%s: No route to peer endpoint\n", wg->dev->name);
+        goto err;
+    }
+    
+    /* The slot's endpoint may be a hop's, in either family */
+    ipv6 = slot->endpoint.addr.sa_family == AF_INET6;
+    sock = ipv6 ? rcu_dereference_bh(wg->sock6) : rcu_dereference_bh(wg->sock4);
+    if (unlikely(!sock)) {
+        dst_release(dst);
+        ret = -ENONET;
+        goto err;
+    }
+    
+    skb->mark = peer->fwmark;
+    if (!ipv6)
+        udp_tunnel_xmit_skb((struct rtable *)dst, sock->sk, skb, slot->saddr4,
+                            slot->endpoint.addr4.sin_addr.s_addr, 0,
+                            ip4_dst_hoplimit(dst), 0, htons(wg->listen_port),
+                            slot->endpoint.addr4.sin_port, false, false);
+    else
+        udp_tunnel6_xmit_skb(dst, sock->sk, skb, skb->dev, &slot->saddr6,
+                             &slot->endpoint.addr6.sin6_addr, 0,
+                             ip6_dst_hoplimit(dst), 0, htons(wg->listen_port),
+                             slot->endpoint.addr6.sin6_port, false);
+    rcu_read_unlock_bh();
+    return 0;
+    
+err:
+    rcu_read_unlock_bh();
+    kfree_skb(skb);
+    PEER_STATS_ADD(peer, tx_errors, 1);
+    return ret;
+}
+
+static int undertheradar_peer_dst_init(struct undertheradar_peer *peer)
+{
+    peer->dst_slots = alloc_percpu(struct undertheradar_dst_slot);
+    return peer->dst_slots ? 0 : -ENOMEM;
+}
+
+static void undertheradar_peer_dst_free(struct undertheradar_peer *peer)
+{
+    int cpu;
+    
+    for_each_possible_cpu(cpu)
+        undertheradar_dst_slot_reset(per_cpu_ptr(peer->dst_slots, cpu));
+    free_percpu(peer->dst_slots);
+}
+
+/* Batched invalidation: any interface or redirect event drops every cached
+ * route in O(1); slots re-resolve lazily on their next send.
+ */
+static int undertheradar_netdev_event(struct notifier_block *nb,
+                                      unsigned long action, void *data)
+{
+    switch (action) {
+    case NETDEV_UP:
+    case NETDEV_DOWN:
+    case NETDEV_CHANGE:
+    case NETDEV_CHANGEADDR:
+    case NETDEV_UNREGISTER:
+        atomic_inc(&undertheradar_route_gen);
+        break;
+    }
+    return NOTIFY_DONE;
+}
+
+static int undertheradar_netevent(struct notifier_block *nb,
+                                  unsigned long action, void *data)
+{
+    if (action == NETEVENT_REDIRECT)
+        atomic_inc(&undertheradar_route_gen);
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block undertheradar_netdev_notifier = {
+    .notifier_call = undertheradar_netdev_event,
+};
+
+static struct notifier_block undertheradar_netevent_notifier = {
+    .notifier_call = undertheradar_netevent,
+};
+
+/* Split a coalesced UDP GRO train back into a list of datagrams */
+static struct sk_buff *undertheradar_rx_split_train(struct undertheradar_device *wg,
+                                                    struct sk_buff *skb)
+{
+    bool ipv6 = skb->protocol == htons(ETH_P_IPV6);
+    struct sk_buff *segs, *next;
+    struct socket *sock;
+    
+    rcu_read_lock_bh();
+    sock = ipv6 ? rcu_dereference_bh(wg->sock6) : rcu_dereference_bh(wg->sock4);
+    if (unlikely(!sock)) {
+        rcu_read_unlock_bh();
+        kfree_skb(skb);
+        return NULL;
+    }
+    
+    /* Segmentation works from the outer headers; encap_rcv left data at
+     * the UDP header, so step back to the MAC header first
+     */
+    __skb_push(skb, -skb_mac_offset(skb));
+    segs = udp_rcv_segment(sock->sk, skb, !ipv6);
+    rcu_read_unlock_bh();
+    
+    if (IS_ERR_OR_NULL(segs))
+        return NULL;
+    
+    /* And back to the UDP header on every datagram, as the rest of
+     * receive expects
+     */
+    skb_list_walk_safe(segs, skb, next) {
+        __skb_pull(skb, skb_transport_offset(skb));
+        udp_post_segment_fix_csum(skb);
+    }
+    return segs;
+}
+
+/* UDP encap receive: queue datagrams (or GRO trains) for NAPI */
+static int undertheradar_udp_encap_rcv(struct sock *sk, struct sk_buff *skb)
+{
+    struct undertheradar_device *wg = rcu_dereference_sk_user_data(sk);
+    u8 _type, *type;
+    
+    /* Steer handshake messages away from the data path */
+    type = skb_header_pointer(skb, sizeof(struct udphdr), sizeof(_type), &_type);
+    if (wg && !skb_is_gso(skb) && type &&
+        *type >= MESSAGE_HANDSHAKE_INITIATION && *type <= MESSAGE_HANDSHAKE_COOKIE) {
+        size_t len = sizeof(struct udphdr) + undertheradar_handshake_len(*type);
+        
+        /* Exact size before anything parses it, MACs and cookie included */
+        if (unlikely(skb->len != len || !pskb_may_pull(skb, len))) {
+            DEV_STATS_INC(wg->dev, rx_length_errors);
+            kfree_skb(skb);
+            return 0;
+        }
+        __skb_pull(skb, sizeof(struct udphdr));
+        undertheradar_handshake_enqueue(wg, skb);
+        return 0;
+    }
+    
+    if (unlikely(!wg || (skb_queue_len(&wg->rx_queue) >= READ_ONCE(wg->rx_queue_limit) &&
+                         !undertheradar_rx_grow(wg)))) {
+        kfree_skb(skb);
+        if (wg) {
+            DEV_STATS_INC(wg->dev, rx_dropped);
+            if (!READ_ONCE(wg->rx_overflowed))
+                WRITE_ONCE(wg->rx_overflowed, true);
+            trace_undertheradar_rx_enqueue(skb_queue_len(&wg->rx_queue), true);
+        }
+        return 0;
+    }
+    
+    /* Softirq context; segments of a train inherit it through skb->cb */
+    PACKET_CB(skb)->rx_cpu = smp_processor_id();
+    skb_queue_tail(&wg->rx_queue, skb);
+    trace_undertheradar_rx_enqueue(skb_queue_len(&wg->rx_queue), false);
+    napi_schedule(&wg->napi);
+    return 0;
+}
+
+/* Network performance optimization. kernel_setsockopt() is gone, so
+ * options are set on the sock directly, as the UDP setsockopt paths do.
+ */
+static void undertheradar_optimize_socket(struct socket *sock)
+{
+    struct sock *sk = sock->sk;
+    int val;
     
     /* Enable TCP_NODELAY equivalent for UDP */
-    val = 1;
-    kernel_setsockopt(sock, SOL_SOCKET, SO_PRIORITY, 
-                      (char *)&val, sizeof(val));
+    sock_set_priority(sk, 1);
     
     /* Increase socket buffers for better throughput */
     val = 16 * 1024 * 1024;  /* 16MB */
-    kernel_setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
-                      (char *)&val, sizeof(val));
-    kernel_setsockopt(sock, SOL_SOCKET, SO_SNDBUF,
-                      (char *)&val, sizeof(val));
+    sock_set_rcvbuf(sk, val);
+    lock_sock(sk);
+    sk->sk_userlocks |= SOCK_SNDBUF_LOCK;
+    WRITE_ONCE(sk->sk_sndbuf, max_t(int, val * 2, SOCK_MIN_SNDBUF));
+    sk->sk_write_space(sk);
+    release_sock(sk);
+    
+    /* Deliver coalesced UDP GRO trains to encap_rcv instead of
+     * one skb per datagram; setup_udp_tunnel_sock() has already
+     * enabled encap, which UDP_GRO would otherwise do
+     */
+    if (UNDERTHERADAR_GRO_ENABLED) {
+        lock_sock(sk);
+        udp_sk(sk)->gro_enabled = 1;
+        udp_sk(sk)->accept_udp_l4 = 1;
+        release_sock(sk);
+    }
     
     /* Enable receive packet steering */
-    sock_enable_rps(sock->sk);
+    sock_enable_rps(sk);
     
     /* CPU affinity for network interrupts */
     undertheradar_set_cpu_affinity(sock);
 }
 
+/* Attach the encap handler and opt in to outer UDP GSO/GRO */
+static void undertheradar_setup_socket(struct undertheradar_device *wg,
+                                       struct socket *sock)
+{
+    struct udp_tunnel_sock_cfg cfg = {
+        .sk_user_data = wg,
+        .encap_type   = UNDERTHERADAR_UDP_ENCAP_TYPE,
+        .encap_rcv    = undertheradar_udp_encap_rcv,
+    };
+    
+    setup_udp_tunnel_sock(dev_net(wg->dev), sock, &cfg);
+    undertheradar_optimize_socket(sock);
+}
+
+/* Allowed-IPs trie: path-compressed binary trie keyed on big-endian address
+ * bits. Readers walk it under rcu_read_lock_bh(); writers hold
+ * device_update_lock and publish with rcu_assign_pointer().
+ */
+static void allowedips_copy_and_assign_cidr(struct allowedips_node *node,
+                                            const u8 *src, u8 cidr, u8 bits)
+{
+    node->cidr = cidr;
+    node->bitlen = bits;
+    node->bit_at_a = cidr / 8U;
+    node->bit_at_b = 7U - (cidr % 8U);
+    memcpy(node->bits, src, bits / 8U);
+    
+    /* Mask off host bits so prefix comparisons are exact */
+    if (cidr < bits) {
+        node->bits[cidr / 8U] &= (0xff00U >> (cidr % 8U)) & 0xff;
+        memset(node->bits + cidr / 8U + 1, 0, bits / 8U - cidr / 8U - 1);
+    }
+}
+
+static __always_inline u8 allowedips_choose(const struct allowedips_node *node,
+                                            const u8 *key)
+{
+    return (key[node->bit_at_a] >> node->bit_at_b) & 1;
+}
+
+static __always_inline u8 allowedips_common_bits(const struct allowedips_node *node,
+                                                 const u8 *key, u8 bits)
+{
+    if (bits == 32) {
+        return 32U - fls(be32_to_cpu(*(const __be32 *)node->bits ^
+                                     *(const __be32 *)key));
+    } else {
+        u64 a = be64_to_cpu(*(const __be64 *)&node->bits[0] ^
+                            *(const __be64 *)&key[0]);
+        
+        if (a)
+            return 64U - fls64(a);
+        return 128U - fls64(be64_to_cpu(*(const __be64 *)&node->bits[8] ^
+                                        *(const __be64 *)&key[8]));
+    }
+}
+
+static __always_inline bool allowedips_prefix_matches(const struct allowedips_node *node,
+                                                      const u8 *key, u8 bits)
+{
+    return allowedips_common_bits(node, key, bits) >= node->cidr;
+}
+
+static void allowedips_connect(struct allowedips_node __rcu **slot,
+                               struct allowedips_node *parent,
+                               struct allowedips_node *node)
+{
+    node->parent_slot = slot;
+    node->parent = parent;
+    rcu_assign_pointer(*slot, node);
+}
+
+static void allowedips_choose_and_connect(struct allowedips_node *parent,
+                                          struct allowedips_node *node)
+{
+    allowedips_connect(&parent->bit[allowedips_choose(parent, node->bits)],
+                       parent, node);
+}
+
+static struct allowedips_node *allowedips_new_node(const u8 *key, u8 cidr, u8 bits)
+{
+    struct allowedips_node *node;
+    
+    node = kzalloc(sizeof(*node), GFP_KERNEL);
+    if (!node)
+        return NULL;
+    
+    INIT_LIST_HEAD(&node->entries);
+    allowedips_copy_and_assign_cidr(node, key, cidr, bits);
+    return node;
+}
+
+/* Find the deepest node whose prefix covers key/cidr; true on exact match */
+static bool allowedips_node_placement(struct allowedips_node __rcu *trie,
+                                      const u8 *key, u8 cidr, u8 bits,
+                                      struct allowedips_node **rnode,
+                                      struct mutex *lock)
+{
+    struct allowedips_node *node = rcu_dereference_protected(trie,
+                                        lockdep_is_held(lock));
+    struct allowedips_node *parent = NULL;
+    bool exact = false;
+    
+    while (node && node->cidr <= cidr &&
+           allowedips_prefix_matches(node, key, bits)) {
+        parent = node;
+        if (parent->cidr == cidr) {
+            exact = true;
+            break;
+        }
+        node = rcu_dereference_protected(parent->bit[allowedips_choose(parent, key)],
+                                         lockdep_is_held(lock));
+    }
+    
+    *rnode = parent;
+    return exact;
+}
+
+static int allowedips_add_entry(struct allowedips_node *node,
+                                struct undertheradar_peer *peer)
+{
+    struct allowedips_entry *entry;
+    
+    /* A peer claims each prefix at most once */
+    list_for_each_entry(entry, &node->entries, node_list) {
+        if (entry->peer == peer)
+            return 0;
+    }
+    
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry)
+        return -ENOMEM;
+    
+    entry->peer = peer;
+    entry->node = node;
+    list_add_tail(&entry->peer_list, &peer->ext->allowed_ips);
+    list_add_tail_rcu(&entry->node_list, &node->entries);
+    return 0;
+}
+
+static int allowedips_insert(struct allowedips_node __rcu **trie, u8 bits,
+                             const u8 *key, u8 cidr,
+                             struct undertheradar_peer *peer,
+                             struct mutex *lock)
+{
+    struct allowedips_node *node, *parent, *down, *newnode;
+    u8 cidr_common;
+    int ret;
+    
+    if (unlikely(cidr > bits || !peer))
+        return -EINVAL;
+    
+    if (!rcu_access_pointer(*trie)) {
+        node = allowedips_new_node(key, cidr, bits);
+        if (!node)
+            return -ENOMEM;
+        ret = allowedips_add_entry(node, peer);
+        if (ret < 0) {
+            kfree(node);
+            return ret;
+        }
+        allowedips_connect(trie, NULL, node);
+        return 0;
+    }
+    
+    if (allowedips_node_placement(*trie, key, cidr, bits, &node, lock))
+        return allowedips_add_entry(node, peer);
+    
+    newnode = allowedips_new_node(key, cidr, bits);
+    if (!newnode)
+        return -ENOMEM;
+    ret = allowedips_add_entry(newnode, peer);
+    if (ret < 0) {
+        kfree(newnode);
+        return ret;
+    }
+    
+    if (!node) {
+        down = rcu_dereference_protected(*trie, lockdep_is_held(lock));
+    } else {
+        const u8 bit = allowedips_choose(node, key);
+        
+        down = rcu_dereference_protected(node->bit[bit], lockdep_is_held(lock));
+        if (!down) {
+            allowedips_connect(&node->bit[bit], node, newnode);
+            return 0;
+        }
+    }
+    
+    cidr_common = min(cidr, allowedips_common_bits(down, key, bits));
+    parent = node;
+    
+    if (newnode->cidr == cidr_common) {
+        /* New prefix sits directly above the existing subtree */
+        allowedips_choose_and_connect(newnode, down);
+        if (!parent)
+            allowedips_connect(trie, NULL, newnode);
+        else
+            allowedips_choose_and_connect(parent, newnode);
+        return 0;
+    }
+    
+    /* Split with an intermediate node that carries no peers */
+    node = allowedips_new_node(newnode->bits, cidr_common, bits);
+    if (!node) {
+        list_del(&list_first_entry(&newnode->entries, struct allowedips_entry,
+                                   node_list)->peer_list);
+        kfree(list_first_entry(&newnode->entries, struct allowedips_entry,
+                               node_list));
+        kfree(newnode);
+        return -ENOMEM;
+    }
+    
+    allowedips_choose_and_connect(node, down);
+    allowedips_choose_and_connect(node, newnode);
+    if (!parent)
+        allowedips_connect(trie, NULL, node);
+    else
+        allowedips_choose_and_connect(parent, node);
+    
+    return 0;
+}
+
+/* Unlink a node left without peers if it has at most one child */
+static void allowedips_prune(struct allowedips_node *node, struct mutex *lock)
+{
+    struct allowedips_node *child, *parent;
+    
+    while (node && list_empty(&node->entries)) {
+        struct allowedips_node *left = rcu_dereference_protected(node->bit[0],
+                                            lockdep_is_held(lock));
+        struct allowedips_node *right = rcu_dereference_protected(node->bit[1],
+                                            lockdep_is_held(lock));
+        
+        if (left && right)
+            return;
+        
+        child = left ?: right;
+        parent = node->parent;
+        if (child) {
+            child->parent_slot = node->parent_slot;
+            child->parent = parent;
+        }
+        rcu_assign_pointer(*node->parent_slot, child);
+        kfree_rcu(node, rcu);
+        
+        /* Intermediate parents may now be redundant as well */
+        node = parent;
+    }
+}
+
+static int undertheradar_allowedips_insert_v4(struct undertheradar_allowedips *table,
+                                              const struct in_addr *ip, u8 cidr,
+                                              struct undertheradar_peer *peer,
+                                              struct mutex *lock)
+{
+    /* Aligned so allowedips_common_bits() can load it as a word */
+    u8 key[4] __aligned(__alignof(u32));
+    
+    memcpy(key, ip, sizeof(key));
+    ++table->seq;
+    return allowedips_insert(&table->root4, 32, key, cidr, peer, lock);
+}
+
+static int undertheradar_allowedips_insert_v6(struct undertheradar_allowedips *table,
+                                              const struct in6_addr *ip, u8 cidr,
+                                              struct undertheradar_peer *peer,
+                                              struct mutex *lock)
+{
+    u8 key[16] __aligned(__alignof(u64));
+    
+    memcpy(key, ip, sizeof(key));
+    ++table->seq;
+    return allowedips_insert(&table->root6, 128, key, cidr, peer, lock);
+}
+
+/* Drop every prefix a peer claims; called before the peer is released */
+static void undertheradar_allowedips_remove_by_peer(struct undertheradar_allowedips *table,
+                                                    struct undertheradar_peer *peer,
+                                                    struct mutex *lock)
+{
+    struct allowedips_entry *entry, *tmp;
+    
+    lockdep_assert_held(lock);
+    ++table->seq;
+    
+    list_for_each_entry_safe(entry, tmp, &peer->ext->allowed_ips, peer_list) {
+        struct allowedips_node *node = entry->node;
+        
+        list_del_rcu(&entry->node_list);
+        list_del(&entry->peer_list);
+        kfree_rcu(entry, rcu);
+        allowedips_prune(node, lock);
+    }
+}
+
+static void allowedips_free_root(struct allowedips_node __rcu **root,
+                                 struct mutex *lock)
+{
+    struct allowedips_node *stack[130], *node, *child;
+    struct allowedips_entry *entry, *tmp;
+    unsigned int len = 0;
+    
+    node = rcu_dereference_protected(*root, lockdep_is_held(lock));
+    RCU_INIT_POINTER(*root, NULL);
+    if (!node)
+        return;
+    
+    /* Depth is bounded by the address length, so a fixed stack suffices */
+    stack[len++] = node;
+    while (len > 0) {
+        node = stack[--len];
+        
+        child = rcu_dereference_protected(node->bit[0], lockdep_is_held(lock));
+        if (child)
+            stack[len++] = child;
+        child = rcu_dereference_protected(node->bit[1], lockdep_is_held(lock));
+        if (child)
+            stack[len++] = child;
+        
+        list_for_each_entry_safe(entry, tmp, &node->entries, node_list) {
+            list_del(&entry->peer_list);
+            kfree_rcu(entry, rcu);
+        }
+        kfree_rcu(node, rcu);
+    }
+}
+
+static void undertheradar_allowedips_init(struct undertheradar_allowedips *table)
+{
+    RCU_INIT_POINTER(table->root4, NULL);
+    RCU_INIT_POINTER(table->root6, NULL);
+    table->seq = 1;
+}
+
+static void undertheradar_allowedips_free(struct undertheradar_allowedips *table,
+                                          struct mutex *lock)
+{
+    ++table->seq;
+    allowedips_free_root(&table->root4, lock);
+    allowedips_free_root(&table->root6, lock);
+}
+
+/* Longest-prefix match; returns the node holding the candidate peers */
+static __always_inline struct allowedips_node *
+allowedips_lookup(struct allowedips_node __rcu *trie, u8 bits, const void *be_ip)
+{
+    /* Aligned so allowedips_common_bits() can load it as a word */
+    u8 key[16] __aligned(__alignof(u64));
+    struct allowedips_node *node, *found = NULL;
+    
+    memcpy(key, be_ip, bits / 8);
+    
+    node = rcu_dereference_bh(trie);
+    while (node && allowedips_prefix_matches(node, key, bits)) {
+        if (!list_empty(&node->entries))
+            found = node;
+        if (node->cidr == bits)
+            break;
+        node = rcu_dereference_bh(node->bit[allowedips_choose(node, key)]);
+    }
+    
+    return found;
+}
+
 /* Intelligent routing with load balancing */
 static struct undertheradar_peer *undertheradar_routing_lookup(
                                     struct undertheradar_device *wg,
                                     struct sk_buff *skb)
 {
-    struct undertheradar_peer *peer, *best_peer = NULL;
+    struct undertheradar_peer *best_peer = NULL;
+    struct allowedips_entry *entry;
+    struct allowedips_node *node;
     u64 lowest_load = U64_MAX;
     
-    /* Find least loaded peer for destination */
-    list_for_each_entry_rcu(peer, &wg->peer_list, peer_list) {
+    /* Longest-prefix match on the inner destination, O(prefix length) */
+    if (skb->protocol == htons(ETH_P_IP))
+        node = allowedips_lookup(wg->peer_allowedips.root4, 32,
+                                 &ip_hdr(skb)->daddr);
+    else if (skb->protocol == htons(ETH_P_IPV6))
+        node = allowedips_lookup(wg->peer_allowedips.root6, 128,
+                                 &ipv6_hdr(skb)->daddr);
+    else
+        return NULL;
+    
+    if (!node)
+        return NULL;
+    
+    /* Find least loaded peer among those claiming the prefix */
+    list_for_each_entry_rcu(entry, &node->entries, node_list) {
+        struct undertheradar_peer *peer = entry->peer;
         u64 load;
         
-        if (!undertheradar_peer_matches_skb(peer, skb))
-            continue;
-        
         /* Calculate peer load based on bandwidth and latency */
-        load = atomic64_read(&peer->tx_bytes) + 
+        load = READ_ONCE(peer->load_estimate) + 
                (peer->last_handshake_rtt * 1000);
         
         if (load < lowest_load) {
@@ -362,7 +2741,409 @@ static struct undertheradar_peer *undertheradar_routing_lookup(
     return best_peer;
 }
 
+/* Peers come from a dedicated slab so they pack densely and stay aligned */
+static struct kmem_cache *undertheradar_peer_cache;
+
+static struct undertheradar_peer *undertheradar_peer_alloc(struct undertheradar_device *wg,
+                                                           const u8 *public_key)
+{
+    struct undertheradar_peer *peer;
+    
+    peer = kmem_cache_zalloc(undertheradar_peer_cache, GFP_KERNEL);
+    if (!peer)
+        return NULL;
+    
+    peer->ext = kzalloc(sizeof(*peer->ext), GFP_KERNEL);
+    if (!peer->ext)
+        goto err_peer;
+    peer->ext->peer = peer;
+    INIT_LIST_HEAD(&peer->ext->allowed_ips);
+    INIT_HLIST_NODE(&peer->ext->wheel_node);
+    INIT_HLIST_NODE(&peer->ext->fire_node);
+    peer->ext->handshake_retry_interval = REKEY_TIMEOUT;
+    
+    INIT_LIST_HEAD(&peer->ext->hop_peer_list);
+    if (undertheradar_peer_dst_init(peer))
+        goto err_ext;
+    if (undertheradar_peer_stats_init(peer))
+        goto err_dst;
+    if (undertheradar_peer_queues_init(wg, peer))
+        goto err_stats;
+    
+    spin_lock_init(&peer->lock);
+    memcpy(peer->public_key, public_key, WG_KEY_LEN);
+    INIT_LIST_HEAD(&peer->peer_list);
+    return peer;
+    
+err_stats:
+    undertheradar_peer_stats_free(peer);
+err_dst:
+    undertheradar_peer_dst_free(peer);
+err_ext:
+    kfree(peer->ext);
+err_peer:
+    kmem_cache_free(undertheradar_peer_cache, peer);
+    return NULL;
+}
+
+static void undertheradar_peer_rcu_free(struct rcu_head *rcu)
+{
+    struct undertheradar_peer *peer = container_of(rcu, struct undertheradar_peer, rcu);
+    
+    undertheradar_peer_stats_free(peer);
+    undertheradar_peer_dst_free(peer);
+    kfree(peer->ext);
+    kmem_cache_free(undertheradar_peer_cache, peer);
+}
+
+/* Unpublish a peer from routing, the peer list and the timer wheel.
+ * Caller holds device_update_lock and waits for a grace period before
+ * undertheradar_peer_free(), so no xmit or poll still holds the peer.
+ */
+static void undertheradar_peer_make_dead(struct undertheradar_peer *peer)
+{
+    undertheradar_allowedips_remove_by_peer(&peer->device->peer_allowedips,
+                                            peer, &peer->device->device_update_lock);
+    list_del_rcu(&peer->peer_list);
+    undertheradar_timer_del_all(peer);
+    undertheradar_peer_set_hop(peer, NULL);
+    undertheradar_session_publish(peer, true);
+    noise_keypairs_clear(&peer->keypairs);
+}
+
+static void undertheradar_peer_free(struct undertheradar_peer *peer)
+{
+    undertheradar_peer_queues_free(peer);
+    call_rcu(&peer->rcu, undertheradar_peer_rcu_free);
+}
+
+/* One grace period for the whole batch rather than one per peer */
+static void undertheradar_peer_remove_all(struct undertheradar_device *wg)
+{
+    struct undertheradar_peer *peer, *tmp;
+    LIST_HEAD(dead_peers);
+    
+    lockdep_assert_held(&wg->device_update_lock);
+    list_for_each_entry_safe(peer, tmp, &wg->peer_list, peer_list) {
+        undertheradar_peer_make_dead(peer);
+        list_add_tail(&peer->peer_list, &dead_peers);
+    }
+    synchronize_net();
+    list_for_each_entry_safe(peer, tmp, &dead_peers, peer_list)
+        undertheradar_peer_free(peer);
+}
+
+static struct undertheradar_peer *undertheradar_peer_find(struct undertheradar_device *wg,
+                                                          const u8 *public_key)
+{
+    struct undertheradar_peer *peer;
+    
+    lockdep_assert_held(&wg->device_update_lock);
+    list_for_each_entry(peer, &wg->peer_list, peer_list) {
+        if (!memcmp(peer->public_key, public_key, WG_KEY_LEN))
+            return peer;
+    }
+    return NULL;
+}
+
+/* Peer configuration, applied by the netlink set-device handler */
+struct undertheradar_allowedip {
+    sa_family_t family;
+    u8 cidr;
+    union {
+        struct in_addr ip4;
+        struct in6_addr ip6;
+    };
+};
+
+struct undertheradar_peer_config {
+    const u8 *public_key;
+    const struct sockaddr *endpoint;    /* NULL keeps the current one */
+    const struct undertheradar_allowedip *allowed_ips;
+    unsigned int num_allowed_ips;
+    bool replace_allowed_ips;
+    u16 persistent_keepalive;           /* seconds, 0 = off */
+    bool via_hops;                      /* relay through the multi-hop chain */
+};
+
+/* Create or update a peer. It is linked before its allowed IPs go into
+ * the trie, so routing only ever returns peers on peer_list; a failed
+ * insert leaves the prefixes added so far, as with WireGuard.
+ */
+int undertheradar_set_peer(struct undertheradar_device *wg,
+                           const struct undertheradar_peer_config *cfg)
+{
+    struct undertheradar_peer *peer;
+    unsigned long keepalive;
+    unsigned int i;
+    int ret = 0;
+    
+    mutex_lock(&wg->device_update_lock);
+    peer = undertheradar_peer_find(wg, cfg->public_key);
+    if (!peer) {
+        peer = undertheradar_peer_alloc(wg, cfg->public_key);
+        if (!peer) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        list_add_tail_rcu(&peer->peer_list, &wg->peer_list);
+    }
+    
+    if (cfg->endpoint)
+        undertheradar_peer_set_endpoint(peer, cfg->endpoint);
+    
+    peer->ext->via_hops = cfg->via_hops;
+    undertheradar_peer_set_hop(peer, cfg->via_hops ?
+                               list_first_entry_or_null(&wg->hop_chain,
+                                                        struct hop_node, list) : NULL);
+    
+    if (cfg->replace_allowed_ips)
+        undertheradar_allowedips_remove_by_peer(&wg->peer_allowedips, peer,
+                                                &wg->device_update_lock);
+    for (i = 0; i < cfg->num_allowed_ips && !ret; ++i) {
+        const struct undertheradar_allowedip *aip = &cfg->allowed_ips[i];
+        
+        if (aip->family == AF_INET)
+            ret = undertheradar_allowedips_insert_v4(&wg->peer_allowedips, &aip->ip4,
+                                                     aip->cidr, peer,
+                                                     &wg->device_update_lock);
+        else if (aip->family == AF_INET6)
+            ret = undertheradar_allowedips_insert_v6(&wg->peer_allowedips, &aip->ip6,
+                                                     aip->cidr, peer,
+                                                     &wg->device_update_lock);
+        else
+            ret = -EAFNOSUPPORT;
+    }
+    
+    keepalive = (unsigned long)cfg->persistent_keepalive * HZ;
+    WRITE_ONCE(peer->ext->persistent_keepalive_interval, keepalive);
+    if (keepalive)
+        undertheradar_timer_arm(peer, TIMER_PERSISTENT_KEEPALIVE, keepalive);
+    else
+        undertheradar_timer_disarm(peer, TIMER_PERSISTENT_KEEPALIVE);
+    
+out:
+    mutex_unlock(&wg->device_update_lock);
+    return ret;
+}
+
+int undertheradar_remove_peer(struct undertheradar_device *wg, const u8 *public_key)
+{
+    struct undertheradar_peer *peer;
+    
+    mutex_lock(&wg->device_update_lock);
+    peer = undertheradar_peer_find(wg, public_key);
+    if (peer) {
+        undertheradar_peer_make_dead(peer);
+        synchronize_net();
+        undertheradar_peer_free(peer);
+    }
+    mutex_unlock(&wg->device_update_lock);
+    
+    return peer ? 0 : -ENOENT;
+}
+
+/* Receive tuning in sysfs. Bounds are checked against each other before
+ * they are published, and the live weight and queue limit are pulled
+ * inside them at once; with adaptive off they then stay where they are.
+ */
+static void undertheradar_rx_clamp(struct undertheradar_device *wg)
+{
+    const struct undertheradar_rx_tuning *t = &wg->rx_tuning;
+    
+    WRITE_ONCE(wg->napi.weight, clamp_t(int, wg->napi.weight, t->napi_weight_min,
+                                        t->napi_weight_max));
+    WRITE_ONCE(wg->rx_queue_limit, clamp(wg->rx_queue_limit, t->rx_queue_min,
+                                         t->rx_queue_max));
+}
+
+static ssize_t undertheradar_rx_store(struct device *d, const char *buf, size_t len,
+                                      size_t offset, u32 lo, u32 hi)
+{
+    struct undertheradar_device *wg = netdev_priv(to_net_dev(d));
+    struct undertheradar_rx_tuning next;
+    u32 val;
+    int ret;
+    
+    ret = kstrtou32(buf, 0, &val);
+    if (ret)
+        return ret;
+    if (val < lo || val > hi)
+        return -EINVAL;
+    
+    mutex_lock(&wg->device_update_lock);
+    next = wg->rx_tuning;
+    *(u32 *)((u8 *)&next + offset) = val;
+    if (next.napi_weight_min > next.napi_weight_max ||
+        next.rx_queue_min > next.rx_queue_max) {
+        ret = -EINVAL;
+    } else {
+        WRITE_ONCE(*(u32 *)((u8 *)&wg->rx_tuning + offset), val);
+        undertheradar_rx_clamp(wg);
+    }
+    mutex_unlock(&wg->device_update_lock);
+    
+    return ret ?: len;
+}
+
+#define UNDERTHERADAR_RX_ATTR(field, lo, hi)                                       \
+static ssize_t field##_show(struct device *d, struct device_attribute *attr,      \
+                            char *buf)                                            \
+{                                                                                 \
+    struct undertheradar_device *wg = netdev_priv(to_net_dev(d));                 \
+                                                                                  \
+    return sysfs_emit(buf, "%u\n", READ_ONCE(wg->rx_tuning.field));               \
+}                                                                                 \
+static ssize_t field##_store(struct device *d, struct device_attribute *attr,     \
+                             const char *buf, size_t len)                         \
+{                                                                                 \
+    return undertheradar_rx_store(d, buf, len,                                    \
+                                  offsetof(struct undertheradar_rx_tuning, field), \
+                                  lo, hi);                                        \
+}                                                                                 \
+static DEVICE_ATTR_RW(field)
+
+UNDERTHERADAR_RX_ATTR(adaptive, 0, 1);
+UNDERTHERADAR_RX_ATTR(napi_weight_min, 1, UNDERTHERADAR_NAPI_WEIGHT_LIMIT);
+UNDERTHERADAR_RX_ATTR(napi_weight_max, 1, UNDERTHERADAR_NAPI_WEIGHT_LIMIT);
+UNDERTHERADAR_RX_ATTR(rx_queue_min, 1, UNDERTHERADAR_QUEUE_LEN_LIMIT);
+UNDERTHERADAR_RX_ATTR(rx_queue_max, 1, UNDERTHERADAR_QUEUE_LEN_LIMIT);
+UNDERTHERADAR_RX_ATTR(busy_poll_usecs, 0, UNDERTHERADAR_BUSY_POLL_MAX_USECS);
+UNDERTHERADAR_RX_ATTR(crypt_on_rx_cpu, 0, 1);
+
+/* Live values, for watching the adaptation */
+static ssize_t napi_weight_show(struct device *d, struct device_attribute *attr,
+                                char *buf)
+{
+    struct undertheradar_device *wg = netdev_priv(to_net_dev(d));
+    
+    return sysfs_emit(buf, "%d\n", READ_ONCE(wg->napi.weight));
+}
+static DEVICE_ATTR_RO(napi_weight);
+
+static ssize_t rx_queue_limit_show(struct device *d, struct device_attribute *attr,
+                                   char *buf)
+{
+    struct undertheradar_device *wg = netdev_priv(to_net_dev(d));
+    
+    return sysfs_emit(buf, "%u\n", READ_ONCE(wg->rx_queue_limit));
+}
+static DEVICE_ATTR_RO(rx_queue_limit);
+
+static ssize_t rx_queue_len_show(struct device *d, struct device_attribute *attr,
+                                 char *buf)
+{
+    struct undertheradar_device *wg = netdev_priv(to_net_dev(d));
+    
+    return sysfs_emit(buf, "%u\n", skb_queue_len_lockless(&wg->rx_queue));
+}
+static DEVICE_ATTR_RO(rx_queue_len);
+
+static struct attribute *undertheradar_rx_attrs[] = {
+    &dev_attr_adaptive.attr,
+    &dev_attr_napi_weight_min.attr,
+    &dev_attr_napi_weight_max.attr,
+    &dev_attr_rx_queue_min.attr,
+    &dev_attr_rx_queue_max.attr,
+    &dev_attr_busy_poll_usecs.attr,
+    &dev_attr_crypt_on_rx_cpu.attr,
+    &dev_attr_napi_weight.attr,
+    &dev_attr_rx_queue_limit.attr,
+    &dev_attr_rx_queue_len.attr,
+    NULL
+};
+
+static const struct attribute_group undertheradar_rx_group = {
+    .name  = "undertheradar",
+    .attrs = undertheradar_rx_attrs,
+};
+
+static int undertheradar_dev_init(struct net_device *dev)
+{
+    struct undertheradar_device *wg = netdev_priv(dev);
+    int ret;
+    
+    /* Reserve outer headers, the obfuscation record header, AEAD padding
+     * and tag, and obfuscation padding, so the TX path never reallocates.
+     */
+    dev->needed_headroom = LL_MAX_HEADER + sizeof(struct ipv6hdr) +
+                           sizeof(struct udphdr) + sizeof(struct message_data) +
+                           sizeof(struct obfuscation_header);
+    dev->needed_tailroom = 16 + CHACHA20POLY1305_AUTHTAG_SIZE +
+                           UNDERTHERADAR_OBFS_MAX_PAD;
+    
+    /* Adaptive receive on, busy poll off, from the historic fixed sizes */
+    wg->rx_tuning = (struct undertheradar_rx_tuning) {
+        .adaptive        = 1,
+        .napi_weight_min = UNDERTHERADAR_NAPI_WEIGHT_MIN,
+        .napi_weight_max = UNDERTHERADAR_NAPI_WEIGHT_MAX,
+        .rx_queue_min    = UNDERTHERADAR_QUEUE_LEN_MIN,
+        .rx_queue_max    = UNDERTHERADAR_QUEUE_LEN_MAX,
+    };
+    wg->rx_queue_limit = UNDERTHERADAR_QUEUE_LEN;
+    
+    wg->dev = dev;
+    mutex_init(&wg->device_update_lock);
+    INIT_LIST_HEAD(&wg->peer_list);
+    INIT_LIST_HEAD(&wg->hop_chain);
+    skb_queue_head_init(&wg->rx_queue);
+    undertheradar_allowedips_init(&wg->peer_allowedips);
+    netif_napi_add_weight(dev, &wg->napi, undertheradar_poll,
+                          UNDERTHERADAR_NAPI_WEIGHT);
+    
+    ret = undertheradar_crypt_init(wg);
+    if (ret < 0)
+        goto err_napi;
+    
+    ret = undertheradar_handshake_init(wg);
+    if (ret < 0)
+        goto err_crypt;
+    
+    undertheradar_timer_wheel_init(&wg->timers);
+    
+    /* Last, so nothing above has to cancel it on failure */
+    INIT_DELAYED_WORK(&wg->load_work, undertheradar_load_worker);
+    queue_delayed_work(system_power_efficient_wq, &wg->load_work,
+                       UNDERTHERADAR_LOAD_INTERVAL);
+    
+    /* ndo_init runs before the kobject is registered */
+    dev->sysfs_groups[0] = &undertheradar_rx_group;
+    return 0;
+    
+err_crypt:
+    undertheradar_crypt_uninit(wg);
+err_napi:
+    netif_napi_del(&wg->napi);
+    return ret;
+}
+
+/* Runs on unregister, after ndo_stop: drop every peer, then the tables */
+static void undertheradar_dev_uninit(struct net_device *dev)
+{
+    struct undertheradar_device *wg = netdev_priv(dev);
+    
+    /* The load worker walks peer_list and re-queues itself */
+    cancel_delayed_work_sync(&wg->load_work);
+    
+    mutex_lock(&wg->device_update_lock);
+    undertheradar_peer_remove_all(wg);
+    undertheradar_allowedips_free(&wg->peer_allowedips, &wg->device_update_lock);
+    undertheradar_hop_chain_free(wg);
+    mutex_unlock(&wg->device_update_lock);
+    
+    /* Every peer has left the wheel, so only its tick work remains */
+    undertheradar_timer_wheel_uninit(&wg->timers);
+    undertheradar_handshake_uninit(wg);
+    
+    /* Peers flushed their work above; nothing feeds the crypt rings now */
+    undertheradar_crypt_uninit(wg);
+    netif_napi_del(&wg->napi);
+    skb_queue_purge(&wg->rx_queue);
+}
+
 static const struct net_device_ops undertheradar_netdev_ops = {
+    .ndo_init               = undertheradar_dev_init,
+    .ndo_uninit             = undertheradar_dev_uninit,
     .ndo_open               = undertheradar_open,
     .ndo_stop               = undertheradar_stop,
     .ndo_start_xmit         = undertheradar_xmit,
@@ -372,18 +3153,46 @@ static const struct net_device_ops undertheradar_netdev_ops = {
 
 static int __init undertheradar_init(void)
 {
+    int ret;
+    
     pr_info("UnderTheRadar VPN Core v%s initializing\n", UNDERTHERADAR_VERSION);
     
+    undertheradar_peer_cache = KMEM_CACHE(undertheradar_peer, SLAB_HWCACHE_ALIGN);
+    if (!undertheradar_peer_cache)
+        return -ENOMEM;
+    
     /* Initialize crypto subsystem */
     undertheradar_crypto_init();
     
+    ret = register_netdevice_notifier(&undertheradar_netdev_notifier);
+    if (ret < 0)
+        goto err_cache;
+    ret = register_netevent_notifier(&undertheradar_netevent_notifier);
+    if (ret < 0)
+        goto err_netdev;
+    
     /* Register network device type */
-    return undertheradar_device_register();
+    ret = undertheradar_device_register();
+    if (ret < 0)
+        goto err_netevent;
+    return 0;
+    
+err_netevent:
+    unregister_netevent_notifier(&undertheradar_netevent_notifier);
+err_netdev:
+    unregister_netdevice_notifier(&undertheradar_netdev_notifier);
+err_cache:
+    kmem_cache_destroy(undertheradar_peer_cache);
+    return ret;
 }
 
 static void __exit undertheradar_exit(void)
 {
     undertheradar_device_unregister();
+    unregister_netevent_notifier(&undertheradar_netevent_notifier);
+    unregister_netdevice_notifier(&undertheradar_netdev_notifier);
+    rcu_barrier();
+    kmem_cache_destroy(undertheradar_peer_cache);
     pr_info("UnderTheRadar VPN Core unloaded\n");
 }
 